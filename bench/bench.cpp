@@ -0,0 +1,496 @@
+// Microbenchmarks for the inner loops of tiling, run with "make bench"
+//
+// Each benchmark does one round of work over its inputs and is repeated
+// until it has run for at least the requested time. Inputs are synthetic
+// or read from the test fixtures, so this must be run from the top of
+// the repository.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <zlib.h>
+#include <atomic>
+#include <set>
+#include <string>
+#include <vector>
+#include "geometry.hpp"
+#include "serial.hpp"
+#include "mvt.hpp"
+#include "pool.hpp"
+#include "memfile.hpp"
+#include "projection.hpp"
+#include "evaluator.hpp"
+#include "read_json.hpp"
+#include "main.hpp"
+#include "options.hpp"
+#include "jsonpull/jsonpull.h"
+
+// Globals that main.cpp would otherwise provide to the kernels.
+// "make test" builds this, so a missing one shows up there.
+int quiet = 1;
+int quiet_progress = 1;
+json_logger logger;
+double progress_interval = 0;
+std::atomic<double> last_progress(0);
+int geometry_scale = 0;
+int cluster_distance = 0;
+std::string attribute_for_id = "";
+compiled_filter const *ingest_filter = NULL;
+int prevent[256];
+int additional[256];
+size_t CPUS = 1;
+size_t TEMP_FILES = 4;
+std::vector<clipbbox> clipbboxes;
+
+void checkdisk(std::vector<struct reader> *) {
+}
+
+bool progress_time() {
+	return false;
+}
+
+struct bench_feature {
+	int t = 0;  // VT_POINT, VT_LINE, or VT_POLYGON
+	drawvec geometry{};
+	std::vector<std::string> keys{};
+	std::vector<serial_val> values{};
+};
+
+// The inputs, loaded once
+static std::vector<bench_feature> countries;
+static std::vector<bench_feature> polygons;  // countries and counties
+static std::vector<bench_feature> lines;     // state boundaries and roads
+static std::string tile_pbf;
+static std::string tile_compressed;
+
+// Keeps the compiler from discarding the results
+static volatile unsigned long long sink = 0;
+
+static double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+static std::string read_file(const char *fname) {
+	gzFile f = gzopen(fname, "rb");  // also reads uncompressed files
+	if (f == NULL) {
+		fprintf(stderr, "%s: can't open; run from the top of the repository\n", fname);
+		exit(EXIT_FAILURE);
+	}
+
+	std::string out;
+	char buf[65536];
+	int n;
+	while ((n = gzread(f, buf, sizeof(buf))) > 0) {
+		out.append(buf, n);
+	}
+	gzclose(f);
+	return out;
+}
+
+static void add_feature(json_object *feature, const char *fname, std::vector<bench_feature> &out) {
+	json_object *geometry = json_hash_get(feature, "geometry");
+	json_object *type = geometry == NULL ? NULL : json_hash_get(geometry, "type");
+	json_object *coordinates = geometry == NULL ? NULL : json_hash_get(geometry, "coordinates");
+	if (type == NULL || type->type != JSON_STRING || coordinates == NULL) {
+		return;
+	}
+
+	int t;
+	for (t = 0; t < GEOM_TYPES; t++) {
+		if (strcmp(type->string, geometry_names[t]) == 0) {
+			break;
+		}
+	}
+	if (t >= GEOM_TYPES) {
+		return;
+	}
+
+	bench_feature bf;
+	bf.t = mb_geometry[t];
+	parse_geometry(t, coordinates, bf.geometry, VT_MOVETO, fname, 0, feature);
+	if (bf.t == VT_POLYGON) {
+		bf.geometry = fix_polygon(bf.geometry);
+	}
+
+	json_object *properties = json_hash_get(feature, "properties");
+	if (properties != NULL && properties->type == JSON_HASH) {
+		for (size_t j = 0; j < properties->length; j++) {
+			serial_val sv;
+			stringify_value(properties->values[j], sv.type, sv.s, fname, 0, feature);
+			if (sv.type >= 0 && sv.type != mvt_null) {
+				bf.keys.push_back(properties->keys[j]->string);
+				bf.values.push_back(sv);
+			}
+		}
+	}
+
+	out.push_back(bf);
+}
+
+// Reads either a FeatureCollection or a sequence of Features
+static void load_geojson(const char *fname, std::vector<bench_feature> &out) {
+	std::string text = read_file(fname);
+	json_pull *jp = json_begin_string(text.c_str());
+
+	json_object *j;
+	while ((j = json_read_tree(jp)) != NULL) {
+		json_object *features = json_hash_get(j, "features");
+		if (features != NULL && features->type == JSON_ARRAY) {
+			for (size_t i = 0; i < features->length; i++) {
+				add_feature(features->array[i], fname, out);
+			}
+		} else {
+			add_feature(j, fname, out);
+		}
+		json_free(j);
+	}
+
+	json_end(jp);
+}
+
+static size_t vertices(std::vector<bench_feature> const &features) {
+	size_t n = 0;
+	for (auto const &f : features) {
+		n += f.geometry.size();
+	}
+	return n;
+}
+
+static mvt_tile make_tile() {
+	mvt_tile tile;
+	mvt_layer layer;
+	layer.name = "countries";
+	layer.version = 2;
+	layer.extent = 4096;
+
+	for (auto const &f : countries) {
+		mvt_feature feature;
+		feature.type = f.t;
+		for (auto const &d : f.geometry) {
+			if (d.op == VT_MOVETO || d.op == VT_LINETO) {
+				feature.geometry.push_back(mvt_geometry(d.op, d.x >> 20, d.y >> 20));
+			} else if (d.op == VT_CLOSEPATH) {
+				feature.geometry.push_back(mvt_geometry(d.op, 0, 0));
+			}
+		}
+		for (size_t i = 0; i < f.keys.size(); i++) {
+			layer.tag(feature, f.keys[i], stringified_to_mvt_value(f.values[i].type, f.values[i].s.c_str()));
+		}
+		layer.features.push_back(feature);
+	}
+
+	tile.layers.push_back(layer);
+	return tile;
+}
+
+// Each benchmark returns the number of units of work it did
+
+static size_t bench_serialize() {
+	static FILE *f = NULL;
+	if (f == NULL) {
+		f = tmpfile();
+		if (f == NULL) {
+			perror("tmpfile");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	rewind(f);
+	std::atomic<long long> pos(0);
+	for (auto const &bf : polygons) {
+		serial_feature sf;
+		sf.t = bf.t;
+		sf.geometry = bf.geometry;
+		sf.metapos = -1;
+		for (size_t i = 0; i < bf.keys.size(); i++) {
+			sf.keys.push_back(i);
+			sf.values.push_back(i);
+		}
+		serialize_feature(f, &sf, &pos, "bench", 0, 0, true);
+	}
+
+	sink += pos;
+	return vertices(polygons);
+}
+
+static size_t bench_deserialize() {
+	static FILE *f = NULL;
+	static size_t count = 0;
+
+	if (f == NULL) {
+		f = tmpfile();
+		if (f == NULL) {
+			perror("tmpfile");
+			exit(EXIT_FAILURE);
+		}
+
+		std::atomic<long long> pos(0);
+		for (auto const &bf : polygons) {
+			serial_feature sf;
+			sf.t = bf.t;
+			sf.geometry = bf.geometry;
+			sf.metapos = -1;
+			serialize_feature(f, &sf, &pos, "bench", 0, 0, true);
+			count++;
+		}
+	}
+
+	rewind(f);
+	std::atomic<long long> pos(0);
+	unsigned initial_x[1] = {0}, initial_y[1] = {0};
+	for (size_t i = 0; i < count; i++) {
+		serial_feature sf = deserialize_feature(f, &pos, NULL, NULL, 0, 0, 0, initial_x, initial_y);
+		sink += sf.geometry.size();
+	}
+	return vertices(polygons);
+}
+
+static size_t bench_clip_lines() {
+	for (auto const &f : lines) {
+		drawvec geom = f.geometry;
+		sink += clip_lines(geom, 1, 5).size();
+	}
+	return vertices(lines);
+}
+
+static size_t bench_simple_clip_poly() {
+	for (auto const &f : polygons) {
+		drawvec geom = f.geometry;
+		sink += simple_clip_poly(geom, 1, 5).size();
+	}
+	return vertices(polygons);
+}
+
+static size_t bench_clean_or_clip_poly() {
+	for (auto const &f : polygons) {
+		drawvec geom = f.geometry;
+		sink += clean_or_clip_poly(geom, 1, 5, true).size();
+	}
+	return vertices(polygons);
+}
+
+static size_t bench_simplify_lines() {
+	drawvec shared_nodes;
+	for (auto const &f : lines) {
+		drawvec geom = f.geometry;
+		sink += simplify_lines(geom, 0, 12, true, 1, 0, shared_nodes).size();
+	}
+	for (auto const &f : polygons) {
+		drawvec geom = f.geometry;
+		sink += simplify_lines(geom, 0, 12, true, 1, 4, shared_nodes).size();
+	}
+	return vertices(lines) + vertices(polygons);
+}
+
+static size_t bench_mvt_encode() {
+	static mvt_tile tile = make_tile();
+	sink += tile.encode().size();
+	return tile.layers[0].features.size();
+}
+
+static size_t bench_mvt_decode() {
+	mvt_tile tile;
+	bool was_compressed;
+	std::string pbf = tile_pbf;
+	if (!tile.decode(pbf, was_compressed)) {
+		fprintf(stderr, "tile didn't decode\n");
+		exit(EXIT_FAILURE);
+	}
+	sink += tile.layers[0].features.size();
+	return tile.layers[0].features.size();
+}
+
+static size_t bench_compress() {
+	std::string out;
+	compress(tile_pbf, out);
+	sink += out.size();
+	return tile_pbf.size();
+}
+
+static size_t bench_decompress() {
+	std::string out;
+	decompress(tile_compressed, out);
+	sink += out.size();
+	return out.size();
+}
+
+static struct memfile *temp_memfile() {
+	char name[] = "/tmp/bench.XXXXXXXX";
+	int fd = mkstemp(name);
+	if (fd < 0) {
+		perror(name);
+		exit(EXIT_FAILURE);
+	}
+	unlink(name);
+
+	struct memfile *m = memfile_open(fd);
+	if (m == NULL) {
+		perror("memfile_open");
+		exit(EXIT_FAILURE);
+	}
+	return m;
+}
+
+static size_t bench_addpool() {
+	struct memfile *pool = temp_memfile();
+	struct memfile *tree = temp_memfile();
+
+	size_t n = 0;
+	for (auto const &f : polygons) {
+		for (size_t i = 0; i < f.keys.size(); i++) {
+			sink += addpool(pool, tree, f.keys[i].c_str(), mvt_string);
+			sink += addpool(pool, tree, f.values[i].s.c_str(), f.values[i].type);
+			n += 2;
+		}
+	}
+
+	memfile_close(pool);
+	memfile_close(tree);
+	return n;
+}
+
+#define GRID 1000
+
+static size_t bench_lonlat2tile() {
+	for (size_t i = 0; i < GRID; i++) {
+		for (size_t j = 0; j < GRID; j++) {
+			long long x, y;
+			lonlat2tile(-180 + 360.0 * i / GRID, -85 + 170.0 * j / GRID, 32, &x, &y);
+			sink += x ^ y;
+		}
+	}
+	return GRID * GRID;
+}
+
+static size_t bench_encode_hilbert() {
+	unsigned x = 1, y = 2;
+	for (size_t i = 0; i < GRID * GRID; i++) {
+		x = x * 1103515245 + 12345;
+		y = y * 1103515245 + 12345;
+		sink += encode_hilbert(x, y);
+	}
+	return GRID * GRID;
+}
+
+static size_t bench_encode_quadkey() {
+	unsigned x = 1, y = 2;
+	for (size_t i = 0; i < GRID * GRID; i++) {
+		x = x * 1103515245 + 12345;
+		y = y * 1103515245 + 12345;
+		sink += encode_quadkey(x, y);
+	}
+	return GRID * GRID;
+}
+
+static size_t bench_evaluate() {
+	static compiled_filter filter = compile_filter(parse_filter("{ \"*\": [ \"any\", [ \">=\", \"pop_est\", 50000000 ], [ \"in\", \"continent\", \"Africa\", \"Oceania\" ], [ \"all\", [ \"has\", \"name\" ], [ \"!=\", \"type\", \"Dependency\" ], [ \"<\", \"$zoom\", 5 ] ] ] }"));
+	static std::string layer = "countries";
+
+	filter_values values;
+	std::set<std::string> exclude;
+	for (auto const &f : countries) {
+		values.clear(filter);
+		for (size_t i = 0; i < f.keys.size(); i++) {
+			int slot = filter.slot(f.keys[i]);
+			if (values.wants(slot)) {
+				values.set_stringified(slot, f.values[i].type, f.values[i].s.c_str());
+			}
+		}
+		values.set_special(filter, false, 0, f.t, 3);
+		sink += evaluate(filter, values, layer, exclude);
+	}
+	return countries.size();
+}
+
+struct benchmark {
+	const char *name;
+	const char *unit;  // what one unit of work is, for the throughput
+	size_t (*run)();
+};
+
+static const benchmark benchmarks[] = {
+	{"serialize_feature", "vertices", bench_serialize},
+	{"deserialize_feature", "vertices", bench_deserialize},
+	{"clip_lines", "vertices", bench_clip_lines},
+	{"simple_clip_poly", "vertices", bench_simple_clip_poly},
+	{"clean_or_clip_poly", "vertices", bench_clean_or_clip_poly},
+	{"simplify_lines", "vertices", bench_simplify_lines},
+	{"mvt_tile::encode", "features", bench_mvt_encode},
+	{"mvt_tile::decode", "features", bench_mvt_decode},
+	{"compress", "bytes", bench_compress},
+	{"decompress", "bytes", bench_decompress},
+	{"addpool", "strings", bench_addpool},
+	{"lonlat2tile", "points", bench_lonlat2tile},
+	{"encode_hilbert", "points", bench_encode_hilbert},
+	{"encode_quadkey", "points", bench_encode_quadkey},
+	{"evaluate", "features", bench_evaluate},
+};
+
+static void usage(char **argv) {
+	fprintf(stderr, "Usage: %s [-t seconds] [name ...]\n", argv[0]);
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv) {
+	double seconds = 1;
+
+	int i;
+	while ((i = getopt(argc, argv, "t:")) != -1) {
+		switch (i) {
+		case 't':
+			seconds = atof(optarg);
+			break;
+
+		default:
+			usage(argv);
+		}
+	}
+
+	load_geojson("tests/ne_110m_admin_0_countries/in.json.gz", countries);
+	polygons = countries;
+	load_geojson("tests/tl_2015_us_county/piscataquis.json", polygons);
+	load_geojson("tests/tl_2015_us_county/somerset.json", polygons);
+	load_geojson("tests/ne_110m_admin_1_states_provinces_lines/in.json", lines);
+	load_geojson("tests/tl_2018_51685_roads/in.json", lines);
+
+	tile_pbf = make_tile().encode();
+	compress(tile_pbf, tile_compressed);
+
+	printf("%-20s %10s %14s %16s\n", "benchmark", "rounds", "ms/round", "throughput");
+
+	for (size_t b = 0; b < sizeof(benchmarks) / sizeof(benchmarks[0]); b++) {
+		if (optind < argc) {
+			bool wanted = false;
+			for (int a = optind; a < argc; a++) {
+				if (strcmp(argv[a], benchmarks[b].name) == 0) {
+					wanted = true;
+				}
+			}
+			if (!wanted) {
+				continue;
+			}
+		}
+
+		// One round first, untimed, to warm up caches and static state
+		benchmarks[b].run();
+
+		size_t rounds = 0;
+		size_t units = 0;
+		double start = now();
+		double elapsed;
+		do {
+			units += benchmarks[b].run();
+			rounds++;
+			elapsed = now() - start;
+		} while (elapsed < seconds);
+
+		printf("%-20s %10zu %14.4f %10.3g %s/s\n", benchmarks[b].name, rounds, elapsed * 1000 / rounds, units / elapsed, benchmarks[b].unit);
+		fflush(stdout);
+	}
+
+	return 0;
+}
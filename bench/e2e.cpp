@@ -0,0 +1,386 @@
+// End-to-end benchmarks of the command-line tools, run with "make bench-e2e"
+//
+// Runs tippecanoe, tile-join, and tippecanoe-decode over a fixed set of
+// tests/ datasets and options, and compares the wall time, CPU time, peak
+// memory, peak temporary disk use, and output size of each against a
+// baseline. Exits with an error if anything got worse by more than its
+// tolerance. Must be run from the top of the repository.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <dirent.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+#include "jsonpull/jsonpull.h"
+
+struct metric {
+	const char *name;
+	double tolerance;  // the fraction by which it may exceed the baseline
+	double slack;	   // and the absolute amount, so that tiny values aren't all noise
+	bool fastest;	   // over several runs, use the smallest value instead of the largest
+};
+
+#define METRICS 5
+static metric metrics[METRICS] = {
+	// Other activity on the machine can only make a run slower, so the fastest run is the fairest
+	{"wall_seconds", 0.25, 0.1, true},
+	{"cpu_seconds", 0.25, 0.1, true},
+	{"max_rss_kb", 0.15, 4096, false},
+	{"temp_peak_bytes", 0.15, 65536, false},
+	{"output_bytes", 0.02, 1024, false},
+};
+
+// $W is the directory for outputs, which later cases may read,
+// and $T is the directory for temporary files
+struct bench_case {
+	const char *name;
+	const char *output;  // in $W
+	const char *command;
+};
+
+static const bench_case cases[] = {
+	{"countries-zg", "countries.mbtiles", "exec ./tippecanoe -q -f -t $T -o $W/countries.mbtiles -zg tests/ne_110m_admin_0_countries/in.json.gz"},
+	{"muni-drop-densest", "muni.mbtiles", "exec ./tippecanoe -q -f -t $T -o $W/muni.mbtiles -z14 -M 20000 --drop-densest-as-needed tests/muni/muni.json"},
+	{"tracts-coalesce", "tracts.mbtiles", "exec ./tippecanoe -q -f -t $T -o $W/tracts.mbtiles -z12 --coalesce --reorder tests/coalesce-tract/tl_2010_06001_tract10.json"},
+	{"counties-shared-borders", "counties.mbtiles", "exec ./tippecanoe -q -f -t $T -o $W/counties.mbtiles -z12 --detect-shared-borders tests/tl_2015_us_county/piscataquis.json tests/tl_2015_us_county/somerset.json"},
+	{"tabblock-z12", "tabblock.mbtiles", "exec ./tippecanoe -q -f -t $T -o $W/tabblock.mbtiles -z12 tests/join-population/tabblock_06001420.json"},
+	{"join-csv", "joined.mbtiles", "exec ./tile-join -q -f -o $W/joined.mbtiles -x GEOID10 -c tests/join-population/population.csv $W/tabblock.mbtiles"},
+	{"decode-tracts", "tracts.json", "exec ./tippecanoe-decode $W/tracts.mbtiles > $W/tracts.json"},
+};
+
+#define CASES (sizeof(cases) / sizeof(cases[0]))
+
+struct measurement {
+	double values[METRICS] = {0, 0, 0, 0, 0};
+	bool present = false;
+};
+
+static double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+// Tippecanoe unlinks its temporary files as soon as it creates them,
+// so they are found through its open file descriptors instead of
+// through the directory. Files that are only mapped, not open, are missed.
+static long long temp_usage(pid_t pid, std::string const &tmpdir) {
+	char dirname[100];
+	snprintf(dirname, sizeof(dirname), "/proc/%d/fd", (int) pid);
+	DIR *d = opendir(dirname);
+	if (d == NULL) {
+		return 0;
+	}
+
+	long long sum = 0;
+	struct dirent *de;
+	while ((de = readdir(d)) != NULL) {
+		std::string fd = std::string(dirname) + "/" + de->d_name;
+		char target[PATH_MAX];
+		ssize_t len = readlink(fd.c_str(), target, sizeof(target) - 1);
+		if (len < 0) {
+			continue;
+		}
+		target[len] = '\0';
+
+		if (strncmp(target, tmpdir.c_str(), tmpdir.size()) == 0 && target[tmpdir.size()] == '/') {
+			struct stat st;
+			if (stat(fd.c_str(), &st) == 0 && S_ISREG(st.st_mode)) {
+				sum += st.st_size;
+			}
+		}
+	}
+
+	closedir(d);
+	return sum;
+}
+
+static measurement run_case(bench_case const &c, std::string const &workdir, std::string const &tmpdir) {
+	setenv("W", workdir.c_str(), 1);
+	setenv("T", tmpdir.c_str(), 1);
+
+	double start = now();
+	pid_t pid = fork();
+	if (pid < 0) {
+		perror("fork");
+		exit(EXIT_FAILURE);
+	}
+	if (pid == 0) {
+		execl("/bin/sh", "sh", "-c", c.command, (char *) NULL);
+		perror("/bin/sh");
+		_exit(127);
+	}
+
+	int status;
+	struct rusage ru;
+	long long temp_peak = 0;
+	while (true) {
+		pid_t r = wait4(pid, &status, WNOHANG, &ru);
+		if (r < 0) {
+			perror("wait4");
+			exit(EXIT_FAILURE);
+		}
+		if (r == pid) {
+			break;
+		}
+
+		temp_peak = std::max(temp_peak, temp_usage(pid, tmpdir));
+		usleep(5000);
+	}
+	double wall = now() - start;
+
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		fprintf(stderr, "%s failed: %s\n", c.name, c.command);
+		exit(EXIT_FAILURE);
+	}
+
+	std::string output = workdir + "/" + c.output;
+	struct stat st;
+	if (stat(output.c_str(), &st) != 0) {
+		perror(output.c_str());
+		exit(EXIT_FAILURE);
+	}
+
+	measurement m;
+	m.values[0] = wall;
+	m.values[1] = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1000000.0 + ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1000000.0;
+	m.values[2] = ru.ru_maxrss;
+	m.values[3] = temp_peak;
+	m.values[4] = st.st_size;
+	m.present = true;
+	return m;
+}
+
+// Returns false if there is no baseline yet
+static bool read_baseline(const char *fname, std::vector<measurement> &baseline) {
+	FILE *f = fopen(fname, "r");
+	if (f == NULL) {
+		if (errno == ENOENT) {
+			return false;
+		}
+		perror(fname);
+		exit(EXIT_FAILURE);
+	}
+
+	json_pull *jp = json_begin_file(f);
+	json_object *j = json_read_tree(jp);
+	if (j == NULL || j->type != JSON_HASH) {
+		fprintf(stderr, "%s: not a JSON object\n", fname);
+		exit(EXIT_FAILURE);
+	}
+
+	json_object *tolerance = json_hash_get(j, "tolerance");
+	json_object *slack = json_hash_get(j, "slack");
+	json_object *case_list = json_hash_get(j, "cases");
+	for (size_t m = 0; m < METRICS; m++) {
+		json_object *t = tolerance == NULL ? NULL : json_hash_get(tolerance, metrics[m].name);
+		if (t != NULL && t->type == JSON_NUMBER) {
+			metrics[m].tolerance = t->number;
+		}
+		json_object *s = slack == NULL ? NULL : json_hash_get(slack, metrics[m].name);
+		if (s != NULL && s->type == JSON_NUMBER) {
+			metrics[m].slack = s->number;
+		}
+	}
+
+	for (size_t c = 0; c < CASES; c++) {
+		json_object *o = case_list == NULL ? NULL : json_hash_get(case_list, cases[c].name);
+		if (o == NULL) {
+			continue;
+		}
+
+		for (size_t m = 0; m < METRICS; m++) {
+			json_object *v = json_hash_get(o, metrics[m].name);
+			if (v == NULL || v->type != JSON_NUMBER) {
+				fprintf(stderr, "%s: %s has no %s\n", fname, cases[c].name, metrics[m].name);
+				exit(EXIT_FAILURE);
+			}
+			baseline[c].values[m] = v->number;
+		}
+		baseline[c].present = true;
+	}
+
+	json_end(jp);
+	fclose(f);
+	return true;
+}
+
+static void write_results(const char *fname, std::vector<measurement> const &results) {
+	FILE *f = fopen(fname, "w");
+	if (f == NULL) {
+		perror(fname);
+		exit(EXIT_FAILURE);
+	}
+
+	fprintf(f, "{\n\t\"tolerance\": {");
+	for (size_t m = 0; m < METRICS; m++) {
+		fprintf(f, "%s \"%s\": %g", m == 0 ? "" : ",", metrics[m].name, metrics[m].tolerance);
+	}
+	fprintf(f, " },\n\t\"slack\": {");
+	for (size_t m = 0; m < METRICS; m++) {
+		fprintf(f, "%s \"%s\": %g", m == 0 ? "" : ",", metrics[m].name, metrics[m].slack);
+	}
+	fprintf(f, " },\n\t\"cases\": {\n");
+	for (size_t c = 0; c < CASES; c++) {
+		fprintf(f, "\t\t\"%s\": {", cases[c].name);
+		for (size_t m = 0; m < METRICS; m++) {
+			fprintf(f, "%s \"%s\": %.*f", m == 0 ? "" : ",", metrics[m].name, m < 2 ? 3 : 0, results[c].values[m]);
+		}
+		fprintf(f, " }%s\n", c + 1 < CASES ? "," : "");
+	}
+	fprintf(f, "\t}\n}\n");
+
+	if (fclose(f) != 0) {
+		perror(fname);
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void remove_files(std::string const &dir) {
+	DIR *d = opendir(dir.c_str());
+	if (d == NULL) {
+		return;
+	}
+	struct dirent *de;
+	while ((de = readdir(d)) != NULL) {
+		if (de->d_name[0] != '.') {
+			unlink((dir + "/" + de->d_name).c_str());
+		}
+	}
+	closedir(d);
+}
+
+static void usage(char **argv) {
+	fprintf(stderr, "Usage: %s [-n runs] [-o results.json] [-u] baseline.json\n", argv[0]);
+	fprintf(stderr, "  -n: run each case this many times and use the fastest times (default 3)\n");
+	fprintf(stderr, "  -o: also write the measurements, in the same form as the baseline\n");
+	fprintf(stderr, "  -u: record the measurements as the new baseline instead of comparing\n");
+	fprintf(stderr, "If the baseline file doesn't exist yet, it is recorded as with -u\n");
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv) {
+	int runs = 3;
+	const char *results_file = NULL;
+	bool update = false;
+
+	int i;
+	while ((i = getopt(argc, argv, "n:o:u")) != -1) {
+		switch (i) {
+		case 'n':
+			runs = atoi(optarg);
+			break;
+
+		case 'o':
+			results_file = optarg;
+			break;
+
+		case 'u':
+			update = true;
+			break;
+
+		default:
+			usage(argv);
+		}
+	}
+
+	if (optind + 1 != argc || runs < 1) {
+		usage(argv);
+	}
+	const char *baseline_file = argv[optind];
+
+	// Timings are only comparable on the same machine, so the baseline
+	// is recorded by the first run rather than kept with the source
+	std::vector<measurement> baseline(CASES);
+	if (!update && !read_baseline(baseline_file, baseline)) {
+		fprintf(stderr, "No baseline in %s yet, so recording one\n", baseline_file);
+		update = true;
+	}
+
+	char workdir_template[] = "/tmp/tippecanoe-e2e.XXXXXXXX";
+	if (mkdtemp(workdir_template) == NULL) {
+		perror(workdir_template);
+		exit(EXIT_FAILURE);
+	}
+	std::string workdir = workdir_template;
+	std::string tmpdir = workdir + "/tmp";
+	if (mkdir(tmpdir.c_str(), 0700) != 0) {
+		perror(tmpdir.c_str());
+		exit(EXIT_FAILURE);
+	}
+
+	std::vector<measurement> results(CASES);
+	for (size_t c = 0; c < CASES; c++) {
+		std::vector<std::vector<double>> values(METRICS);
+		for (int r = 0; r < runs; r++) {
+			measurement m = run_case(cases[c], workdir, tmpdir);
+			for (size_t v = 0; v < METRICS; v++) {
+				values[v].push_back(m.values[v]);
+			}
+		}
+		for (size_t v = 0; v < METRICS; v++) {
+			if (metrics[v].fastest) {
+				results[c].values[v] = *std::min_element(values[v].begin(), values[v].end());
+			} else {
+				results[c].values[v] = *std::max_element(values[v].begin(), values[v].end());
+			}
+		}
+		results[c].present = true;
+	}
+
+	remove_files(tmpdir);
+	rmdir(tmpdir.c_str());
+	remove_files(workdir);
+	rmdir(workdir.c_str());
+
+	if (results_file != NULL) {
+		write_results(results_file, results);
+	}
+	if (update) {
+		write_results(baseline_file, results);
+	}
+
+	size_t regressions = 0;
+	printf("%-24s %-16s %14s %14s %8s\n", "case", "metric", "baseline", "now", "change");
+	for (size_t c = 0; c < CASES; c++) {
+		for (size_t m = 0; m < METRICS; m++) {
+			double now_value = results[c].values[m];
+
+			if (!baseline[c].present) {
+				printf("%-24s %-16s %14s %14.3f\n", cases[c].name, metrics[m].name, "-", now_value);
+				continue;
+			}
+
+			double base = baseline[c].values[m];
+			double change = base > 0 ? (now_value - base) / base * 100 : 0;
+			const char *verdict = "";
+			if (now_value > base * (1 + metrics[m].tolerance) + metrics[m].slack) {
+				verdict = "  REGRESSION";
+				regressions++;
+			} else if (now_value < base * (1 - metrics[m].tolerance) - metrics[m].slack) {
+				verdict = "  improved";
+			}
+
+			printf("%-24s %-16s %14.3f %14.3f %+7.1f%%%s\n", cases[c].name, metrics[m].name, base, now_value, change, verdict);
+		}
+	}
+
+	if (regressions > 0) {
+		fprintf(stderr, "\n*** %zu REGRESSION%s BEYOND TOLERANCE compared to %s ***\n\n", regressions, regressions == 1 ? "" : "S", baseline_file);
+		exit(EXIT_FAILURE);
+	}
+
+	return 0;
+}
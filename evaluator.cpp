@@ -5,41 +5,103 @@
 #include "mvt.hpp"
 #include "evaluator.hpp"
 
-int compare(mvt_value one, json_object *two, bool &fail) {
+void filter_values::set_stringified(int slot, int type, const char *s) {
+	filter_value &v = values[slot];
+
+	if (type == mvt_double) {
+		v.type = mvt_double;
+		v.number = atof(s);
+	} else if (type == mvt_bool) {
+		v.type = mvt_bool;
+		v.boolean = (s[0] == 't');
+	} else if (type == mvt_null) {
+		v.type = mvt_null;
+	} else {
+		v.type = mvt_string;
+		v.string = s;
+	}
+}
+
+void filter_values::set_mvt(int slot, mvt_value const &mv) {
+	filter_value &v = values[slot];
+
+	if (mv.type == mvt_string) {
+		v.type = mvt_string;
+		v.string = mv.string_value.c_str();
+	} else if (mv.type == mvt_double) {
+		v.type = mvt_double;
+		v.number = mv.numeric_value.double_value;
+	} else if (mv.type == mvt_float) {
+		v.type = mvt_double;
+		v.number = mv.numeric_value.float_value;
+	} else if (mv.type == mvt_int) {
+		v.type = mvt_double;
+		v.number = mv.numeric_value.int_value;
+	} else if (mv.type == mvt_uint) {
+		v.type = mvt_double;
+		v.number = mv.numeric_value.uint_value;
+	} else if (mv.type == mvt_sint) {
+		v.type = mvt_double;
+		v.number = mv.numeric_value.sint_value;
+	} else if (mv.type == mvt_bool) {
+		v.type = mvt_bool;
+		v.boolean = mv.numeric_value.bool_value;
+	} else if (mv.type == mvt_null) {
+		v.type = mvt_null;
+	} else {
+		fprintf(stderr, "Internal error: bad mvt type %d\n", mv.type);
+		exit(EXIT_FAILURE);
+	}
+}
+
+// $id, $type, and $zoom, which are set after the real attributes
+// so that attributes with the same names take precedence
+void filter_values::set_special(compiled_filter const &filter, bool has_id, unsigned long long id, int type, int z) {
+	if (has_id && wants(filter.id_slot)) {
+		values[filter.id_slot].type = mvt_double;
+		values[filter.id_slot].number = id;
+	}
+
+	if (wants(filter.type_slot)) {
+		filter_value &v = values[filter.type_slot];
+		v.type = mvt_string;
+
+		if (type == mvt_point) {
+			v.string = "Point";
+		} else if (type == mvt_linestring) {
+			v.string = "LineString";
+		} else if (type == mvt_polygon) {
+			v.string = "Polygon";
+		} else {
+			v.string = "";
+		}
+	}
+
+	if (z >= 0 && wants(filter.zoom_slot)) {
+		values[filter.zoom_slot].type = mvt_double;
+		values[filter.zoom_slot].number = z;
+	}
+}
+
+static int compare(filter_value const &one, filter_constant const &two, bool &fail) {
 	if (one.type == mvt_string) {
-		if (two->type != JSON_STRING) {
+		if (two.type != JSON_STRING) {
 			fail = true;
 			return false;  // string vs non-string
 		}
 
-		return strcmp(one.string_value.c_str(), two->string);
+		return strcmp(one.string, two.string.c_str());
 	}
 
-	if (one.type == mvt_double || one.type == mvt_float || one.type == mvt_int || one.type == mvt_uint || one.type == mvt_sint) {
-		if (two->type != JSON_NUMBER) {
+	if (one.type == mvt_double) {
+		if (two.type != JSON_NUMBER) {
 			fail = true;
 			return false;  // number vs non-number
 		}
 
-		double v;
-		if (one.type == mvt_double) {
-			v = one.numeric_value.double_value;
-		} else if (one.type == mvt_float) {
-			v = one.numeric_value.float_value;
-		} else if (one.type == mvt_int) {
-			v = one.numeric_value.int_value;
-		} else if (one.type == mvt_uint) {
-			v = one.numeric_value.uint_value;
-		} else if (one.type == mvt_sint) {
-			v = one.numeric_value.sint_value;
-		} else {
-			fprintf(stderr, "Internal error: bad mvt type %d\n", one.type);
-			exit(EXIT_FAILURE);
-		}
-
-		if (v < two->number) {
+		if (one.number < two.number) {
 			return -1;
-		} else if (v > two->number) {
+		} else if (one.number > two.number) {
 			return 1;
 		} else {
 			return 0;
@@ -47,17 +109,17 @@ int compare(mvt_value one, json_object *two, bool &fail) {
 	}
 
 	if (one.type == mvt_bool) {
-		if (two->type != JSON_TRUE && two->type != JSON_FALSE) {
+		if (two.type != JSON_TRUE && two.type != JSON_FALSE) {
 			fail = true;
 			return false;  // bool vs non-bool
 		}
 
-		bool b = two->type != JSON_FALSE;
-		return one.numeric_value.bool_value > b;
+		bool b = two.type != JSON_FALSE;
+		return one.boolean > b;
 	}
 
 	if (one.type == mvt_null) {
-		if (two->type != JSON_NULL) {
+		if (two.type != JSON_NULL) {
 			fail = true;
 			return false;  // null vs non-null
 		}
@@ -65,194 +127,106 @@ int compare(mvt_value one, json_object *two, bool &fail) {
 		return 0;  // null equals null
 	}
 
-	fprintf(stderr, "Internal error: bad mvt type %d\n", one.type);
+	fprintf(stderr, "Internal error: bad filter value type %d\n", one.type);
 	exit(EXIT_FAILURE);
 }
 
-bool eval(std::map<std::string, mvt_value> const &feature, json_object *f, std::set<std::string> &exclude_attributes) {
-	if (f == NULL || f->type != JSON_ARRAY) {
-		fprintf(stderr, "Filter is not an array: %s\n", json_stringify(f));
-		exit(EXIT_FAILURE);
-	}
-
-	if (f->length < 1) {
-		fprintf(stderr, "Array too small in filter: %s\n", json_stringify(f));
-		exit(EXIT_FAILURE);
-	}
-
-	if (f->array[0]->type != JSON_STRING) {
-		fprintf(stderr, "Filter operation is not a string: %s\n", json_stringify(f));
-		exit(EXIT_FAILURE);
-	}
-
-	if (strcmp(f->array[0]->string, "has") == 0 ||
-	    strcmp(f->array[0]->string, "!has") == 0) {
-		if (f->length != 2) {
-			fprintf(stderr, "Wrong number of array elements in filter: %s\n", json_stringify(f));
-			exit(EXIT_FAILURE);
-		}
-
-		if (strcmp(f->array[0]->string, "has") == 0) {
-			if (f->array[1]->type != JSON_STRING) {
-				fprintf(stderr, "\"has\" key is not a string: %s\n", json_stringify(f));
-				exit(EXIT_FAILURE);
-			}
-			return feature.count(std::string(f->array[1]->string)) != 0;
-		}
-
-		if (strcmp(f->array[0]->string, "!has") == 0) {
-			if (f->array[1]->type != JSON_STRING) {
-				fprintf(stderr, "\"!has\" key is not a string: %s\n", json_stringify(f));
-				exit(EXIT_FAILURE);
-			}
-			return feature.count(std::string(f->array[1]->string)) == 0;
-		}
+static void warn_once(bool &warned, const char *message, filter_node const &f) {
+	if (!warned) {
+		fprintf(stderr, "Warning: %s: %s\n", message, f.source.c_str());
+		warned = true;
 	}
+}
 
-	if (strcmp(f->array[0]->string, "==") == 0 ||
-	    strcmp(f->array[0]->string, "!=") == 0 ||
-	    strcmp(f->array[0]->string, ">") == 0 ||
-	    strcmp(f->array[0]->string, ">=") == 0 ||
-	    strcmp(f->array[0]->string, "<") == 0 ||
-	    strcmp(f->array[0]->string, "<=") == 0) {
-		if (f->length != 3) {
-			fprintf(stderr, "Wrong number of array elements in filter: %s\n", json_stringify(f));
-			exit(EXIT_FAILURE);
-		}
-		if (f->array[1]->type != JSON_STRING) {
-			fprintf(stderr, "\"!has\" key is not a string: %s\n", json_stringify(f));
-			exit(EXIT_FAILURE);
-		}
-
-		auto ff = feature.find(std::string(f->array[1]->string));
-		if (ff == feature.end()) {
+static bool eval(filter_values const &feature, filter_node const &f, std::set<std::string> &exclude_attributes) {
+	switch (f.op) {
+	case FILTER_HAS:
+		return feature.values[f.slot].type >= 0;
+
+	case FILTER_NOT_HAS:
+		return feature.values[f.slot].type < 0;
+
+	case FILTER_EQ:
+	case FILTER_NE:
+	case FILTER_GT:
+	case FILTER_GE:
+	case FILTER_LT:
+	case FILTER_LE: {
+		filter_value const &v = feature.values[f.slot];
+		if (v.type < 0) {
 			static bool warned = false;
-			if (!warned) {
-				const char *s = json_stringify(f);
-				fprintf(stderr, "Warning: attribute not found for comparison: %s\n", s);
-				free((void *) s);
-				warned = true;
-			}
-			if (strcmp(f->array[0]->string, "!=") == 0) {
+			warn_once(warned, "attribute not found for comparison", f);
+			if (f.op == FILTER_NE) {
 				return true;  //  attributes that aren't found are not equal
 			}
 			return false;  // not found: comparison is false
 		}
 
 		bool fail = false;
-		int cmp = compare(ff->second, f->array[2], fail);
+		int cmp = compare(v, f.constants[0], fail);
 
 		if (fail) {
 			static bool warned = false;
-			if (!warned) {
-				const char *s = json_stringify(f);
-				fprintf(stderr, "Warning: mismatched type in comparison: %s\n", s);
-				free((void *) s);
-				warned = true;
-			}
-			if (strcmp(f->array[0]->string, "!=") == 0) {
+			warn_once(warned, "mismatched type in comparison", f);
+			if (f.op == FILTER_NE) {
 				return true;  // mismatched types are not equal
 			}
 			return false;
 		}
 
-		if (strcmp(f->array[0]->string, "==") == 0) {
+		switch (f.op) {
+		case FILTER_EQ:
 			return cmp == 0;
-		}
-		if (strcmp(f->array[0]->string, "!=") == 0) {
+		case FILTER_NE:
 			return cmp != 0;
-		}
-		if (strcmp(f->array[0]->string, ">") == 0) {
+		case FILTER_GT:
 			return cmp > 0;
-		}
-		if (strcmp(f->array[0]->string, ">=") == 0) {
+		case FILTER_GE:
 			return cmp >= 0;
-		}
-		if (strcmp(f->array[0]->string, "<") == 0) {
+		case FILTER_LT:
 			return cmp < 0;
-		}
-		if (strcmp(f->array[0]->string, "<=") == 0) {
+		default:
 			return cmp <= 0;
 		}
-
-		fprintf(stderr, "Internal error: can't happen: %s\n", json_stringify(f));
-		exit(EXIT_FAILURE);
 	}
 
-	if (strcmp(f->array[0]->string, "all") == 0 ||
-	    strcmp(f->array[0]->string, "any") == 0 ||
-	    strcmp(f->array[0]->string, "none") == 0) {
-		bool v;
-
-		if (strcmp(f->array[0]->string, "all") == 0) {
-			v = true;
-		} else {
-			v = false;
-		}
-
-		for (size_t i = 1; i < f->length; i++) {
-			bool out = eval(feature, f->array[i], exclude_attributes);
-
-			if (strcmp(f->array[0]->string, "all") == 0) {
-				v = v && out;
-				if (!v) {
-					break;
-				}
-			} else {
-				v = v || out;
-				if (v) {
-					break;
-				}
+	case FILTER_ALL:
+		for (size_t i = 0; i < f.children.size(); i++) {
+			if (!eval(feature, f.children[i], exclude_attributes)) {
+				return false;
 			}
 		}
+		return true;
 
-		if (strcmp(f->array[0]->string, "none") == 0) {
-			return !v;
-		} else {
-			return v;
-		}
-	}
-
-	if (strcmp(f->array[0]->string, "in") == 0 ||
-	    strcmp(f->array[0]->string, "!in") == 0) {
-		if (f->length < 2) {
-			fprintf(stderr, "Array too small in filter: %s\n", json_stringify(f));
-			exit(EXIT_FAILURE);
-		}
-
-		if (f->array[1]->type != JSON_STRING) {
-			fprintf(stderr, "\"!has\" key is not a string: %s\n", json_stringify(f));
-			exit(EXIT_FAILURE);
+	case FILTER_ANY:
+	case FILTER_NONE:
+		for (size_t i = 0; i < f.children.size(); i++) {
+			if (eval(feature, f.children[i], exclude_attributes)) {
+				return f.op == FILTER_ANY;
+			}
 		}
+		return f.op == FILTER_NONE;
 
-		auto ff = feature.find(std::string(f->array[1]->string));
-		if (ff == feature.end()) {
+	case FILTER_IN:
+	case FILTER_NOT_IN: {
+		filter_value const &v = feature.values[f.slot];
+		if (v.type < 0) {
 			static bool warned = false;
-			if (!warned) {
-				const char *s = json_stringify(f);
-				fprintf(stderr, "Warning: attribute not found for comparison: %s\n", s);
-				free((void *) s);
-				warned = true;
-			}
-			if (strcmp(f->array[0]->string, "!in") == 0) {
+			warn_once(warned, "attribute not found for comparison", f);
+			if (f.op == FILTER_NOT_IN) {
 				return true;  // attributes that aren't found are not in
 			}
 			return false;  // not found: comparison is false
 		}
 
 		bool found = false;
-		for (size_t i = 2; i < f->length; i++) {
+		for (size_t i = 0; i < f.constants.size(); i++) {
 			bool fail = false;
-			int cmp = compare(ff->second, f->array[i], fail);
+			int cmp = compare(v, f.constants[i], fail);
 
 			if (fail) {
 				static bool warned = false;
-				if (!warned) {
-					const char *s = json_stringify(f);
-					fprintf(stderr, "Warning: mismatched type in comparison: %s\n", s);
-					free((void *) s);
-					warned = true;
-				}
+				warn_once(warned, "mismatched type in comparison", f);
 				cmp = 1;
 			}
 
@@ -262,56 +236,348 @@ bool eval(std::map<std::string, mvt_value> const &feature, json_object *f, std::
 			}
 		}
 
-		if (strcmp(f->array[0]->string, "in") == 0) {
+		if (f.op == FILTER_IN) {
 			return found;
 		} else {
 			return !found;
 		}
 	}
 
-	if (strcmp(f->array[0]->string, "attribute-filter") == 0) {
+	case FILTER_ATTRIBUTE_FILTER:
+		if (!eval(feature, f.children[0], exclude_attributes)) {
+			exclude_attributes.insert(f.attribute);
+		}
+		return true;
+	}
+
+	fprintf(stderr, "Internal error: bad filter operation %d\n", f.op);
+	exit(EXIT_FAILURE);
+}
+
+bool evaluate(compiled_filter const &filter, filter_values const &feature, std::string const &layer, std::set<std::string> &exclude_attributes) {
+	bool ok = true;
+
+	auto f = filter.layers.find(layer);
+	if (f != filter.layers.end()) {
+		ok = eval(feature, f->second, exclude_attributes);
+	}
+
+	if (ok && filter.has_all_layers) {
+		ok = eval(feature, filter.all_layers, exclude_attributes);
+	}
+
+	return ok;
+}
+
+// Evaluate as much of the expression as can be known without the zoom level:
+// 1 if it is true at every zoom, 0 if false at every zoom, -1 if it depends
+static int eval_without_zoom(filter_values const &feature, filter_node const &f) {
+	if (!f.zoom_dependent) {
+		std::set<std::string> exclude_attributes;
+		return eval(feature, f, exclude_attributes);
+	}
+
+	switch (f.op) {
+	case FILTER_ALL: {
+		int ret = 1;
+		for (size_t i = 0; i < f.children.size(); i++) {
+			int v = eval_without_zoom(feature, f.children[i]);
+			if (v == 0) {
+				return 0;
+			}
+			if (v < 0) {
+				ret = -1;
+			}
+		}
+		return ret;
+	}
+
+	case FILTER_ANY:
+	case FILTER_NONE: {
+		int ret = 0;
+		for (size_t i = 0; i < f.children.size(); i++) {
+			int v = eval_without_zoom(feature, f.children[i]);
+			if (v == 1) {
+				ret = 1;
+				break;
+			}
+			if (v < 0) {
+				ret = -1;
+			}
+		}
+		if (f.op == FILTER_NONE && ret >= 0) {
+			return !ret;
+		}
+		return ret;
+	}
+
+	case FILTER_ATTRIBUTE_FILTER:
+		return 1;
+
+	default:
+		return -1;
+	}
+}
+
+// Could the feature pass the filter at any zoom level?
+// If not, it can be dropped before it is ever tiled.
+bool may_pass_filter(compiled_filter const &filter, filter_values const &feature, std::string const &layer) {
+	auto f = filter.layers.find(layer);
+	if (f != filter.layers.end() && eval_without_zoom(feature, f->second) == 0) {
+		return false;
+	}
+
+	if (filter.has_all_layers && eval_without_zoom(feature, filter.all_layers) == 0) {
+		return false;
+	}
+
+	return true;
+}
+
+// Remove the parts of a conjunction that are known to be true
+// for every feature that got through may_pass_filter().
+// Returns whether anything is left that still needs evaluating.
+static bool residue_node(filter_node &f) {
+	if (!f.zoom_dependent && !f.excludes_attributes) {
+		return false;
+	}
+
+	if (f.op == FILTER_ALL) {
+		std::vector<filter_node> children;
+		for (size_t i = 0; i < f.children.size(); i++) {
+			if (residue_node(f.children[i])) {
+				children.push_back(f.children[i]);
+			}
+		}
+		f.children = children;
+		return f.children.size() > 0;
+	}
+
+	return true;
+}
+
+// The part of the filter that still has to be evaluated at tiling time
+compiled_filter zoom_residue(compiled_filter const &filter) {
+	compiled_filter out = filter;
+
+	for (auto f = out.layers.begin(); f != out.layers.end();) {
+		if (residue_node(f->second)) {
+			++f;
+		} else {
+			f = out.layers.erase(f);
+		}
+	}
+
+	if (out.has_all_layers && !residue_node(out.all_layers)) {
+		out.all_layers = filter_node();
+		out.has_all_layers = false;
+	}
+
+	return out;
+}
+
+static int filter_slot(compiled_filter &cf, const char *name) {
+	auto f = cf.slots.find(name);
+	if (f != cf.slots.end()) {
+		return f->second;
+	}
+
+	int slot = cf.attributes.size();
+	cf.attributes.push_back(name);
+	cf.slots.insert(std::pair<std::string, int>(name, slot));
+	return slot;
+}
+
+static filter_constant filter_constant_from_json(json_object *j) {
+	filter_constant c;
+	c.type = j->type;
+
+	if (j->type == JSON_STRING) {
+		c.string = j->string;
+	} else if (j->type == JSON_NUMBER) {
+		c.number = j->number;
+	}
+
+	return c;
+}
+
+static std::string json_source(json_object *f) {
+	const char *s = json_stringify(f);
+	std::string out = s;
+	free((void *) s);
+	return out;
+}
+
+static filter_node compile_expression(json_object *f, compiled_filter &cf) {
+	if (f == NULL || f->type != JSON_ARRAY) {
+		fprintf(stderr, "Filter is not an array: %s\n", json_stringify(f));
+		exit(EXIT_FAILURE);
+	}
+
+	if (f->length < 1) {
+		fprintf(stderr, "Array too small in filter: %s\n", json_stringify(f));
+		exit(EXIT_FAILURE);
+	}
+
+	if (f->array[0]->type != JSON_STRING) {
+		fprintf(stderr, "Filter operation is not a string: %s\n", json_stringify(f));
+		exit(EXIT_FAILURE);
+	}
+
+	const char *op = f->array[0]->string;
+	filter_node n;
+
+	if (strcmp(op, "has") == 0 ||
+	    strcmp(op, "!has") == 0) {
+		if (f->length != 2) {
+			fprintf(stderr, "Wrong number of array elements in filter: %s\n", json_stringify(f));
+			exit(EXIT_FAILURE);
+		}
+
+		if (f->array[1]->type != JSON_STRING) {
+			fprintf(stderr, "\"%s\" key is not a string: %s\n", op, json_stringify(f));
+			exit(EXIT_FAILURE);
+		}
+
+		n.op = strcmp(op, "has") == 0 ? FILTER_HAS : FILTER_NOT_HAS;
+		n.slot = filter_slot(cf, f->array[1]->string);
+		n.zoom_dependent = strcmp(f->array[1]->string, "$zoom") == 0;
+		return n;
+	}
+
+	if (strcmp(op, "==") == 0 ||
+	    strcmp(op, "!=") == 0 ||
+	    strcmp(op, ">") == 0 ||
+	    strcmp(op, ">=") == 0 ||
+	    strcmp(op, "<") == 0 ||
+	    strcmp(op, "<=") == 0) {
 		if (f->length != 3) {
 			fprintf(stderr, "Wrong number of array elements in filter: %s\n", json_stringify(f));
 			exit(EXIT_FAILURE);
 		}
+		if (f->array[1]->type != JSON_STRING) {
+			fprintf(stderr, "\"%s\" key is not a string: %s\n", op, json_stringify(f));
+			exit(EXIT_FAILURE);
+		}
+
+		if (strcmp(op, "==") == 0) {
+			n.op = FILTER_EQ;
+		} else if (strcmp(op, "!=") == 0) {
+			n.op = FILTER_NE;
+		} else if (strcmp(op, ">") == 0) {
+			n.op = FILTER_GT;
+		} else if (strcmp(op, ">=") == 0) {
+			n.op = FILTER_GE;
+		} else if (strcmp(op, "<") == 0) {
+			n.op = FILTER_LT;
+		} else {
+			n.op = FILTER_LE;
+		}
+
+		n.slot = filter_slot(cf, f->array[1]->string);
+		n.zoom_dependent = strcmp(f->array[1]->string, "$zoom") == 0;
+		n.constants.push_back(filter_constant_from_json(f->array[2]));
+		n.source = json_source(f);
+		return n;
+	}
+
+	if (strcmp(op, "all") == 0 ||
+	    strcmp(op, "any") == 0 ||
+	    strcmp(op, "none") == 0) {
+		if (strcmp(op, "all") == 0) {
+			n.op = FILTER_ALL;
+		} else if (strcmp(op, "any") == 0) {
+			n.op = FILTER_ANY;
+		} else {
+			n.op = FILTER_NONE;
+		}
+
+		for (size_t i = 1; i < f->length; i++) {
+			n.children.push_back(compile_expression(f->array[i], cf));
+			n.zoom_dependent |= n.children.back().zoom_dependent;
+			n.excludes_attributes |= n.children.back().excludes_attributes;
+		}
+		return n;
+	}
+
+	if (strcmp(op, "in") == 0 ||
+	    strcmp(op, "!in") == 0) {
+		if (f->length < 2) {
+			fprintf(stderr, "Array too small in filter: %s\n", json_stringify(f));
+			exit(EXIT_FAILURE);
+		}
 
 		if (f->array[1]->type != JSON_STRING) {
-			fprintf(stderr, "\"attribute-filter\" key is not a string: %s\n", json_stringify(f));
+			fprintf(stderr, "\"%s\" key is not a string: %s\n", op, json_stringify(f));
 			exit(EXIT_FAILURE);
 		}
 
-		bool ok = eval(feature, f->array[2], exclude_attributes);
-		if (!ok) {
-			exclude_attributes.insert(f->array[1]->string);
+		n.op = strcmp(op, "in") == 0 ? FILTER_IN : FILTER_NOT_IN;
+		n.slot = filter_slot(cf, f->array[1]->string);
+		n.zoom_dependent = strcmp(f->array[1]->string, "$zoom") == 0;
+		for (size_t i = 2; i < f->length; i++) {
+			n.constants.push_back(filter_constant_from_json(f->array[i]));
+		}
+		n.source = json_source(f);
+		return n;
+	}
+
+	if (strcmp(op, "attribute-filter") == 0) {
+		if (f->length != 3) {
+			fprintf(stderr, "Wrong number of array elements in filter: %s\n", json_stringify(f));
+			exit(EXIT_FAILURE);
 		}
 
-		return true;
+		if (f->array[1]->type != JSON_STRING) {
+			fprintf(stderr, "\"attribute-filter\" key is not a string: %s\n", json_stringify(f));
+			exit(EXIT_FAILURE);
+		}
+
+		n.op = FILTER_ATTRIBUTE_FILTER;
+		n.attribute = f->array[1]->string;
+		n.children.push_back(compile_expression(f->array[2], cf));
+		n.zoom_dependent = n.children.back().zoom_dependent;
+		n.excludes_attributes = true;
+		return n;
 	}
 
 	fprintf(stderr, "Unknown filter %s\n", json_stringify(f));
 	exit(EXIT_FAILURE);
 }
 
-bool evaluate(std::map<std::string, mvt_value> const &feature, std::string const &layer, json_object *filter, std::set<std::string> &exclude_attributes) {
+// Check the filter and turn it into a tree of operations whose
+// attribute references are resolved to slots in a filter_values
+compiled_filter compile_filter(json_object *filter) {
 	if (filter == NULL || filter->type != JSON_HASH) {
 		fprintf(stderr, "Error: filter is not a hash: %s\n", json_stringify(filter));
 		exit(EXIT_FAILURE);
 	}
 
-	bool ok = true;
-	json_object *f;
+	compiled_filter cf;
 
-	f = json_hash_get(filter, layer.c_str());
-	if (ok && f != NULL) {
-		ok = eval(feature, f, exclude_attributes);
-	}
+	for (size_t i = 0; i < filter->length; i++) {
+		if (filter->keys[i]->type != JSON_STRING) {
+			continue;
+		}
 
-	f = json_hash_get(filter, "*");
-	if (ok && f != NULL) {
-		ok = eval(feature, f, exclude_attributes);
+		// As with json_hash_get(), the first of any duplicate keys is the one that counts
+		filter_node n = compile_expression(filter->values[i], cf);
+
+		if (strcmp(filter->keys[i]->string, "*") == 0) {
+			if (!cf.has_all_layers) {
+				cf.all_layers = n;
+				cf.has_all_layers = true;
+			}
+		} else {
+			cf.layers.insert(std::pair<std::string, filter_node>(filter->keys[i]->string, n));
+		}
 	}
 
-	return ok;
+	cf.id_slot = cf.slot("$id");
+	cf.type_slot = cf.slot("$type");
+	cf.zoom_slot = cf.slot("$zoom");
+
+	return cf;
 }
 
 json_object *read_filter(const char *fname) {
@@ -322,6 +588,7 @@ json_object *read_filter(const char *fname) {
 	}
 
 	json_pull *jp = json_begin_file(fp);
+	json_disable_arena(jp);  // the filter outlives the parser
 	json_object *filter = json_read_tree(jp);
 	if (filter == NULL) {
 		fprintf(stderr, "%s: %s\n", fname, jp->error);
@@ -335,6 +602,7 @@ json_object *read_filter(const char *fname) {
 
 json_object *parse_filter(const char *s) {
 	json_pull *jp = json_begin_string(s);
+	json_disable_arena(jp);  // the filter outlives the parser
 	json_object *filter = json_read_tree(jp);
 	if (filter == NULL) {
 		fprintf(stderr, "Could not parse filter %s\n", s);
@@ -1,13 +1,107 @@
 #ifndef EVALUATOR_HPP
-#define EVALUATOR HPP
+#define EVALUATOR_HPP
 
 #include <map>
 #include <string>
 #include <set>
+#include <vector>
 #include "jsonpull/jsonpull.h"
 #include "mvt.hpp"
 
-bool evaluate(std::map<std::string, mvt_value> const &feature, std::string const &layer, json_object *filter, std::set<std::string> &exclude_attributes);
+enum filter_op {
+	FILTER_HAS,
+	FILTER_NOT_HAS,
+	FILTER_EQ,
+	FILTER_NE,
+	FILTER_GT,
+	FILTER_GE,
+	FILTER_LT,
+	FILTER_LE,
+	FILTER_ALL,
+	FILTER_ANY,
+	FILTER_NONE,
+	FILTER_IN,
+	FILTER_NOT_IN,
+	FILTER_ATTRIBUTE_FILTER,
+};
+
+// A constant from the filter expression, parsed once when the filter is compiled
+struct filter_constant {
+	int type = JSON_NULL;  // JSON_STRING, JSON_NUMBER, JSON_TRUE, JSON_FALSE, JSON_NULL, or other
+	std::string string = "";
+	double number = 0;
+};
+
+struct filter_node {
+	int op = FILTER_ALL;
+	int slot = -1;		     // which attribute value the comparison looks at
+	std::string attribute = "";  // for attribute-filter, the attribute to exclude
+	std::vector<filter_constant> constants{};
+	std::vector<filter_node> children{};
+	std::string source = "";  // the original expression, for warnings
+
+	bool zoom_dependent = false;	   // looks at $zoom, so must be evaluated per zoom level
+	bool excludes_attributes = false;  // contains an attribute-filter
+};
+
+// An attribute value for filtering. Strings are not copied, so they must
+// outlive the evaluation.
+struct filter_value {
+	int type = -1;	// mvt_string, mvt_double, mvt_bool, mvt_null, or -1 if not present
+	const char *string = NULL;
+	double number = 0;
+	bool boolean = false;
+};
+
+struct compiled_filter {
+	std::vector<std::string> attributes{};	// the attribute for each slot
+	std::map<std::string, int> slots{};
+	std::map<std::string, filter_node> layers{};
+	bool has_all_layers = false;
+	filter_node all_layers{};
+
+	int id_slot = -1;
+	int type_slot = -1;
+	int zoom_slot = -1;
+
+	bool empty() const {
+		return layers.size() == 0 && !has_all_layers;
+	}
+
+	// The slot for an attribute name, or -1 if the filter doesn't look at it
+	int slot(std::string const &name) const {
+		auto f = slots.find(name);
+		if (f == slots.end()) {
+			return -1;
+		}
+		return f->second;
+	}
+};
+
+// The attribute values of one feature, indexed by slot. The first value
+// set for each slot is the one that counts.
+struct filter_values {
+	std::vector<filter_value> values{};
+
+	void clear(compiled_filter const &filter) {
+		values.clear();
+		values.resize(filter.attributes.size());
+	}
+
+	bool wants(int slot) const {
+		return slot >= 0 && values[slot].type < 0;
+	}
+
+	void set_stringified(int slot, int type, const char *s);
+	void set_mvt(int slot, mvt_value const &v);
+	// z is -1 if the zoom level is not known yet
+	void set_special(compiled_filter const &filter, bool has_id, unsigned long long id, int type, int z);
+};
+
+compiled_filter compile_filter(json_object *filter);
+bool evaluate(compiled_filter const &filter, filter_values const &feature, std::string const &layer, std::set<std::string> &exclude_attributes);
+bool may_pass_filter(compiled_filter const &filter, filter_values const &feature, std::string const &layer);
+compiled_filter zoom_residue(compiled_filter const &filter);
 json_object *parse_filter(const char *s);
 json_object *read_filter(const char *fname);
 
@@ -0,0 +1,73 @@
+#ifndef FILTER_PLUGIN_H
+#define FILTER_PLUGIN_H
+
+// The interface for shared-library filters loaded with --filter-plugin.
+//
+// The library must define
+//
+//	int tippecanoe_filter(const struct tippecanoe_filter_host *host, struct tippecanoe_filter_feature *feature);
+//
+// which is called for each feature as it is added to each tile, from all the
+// tiling threads at once. It returns nonzero to keep the feature or 0 to drop it.
+//
+// It may also define
+//
+//	int tippecanoe_filter_init(const struct tippecanoe_filter_host *host);
+//
+// which is called once when the library is loaded, and returns nonzero on success.
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define TIPPECANOE_FILTER_VERSION 1
+
+// Attribute types, numbered as in the vector tile value types
+#define TIPPECANOE_FILTER_STRING 0
+#define TIPPECANOE_FILTER_NUMBER 2
+#define TIPPECANOE_FILTER_BOOL 6
+#define TIPPECANOE_FILTER_NULL 7
+
+// Geometry types and operations, as in vector tiles
+#define TIPPECANOE_FILTER_POINT 1
+#define TIPPECANOE_FILTER_LINESTRING 2
+#define TIPPECANOE_FILTER_POLYGON 3
+
+#define TIPPECANOE_FILTER_MOVETO 1
+#define TIPPECANOE_FILTER_LINETO 2
+#define TIPPECANOE_FILTER_CLOSEPATH 7
+
+struct tippecanoe_filter_feature;
+
+// Strings returned by these functions point into tippecanoe's own storage
+// and are valid until the filter returns or sets or removes an attribute.
+// Coordinates are in the 32-bit world coordinate space of the tile pyramid.
+struct tippecanoe_filter_host {
+	int version;
+
+	const char *(*layer)(struct tippecanoe_filter_feature *feature);
+	int (*type)(struct tippecanoe_filter_feature *feature);
+	int (*zoom)(struct tippecanoe_filter_feature *feature);
+	int (*has_id)(struct tippecanoe_filter_feature *feature);
+	unsigned long long (*id)(struct tippecanoe_filter_feature *feature);
+
+	size_t (*geometry_count)(struct tippecanoe_filter_feature *feature);
+	void (*geometry)(struct tippecanoe_filter_feature *feature, size_t i, int *op, long long *x, long long *y);
+
+	size_t (*attribute_count)(struct tippecanoe_filter_feature *feature);
+	void (*attribute)(struct tippecanoe_filter_feature *feature, size_t i, const char **key, int *type, const char **value);
+	// Numbers and booleans are set from their string form, like "3.5" or "true"
+	void (*set_attribute)(struct tippecanoe_filter_feature *feature, const char *key, int type, const char *value);
+	void (*remove_attribute)(struct tippecanoe_filter_feature *feature, const char *key);
+};
+
+typedef int (*tippecanoe_filter_function)(const struct tippecanoe_filter_host *host, struct tippecanoe_filter_feature *feature);
+typedef int (*tippecanoe_filter_init_function)(const struct tippecanoe_filter_host *host);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
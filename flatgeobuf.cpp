@@ -1,4 +1,9 @@
 #include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <algorithm>
 #include "serial.hpp"
 #include <iostream>
 #include "projection.hpp"
@@ -37,6 +42,74 @@ uint64_t PackedRTreeSize(const uint64_t numItems, const uint16_t nodeSize)
     return numNodes * sizeof(NodeItem);
 }
 
+// A feature found in the index: where it is, and its position in the file
+struct fgb_indexed_feature {
+	uint64_t offset;
+	long long sequence;
+
+	bool operator<(const fgb_indexed_feature &o) const {
+		return offset < o.offset;
+	}
+};
+
+// Search the packed Hilbert R-tree for the features whose bounding boxes
+// intersect the specified box, following
+// https://github.com/flatgeobuf/flatgeobuf/blob/master/src/cpp/packedrtree.cpp
+// Feature offsets are relative to the start of the features.
+std::vector<fgb_indexed_feature> PackedRTreeSearch(const char *index, const uint64_t numItems, const uint16_t nodeSize, double minX, double minY, double maxX, double maxY) {
+	// Level 0 is the leaves, at the end; the root is the only node in the last level, at the start
+	std::vector<std::pair<uint64_t, uint64_t>> levelBounds;
+	{
+		std::vector<uint64_t> levelNumNodes;
+		uint64_t n = numItems;
+		uint64_t numNodes = n;
+		levelNumNodes.push_back(n);
+		do {
+			n = (n + nodeSize - 1) / nodeSize;
+			numNodes += n;
+			levelNumNodes.push_back(n);
+		} while (n != 1);
+
+		uint64_t offset = numNodes;
+		for (auto size : levelNumNodes) {
+			offset -= size;
+			levelBounds.push_back(std::pair<uint64_t, uint64_t>(offset, offset + size));
+		}
+	}
+
+	uint64_t leafNodesOffset = levelBounds[0].first;
+	std::vector<fgb_indexed_feature> out;
+	std::vector<std::pair<uint64_t, size_t>> queue;  // node index, level
+	queue.push_back(std::pair<uint64_t, size_t>(0, levelBounds.size() - 1));
+
+	for (size_t q = 0; q < queue.size(); q++) {
+		uint64_t nodeIndex = queue[q].first;
+		size_t level = queue[q].second;
+		uint64_t end = std::min(nodeIndex + nodeSize, levelBounds[level].second);
+
+		for (uint64_t pos = nodeIndex; pos < end; pos++) {
+			NodeItem node;
+			memcpy(&node, index + pos * sizeof(NodeItem), sizeof(NodeItem));
+
+			if (maxX < node.minX || maxY < node.minY || minX > node.maxX || minY > node.maxY) {
+				continue;
+			}
+
+			if (nodeIndex >= leafNodesOffset) {
+				fgb_indexed_feature f;
+				f.offset = node.offset;
+				f.sequence = pos - leafNodesOffset;
+				out.push_back(f);
+			} else {
+				queue.push_back(std::pair<uint64_t, size_t>(node.offset, level - 1));
+			}
+		}
+	}
+
+	std::sort(out.begin(), out.end());
+	return out;
+}
+
 drawvec readPoints(const FlatGeobuf::Geometry *geometry) {
 	auto xy = geometry->xy();
 	drawvec dv;
@@ -248,61 +321,108 @@ void readFeature(const FlatGeobuf::Feature *feature, long long feature_sequence_
 	serialize_feature(sst, sf);
 }
 
-struct fgb_queued_feature {
-	const FlatGeobuf::Feature *feature = NULL;
+// A run of consecutive features, to be parsed by one thread
+struct fgb_range_arg {
+	const char *start = NULL;
+	const char *end = NULL;
+	std::vector<fgb_indexed_feature> const *indexed = NULL;  // or these features, from the index
+	size_t indexed_start = 0;
+	size_t indexed_end = 0;
+	long long first_feature = 0;
 	long long feature_sequence_id = -1;
 	FlatGeobuf::GeometryType h_geometry_type = FlatGeobuf::GeometryType::Unknown;
 	const std::vector<std::string> *h_column_names = NULL;
 	const std::vector<FlatGeobuf::ColumnType> *h_column_types = NULL;
-	std::vector<struct serialization_state> *sst = NULL;
+	struct serialization_state *sst = NULL;
 	int layer = 0;
 	std::string layername = "";
 };
 
-static std::vector<fgb_queued_feature> feature_queue;
+static size_t fgb_parse_one(const char *start, long long feature_sequence_id, struct fgb_range_arg *a) {
+	auto feature_size = flatbuffers::GetPrefixedSize((const uint8_t *)start);
 
-struct queue_run_arg {
-	size_t start;
-	size_t end;
-	size_t segment;
+	flatbuffers::Verifier v2((const uint8_t *)start,feature_size+sizeof(uint32_t));
+	const auto ok2 = FlatGeobuf::VerifySizePrefixedFeatureBuffer(v2);
+	if (!ok2) {
+		fprintf(stderr, "flatgeobuf feature buffer verification failed\n");
+		exit(EXIT_FAILURE);
+	}
+
+	auto feature = FlatGeobuf::GetSizePrefixedFeature(start);
+	readFeature(feature, feature_sequence_id, a->h_geometry_type, *a->h_column_names, *a->h_column_types, a->sst, a->layer, a->layername);
+
+	return sizeof(uint32_t) + feature_size;
+}
 
-	queue_run_arg(size_t start1, size_t end1, size_t segment1)
-	    : start(start1), end(end1), segment(segment1) {
+void *fgb_run_parse_range(void *v) {
+	struct fgb_range_arg *a = (struct fgb_range_arg *) v;
+
+	if (a->indexed != NULL) {
+		for (size_t i = a->indexed_start; i < a->indexed_end; i++) {
+			fgb_parse_one(a->start + (*a->indexed)[i].offset, (*a->indexed)[i].sequence, a);
+		}
+
+		return NULL;
 	}
-};
 
-void *fgb_run_parse_feature(void *v) {
-	struct queue_run_arg *qra = (struct queue_run_arg *) v;
+	long long feature_sequence_id = a->feature_sequence_id;
+	for (const char *start = a->start; start < a->end;) {
+		start += fgb_parse_one(start, feature_sequence_id, a);
 
-	for (size_t i = qra->start; i < qra->end; i++) {
-		struct fgb_queued_feature &qf = feature_queue[i];
-		readFeature(qf.feature, qf.feature_sequence_id, qf.h_geometry_type, *qf.h_column_names, *qf.h_column_types, &(*qf.sst)[qra->segment], qf.layer, qf.layername);
+		if (feature_sequence_id >= 0) feature_sequence_id ++;
 	}
 
 	return NULL;
 }
 
-void fgbRunQueue() {
-	if (feature_queue.size() == 0) {
-		return;
+// Read only the features whose bounding boxes intersect all the --clip-bounding-boxes
+static std::vector<fgb_indexed_feature> fgb_search_clip(const char *src, size_t len, const char *index, const char *features, uint64_t features_count, uint16_t node_size) {
+	double minx = -INFINITY, miny = -INFINITY, maxx = INFINITY, maxy = INFINITY;
+	for (auto &c : clipbboxes) {
+		minx = std::max(minx, std::min(c.lon1, c.lon2));
+		miny = std::max(miny, std::min(c.lat1, c.lat2));
+		maxx = std::min(maxx, std::max(c.lon1, c.lon2));
+		maxy = std::min(maxy, std::max(c.lat1, c.lat2));
 	}
 
-	std::vector<struct queue_run_arg> qra;
+	std::vector<fgb_indexed_feature> found = PackedRTreeSearch(index, features_count, node_size, minx, miny, maxx, maxy);
 
-	std::vector<pthread_t> pthreads;
-	pthreads.resize(CPUS);
+	// Ask for each run of adjacent features to be read in
+	// as one sequential span of the file
+	long long page = sysconf(_SC_PAGESIZE);
+	for (size_t i = 0; i < found.size();) {
+		uint64_t first = found[i].offset;
+		uint64_t last = first;
 
-	for (size_t i = 0; i < CPUS; i++) {
-		*((*(feature_queue[0].sst))[i].layer_seq) = *((*(feature_queue[0].sst))[0].layer_seq) + feature_queue.size() * i / CPUS;
+		for (; i < found.size(); i++) {
+			if (found[i].offset > last || found[i].offset + sizeof(uint32_t) > (uint64_t) (src + len - features)) {
+				break;
+			}
+			last = found[i].offset + sizeof(uint32_t) + flatbuffers::GetPrefixedSize((const uint8_t *) features + found[i].offset);
+			if (last > (uint64_t) (src + len - features)) {
+				fprintf(stderr, "flatgeobuf feature extends past the end of the file\n");
+				exit(EXIT_FAILURE);
+			}
+		}
+		if (last == first) {
+			fprintf(stderr, "flatgeobuf index refers past the end of the file\n");
+			exit(EXIT_FAILURE);
+		}
 
-		qra.push_back(queue_run_arg(
-			feature_queue.size() * i / CPUS,
-			feature_queue.size() * (i + 1) / CPUS,
-			i));
+		const char *span = features + first;
+		long long skew = (span - src) % page;
+		madvise((void *) (span - skew), last - first + skew, MADV_WILLNEED);
 	}
 
+	return found;
+}
+
+static void fgb_run_ranges(std::vector<struct serialization_state> *sst, std::vector<fgb_range_arg> &args) {
+	std::vector<pthread_t> pthreads;
+	pthreads.resize(CPUS);
+
 	for (size_t i = 0; i < CPUS; i++) {
-		if (pthread_create(&pthreads[i], NULL, fgb_run_parse_feature, &qra[i]) != 0) {
+		if (pthread_create(&pthreads[i], NULL, fgb_run_parse_range, &args[i]) != 0) {
 			perror("pthread_create");
 			exit(EXIT_FAILURE);
 		}
@@ -317,27 +437,32 @@ void fgbRunQueue() {
 	}
 
 	// Lack of atomicity is OK, since we are single-threaded again here
-	long long was = *((*(feature_queue[0].sst))[CPUS - 1].layer_seq);
-	*((*(feature_queue[0].sst))[0].layer_seq) = was;
-	feature_queue.clear();
+	long long was = *((*sst)[CPUS - 1].layer_seq);
+	*((*sst)[0].layer_seq) = was;
 }
 
-void queueFeature(const FlatGeobuf::Feature *feature, long long feature_sequence_id, FlatGeobuf::GeometryType h_geometry_type, const std::vector<std::string> &h_column_names, const std::vector<FlatGeobuf::ColumnType> &h_column_types, std::vector<struct serialization_state> *sst, int layer, std::string layername) {
-	struct fgb_queued_feature qf;
-	qf.feature = feature;
-	qf.feature_sequence_id = feature_sequence_id;
-	qf.h_geometry_type = h_geometry_type;
-	qf.h_column_names = &h_column_names;
-	qf.h_column_types = &h_column_types;
-	qf.sst = sst;
-	qf.layer = layer;
-	qf.layername = layername;
-
-	feature_queue.push_back(qf);
-
-	if (feature_queue.size() > CPUS * 500) {
-		fgbRunQueue();
+static void fgb_run_indexed(std::vector<struct serialization_state> *sst, std::vector<fgb_indexed_feature> const &found, const char *features, FlatGeobuf::GeometryType h_geometry_type, const std::vector<std::string> &h_column_names, const std::vector<FlatGeobuf::ColumnType> &h_column_types, int layer, std::string layername) {
+	std::vector<fgb_range_arg> args;
+	args.resize(CPUS);
+
+	long long base = *((*sst)[0].layer_seq);
+
+	for (size_t i = 0; i < CPUS; i++) {
+		args[i].start = features;
+		args[i].indexed = &found;
+		args[i].indexed_start = found.size() * i / CPUS;
+		args[i].indexed_end = found.size() * (i + 1) / CPUS;
+		args[i].h_geometry_type = h_geometry_type;
+		args[i].h_column_names = &h_column_names;
+		args[i].h_column_types = &h_column_types;
+		args[i].sst = &(*sst)[i];
+		args[i].layer = layer;
+		args[i].layername = layername;
+
+		*((*sst)[i].layer_seq) = base + args[i].indexed_start;
 	}
+
+	fgb_run_ranges(sst, args);
 }
 
 void parse_flatgeobuf(std::vector<struct serialization_state> *sst, const char *src, size_t len, int layer, std::string layername) {
@@ -375,25 +500,76 @@ void parse_flatgeobuf(std::vector<struct serialization_state> *sst, const char *
 		index_size = PackedRTreeSize(features_count,node_size);
 		feature_sequence_id = 0;
 	}
+	const char *index = src + sizeof(magicbytes) + sizeof(uint32_t) + header_size;
 	const char* start = src + sizeof(magicbytes) + sizeof(uint32_t) + header_size + index_size;
+	const char *features = start;
+	const char *end = src + len;
 
-	while (start < src + len) {
-		auto feature_size = flatbuffers::GetPrefixedSize((const uint8_t *)start);
+	if (node_size > 0 && features_count > 0 && clipbboxes.size() > 0) {
+		std::vector<fgb_indexed_feature> found = fgb_search_clip(src, len, index, features, features_count, node_size);
+		fgb_run_indexed(sst, found, features, h_geometry_type, h_column_names, h_column_types, layer, layername);
+		return;
+	}
+
+	// Divide the features into one run of about the same size for each thread,
+	// looking only at the size prefixes to find the boundaries between them.
+	// Verifying and parsing the features happens in the threads.
+
+	std::vector<fgb_range_arg> args;
+	args.resize(CPUS);
+
+	size_t which = 0;
+	long long n = 0;
+	args[0].start = start;
+	args[0].first_feature = 0;
 
-		flatbuffers::Verifier v2((const uint8_t *)start,feature_size+sizeof(uint32_t));
-		const auto ok2 = FlatGeobuf::VerifySizePrefixedFeatureBuffer(v2);
-		if (!ok2) {
-			fprintf(stderr, "flatgeobuf feature buffer verification failed\n");
+	while (start < end) {
+		while (which + 1 < CPUS && start - features >= (end - features) * (long long) (which + 1) / (long long) CPUS) {
+			which++;
+			args[which].start = start;
+			args[which].first_feature = n;
+		}
+
+		if (end - start < (long long) sizeof(uint32_t)) {
+			fprintf(stderr, "flatgeobuf feature size is truncated\n");
+			exit(EXIT_FAILURE);
+		}
+		auto feature_size = flatbuffers::GetPrefixedSize((const uint8_t *)start);
+		if (feature_size > (size_t) (end - start) - sizeof(uint32_t)) {
+			fprintf(stderr, "flatgeobuf feature extends past the end of the file\n");
 			exit(EXIT_FAILURE);
 		}
 
-		auto feature = FlatGeobuf::GetSizePrefixedFeature(start);
+		start += sizeof(uint32_t) + feature_size;
+		n++;
+	}
 
-		queueFeature(feature, feature_sequence_id, h_geometry_type, h_column_names, h_column_types, sst, layer, layername);
+	for (which++; which < CPUS; which++) {
+		args[which].start = end;
+		args[which].first_feature = n;
+	}
 
-		if (feature_sequence_id >= 0) feature_sequence_id ++;
-		start += sizeof(uint32_t) + feature_size;
+	long long base = *((*sst)[0].layer_seq);
+
+	for (size_t i = 0; i < CPUS; i++) {
+		if (i + 1 < CPUS) {
+			args[i].end = args[i + 1].start;
+		} else {
+			args[i].end = end;
+		}
+
+		if (feature_sequence_id >= 0) {
+			args[i].feature_sequence_id = feature_sequence_id + args[i].first_feature;
+		}
+		args[i].h_geometry_type = h_geometry_type;
+		args[i].h_column_names = &h_column_names;
+		args[i].h_column_types = &h_column_types;
+		args[i].sst = &(*sst)[i];
+		args[i].layer = layer;
+		args[i].layername = layername;
+
+		*((*sst)[i].layer_seq) = base + args[i].first_feature;
 	}
 
-	fgbRunQueue();
-}
\ No newline at end of file
+	fgb_run_ranges(sst, args);
+}
@@ -22,18 +22,6 @@
 #define POLYGON 4
 #define MULTIPOLYGON 5
 
-struct queued_feature {
-	protozero::pbf_reader pbf{};
-	size_t dim = 0;
-	double e = 0;
-	std::vector<std::string> *keys = NULL;
-	std::vector<struct serialization_state> *sst = NULL;
-	int layer = 0;
-	std::string layername = "";
-};
-
-static std::vector<queued_feature> feature_queue;
-
 void ensureDim(size_t dim) {
 	if (dim < 2) {
 		fprintf(stderr, "Geometry has fewer than 2 dimensions: %zu\n", dim);
@@ -423,82 +411,37 @@ void readFeature(protozero::pbf_reader &pbf, size_t dim, double e, std::vector<s
 	}
 }
 
-struct queue_run_arg {
-	size_t start;
-	size_t end;
-	size_t segment;
-
-	queue_run_arg(size_t start1, size_t end1, size_t segment1)
-	    : start(start1), end(end1), segment(segment1) {
-	}
+// A run of consecutive fields of a FeatureCollection, to be parsed by one thread
+struct geobuf_range_arg {
+	const char *start = NULL;
+	const char *end = NULL;
+	long long first_feature = 0;
+	size_t dim = 0;
+	double e = 0;
+	std::vector<std::string> *keys = NULL;
+	struct serialization_state *sst = NULL;
+	int layer = 0;
+	std::string layername = "";
 };
 
-void *run_parse_feature(void *v) {
-	struct queue_run_arg *qra = (struct queue_run_arg *) v;
-
-	for (size_t i = qra->start; i < qra->end; i++) {
-		struct queued_feature &qf = feature_queue[i];
-		readFeature(qf.pbf, qf.dim, qf.e, *qf.keys, &(*qf.sst)[qra->segment], qf.layer, qf.layername);
-	}
-
-	return NULL;
-}
-
-void runQueue() {
-	if (feature_queue.size() == 0) {
-		return;
-	}
-
-	std::vector<struct queue_run_arg> qra;
-
-	std::vector<pthread_t> pthreads;
-	pthreads.resize(CPUS);
-
-	for (size_t i = 0; i < CPUS; i++) {
-		*((*(feature_queue[0].sst))[i].layer_seq) = *((*(feature_queue[0].sst))[0].layer_seq) + feature_queue.size() * i / CPUS;
+void *run_parse_range(void *v) {
+	struct geobuf_range_arg *a = (struct geobuf_range_arg *) v;
+	protozero::pbf_reader pbf(a->start, a->end - a->start);
 
-		qra.push_back(queue_run_arg(
-			feature_queue.size() * i / CPUS,
-			feature_queue.size() * (i + 1) / CPUS,
-			i));
-	}
-
-	for (size_t i = 0; i < CPUS; i++) {
-		if (pthread_create(&pthreads[i], NULL, run_parse_feature, &qra[i]) != 0) {
-			perror("pthread_create");
-			exit(EXIT_FAILURE);
+	while (pbf.next()) {
+		switch (pbf.tag()) {
+		case 1: {
+			protozero::pbf_reader feature_reader(pbf.get_message());
+			readFeature(feature_reader, a->dim, a->e, *a->keys, a->sst, a->layer, a->layername);
+			break;
 		}
-	}
-
-	for (size_t i = 0; i < CPUS; i++) {
-		void *retval;
 
-		if (pthread_join(pthreads[i], &retval) != 0) {
-			perror("pthread_join");
+		default:
+			pbf.skip();
 		}
 	}
 
-	// Lack of atomicity is OK, since we are single-threaded again here
-	long long was = *((*(feature_queue[0].sst))[CPUS - 1].layer_seq);
-	*((*(feature_queue[0].sst))[0].layer_seq) = was;
-	feature_queue.clear();
-}
-
-void queueFeature(protozero::pbf_reader &pbf, size_t dim, double e, std::vector<std::string> &keys, std::vector<struct serialization_state> *sst, int layer, std::string layername) {
-	struct queued_feature qf;
-	qf.pbf = pbf;
-	qf.dim = dim;
-	qf.e = e;
-	qf.keys = &keys;
-	qf.sst = sst;
-	qf.layer = layer;
-	qf.layername = layername;
-
-	feature_queue.push_back(qf);
-
-	if (feature_queue.size() > CPUS * 500) {
-		runQueue();
-	}
+	return NULL;
 }
 
 void outBareGeometry(drawvec const &dv, int type, struct serialization_state *sst, int layer, std::string layername) {
@@ -518,19 +461,84 @@ void outBareGeometry(drawvec const &dv, int type, struct serialization_state *ss
 	serialize_feature(sst, sf);
 }
 
-void readFeatureCollection(protozero::pbf_reader &pbf, size_t dim, double e, std::vector<std::string> &keys, std::vector<struct serialization_state> *sst, int layer, std::string layername) {
+void readFeatureCollection(protozero::data_view collection, size_t dim, double e, std::vector<std::string> &keys, std::vector<struct serialization_state> *sst, int layer, std::string layername) {
+	const char *begin = collection.data();
+	const char *end = begin + collection.size();
+
+	// Divide the collection into one run of fields of about the same size
+	// for each thread, splitting only after the end of a feature.
+	// Parsing the features happens in the threads.
+
+	std::vector<geobuf_range_arg> args;
+	args.resize(CPUS);
+
+	size_t which = 0;
+	long long n = 0;
+	args[0].start = begin;
+	args[0].first_feature = 0;
+
+	protozero::pbf_reader pbf(collection);
 	while (pbf.next()) {
-		switch (pbf.tag()) {
-		case 1: {
-			protozero::pbf_reader feature_reader(pbf.get_message());
-			queueFeature(feature_reader, dim, e, keys, sst, layer, layername);
-			break;
-		}
+		if (pbf.tag() == 1) {
+			protozero::data_view feature = pbf.get_view();
+			const char *after = feature.data() + feature.size();
+			n++;
 
-		default:
+			while (which + 1 < CPUS && after - begin >= (end - begin) * (long long) (which + 1) / (long long) CPUS) {
+				which++;
+				args[which].start = after;
+				args[which].first_feature = n;
+			}
+		} else {
 			pbf.skip();
 		}
 	}
+
+	for (which++; which < CPUS; which++) {
+		args[which].start = end;
+		args[which].first_feature = n;
+	}
+
+	long long base = *((*sst)[0].layer_seq);
+
+	for (size_t i = 0; i < CPUS; i++) {
+		if (i + 1 < CPUS) {
+			args[i].end = args[i + 1].start;
+		} else {
+			args[i].end = end;
+		}
+
+		args[i].dim = dim;
+		args[i].e = e;
+		args[i].keys = &keys;
+		args[i].sst = &(*sst)[i];
+		args[i].layer = layer;
+		args[i].layername = layername;
+
+		*((*sst)[i].layer_seq) = base + args[i].first_feature;
+	}
+
+	std::vector<pthread_t> pthreads;
+	pthreads.resize(CPUS);
+
+	for (size_t i = 0; i < CPUS; i++) {
+		if (pthread_create(&pthreads[i], NULL, run_parse_range, &args[i]) != 0) {
+			perror("pthread_create");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	for (size_t i = 0; i < CPUS; i++) {
+		void *retval;
+
+		if (pthread_join(pthreads[i], &retval) != 0) {
+			perror("pthread_join");
+		}
+	}
+
+	// Lack of atomicity is OK, since we are single-threaded again here
+	long long was = *((*sst)[CPUS - 1].layer_seq);
+	*((*sst)[0].layer_seq) = was;
 }
 
 void parse_geobuf(std::vector<struct serialization_state> *sst, const char *src, size_t len, int layer, std::string layername) {
@@ -554,15 +562,13 @@ void parse_geobuf(std::vector<struct serialization_state> *sst, const char *src,
 			e = pow(10, pbf.get_int64());
 			break;
 
-		case 4: {
-			protozero::pbf_reader feature_collection_reader(pbf.get_message());
-			readFeatureCollection(feature_collection_reader, dim, e, keys, sst, layer, layername);
+		case 4:
+			readFeatureCollection(pbf.get_view(), dim, e, keys, sst, layer, layername);
 			break;
-		}
 
 		case 5: {
 			protozero::pbf_reader feature_reader(pbf.get_message());
-			queueFeature(feature_reader, dim, e, keys, sst, layer, layername);
+			readFeature(feature_reader, dim, e, keys, &(*sst)[0], layer, layername);
 			break;
 		}
 
@@ -580,6 +586,4 @@ void parse_geobuf(std::vector<struct serialization_state> *sst, const char *src,
 			pbf.skip();
 		}
 	}
-
-	runQueue();
 }
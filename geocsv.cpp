@@ -1,5 +1,12 @@
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 #include <algorithm>
+#include <atomic>
 #include "geocsv.hpp"
 #include "mvt.hpp"
 #include "serial.hpp"
@@ -10,124 +17,293 @@
 #include "milo/dtoa_milo.h"
 #include "options.hpp"
 
-void parse_geocsv(std::vector<struct serialization_state> &sst, std::string fname, int layer, std::string layername) {
-	FILE *f;
+struct geocsv_columns {
+	std::vector<std::string> header;
+	ssize_t latcol = -1;
+	ssize_t loncol = -1;
+};
 
-	if (fname.size() == 0) {
-		f = stdin;
-	} else {
-		f = fopen(fname.c_str(), "r");
-		if (f == NULL) {
-			perror(fname.c_str());
-			exit(EXIT_FAILURE);
+// Where a record came from, for messages. Line numbers of mmapped
+// records are only counted if something needs to be reported.
+struct geocsv_where {
+	const char *map = NULL;
+	const char *pos = NULL;
+	size_t line = 0;
+
+	size_t lineno() const {
+		if (map == NULL) {
+			return line;
+		}
+
+		size_t n = 1;
+		for (const char *cp = map; (cp = (const char *) memchr(cp, '\n', pos - cp)) != NULL; cp++) {
+			n++;
 		}
+		return n;
 	}
+};
 
-	std::string s;
-	std::vector<std::string> header;
-	ssize_t latcol = -1, loncol = -1;
+static void check_geocsv_utf8(std::string const &s, std::string const &fname) {
+	std::string err = check_utf8(s);
+	if (err != "") {
+		fprintf(stderr, "%s: %s\n", fname.c_str(), err.c_str());
+		exit(EXIT_FAILURE);
+	}
+}
 
-	if ((s = csv_getline(f)).size() > 0) {
-		std::string err = check_utf8(s);
-		if (err != "") {
-			fprintf(stderr, "%s: %s\n", fname.c_str(), err.c_str());
-			exit(EXIT_FAILURE);
-		}
+static void parse_geocsv_header(std::string const &s, std::string const &fname, geocsv_columns &cols) {
+	if (s.size() > 0) {
+		check_geocsv_utf8(s, fname);
 
-		header = csv_split(s.c_str());
+		cols.header = csv_split(s.c_str());
 
-		for (size_t i = 0; i < header.size(); i++) {
-			header[i] = csv_dequote(header[i]);
+		for (size_t i = 0; i < cols.header.size(); i++) {
+			cols.header[i] = csv_dequote(cols.header[i]);
 
-			std::string lower(header[i]);
+			std::string lower(cols.header[i]);
 			std::transform(lower.begin(), lower.end(), lower.begin(), ::tolower);
 
 			if (lower == "y" || lower == "lat" || (lower.find("latitude") != std::string::npos)) {
-				latcol = i;
+				cols.latcol = i;
 			}
 			if (lower == "x" || lower == "lon" || lower == "lng" || lower == "long" || (lower.find("longitude") != std::string::npos)) {
-				loncol = i;
+				cols.loncol = i;
 			}
 		}
 	}
 
-	if (latcol < 0 || loncol < 0) {
+	if (cols.latcol < 0 || cols.loncol < 0) {
 		fprintf(stderr, "%s: Can't find \"lat\" and \"lon\" columns\n", fname.c_str());
 		exit(EXIT_FAILURE);
 	}
+}
 
-	size_t seq = 0;
-	while ((s = csv_getline(f)).size() > 0) {
-		std::string err = check_utf8(s);
-		if (err != "") {
-			fprintf(stderr, "%s: %s\n", fname.c_str(), err.c_str());
+static void parse_geocsv_record(struct serialization_state *sst, std::string const &s, geocsv_columns const &cols, std::string const &fname, geocsv_where const &where, int layer, std::string const &layername) {
+	check_geocsv_utf8(s, fname);
+
+	std::vector<std::string> line = csv_split(s.c_str());
+
+	if (line.size() != cols.header.size()) {
+		fprintf(stderr, "%s:%zu: Mismatched column count: %zu in line, %zu in header\n", fname.c_str(), where.lineno(), line.size(), cols.header.size());
+		exit(EXIT_FAILURE);
+	}
+
+	if (line[cols.loncol].empty() || line[cols.latcol].empty()) {
+		// Records from several chunks may be parsed at once
+		static std::atomic<bool> warned(false);
+		if (!warned.exchange(true)) {
+			fprintf(stderr, "%s:%zu: null geometry (additional not reported)\n", fname.c_str(), where.lineno());
+		}
+		return;
+	}
+	double lon = atof(line[cols.loncol].c_str());
+	double lat = atof(line[cols.latcol].c_str());
+
+	long long x, y;
+	projection->project(lon, lat, 32, &x, &y);
+	drawvec dv;
+	dv.push_back(draw(VT_MOVETO, x, y));
+
+	std::vector<std::string> full_keys;
+	std::vector<serial_val> full_values;
+
+	for (size_t i = 0; i < line.size(); i++) {
+		if (i != (size_t) cols.latcol && i != (size_t) cols.loncol) {
+			line[i] = csv_dequote(line[i]);
+
+			serial_val sv;
+			if (is_number(line[i])) {
+				sv.type = mvt_double;
+			} else if (line[i].size() == 0 && prevent[P_EMPTY_CSV_COLUMNS]) {
+				sv.type = mvt_null;
+				line[i] = "null";
+			} else {
+				sv.type = mvt_string;
+			}
+			sv.s = line[i];
+
+			full_keys.push_back(cols.header[i]);
+			full_values.push_back(sv);
+		}
+	}
+
+	serial_feature sf;
+
+	sf.layer = layer;
+	sf.layername = layername;
+	sf.segment = sst->segment;
+	sf.has_id = false;
+	sf.id = 0;
+	sf.has_tippecanoe_minzoom = false;
+	sf.has_tippecanoe_maxzoom = false;
+	sf.feature_minzoom = false;
+	sf.seq = *(sst->layer_seq);
+	sf.geometry = dv;
+	sf.t = 1;  // POINT
+	sf.full_keys = full_keys;
+	sf.full_values = full_values;
+
+	serialize_feature(sst, sf);
+}
+
+struct geocsv_chunk_arg {
+	const char *map = NULL;
+	const char *start = NULL;
+	const char *end = NULL;
+	geocsv_columns const *cols = NULL;
+	std::string const *fname = NULL;
+	struct serialization_state *sst = NULL;
+	int layer = 0;
+	std::string layername = "";
+};
+
+static void *run_parse_geocsv_chunk(void *v) {
+	struct geocsv_chunk_arg *a = (struct geocsv_chunk_arg *) v;
+
+	geocsv_where where;
+	where.map = a->map;
+
+	for (const char *cp = a->start; cp < a->end;) {
+		const char *nl = (const char *) memchr(cp, '\n', a->end - cp);
+		const char *next = (nl == NULL) ? a->end : nl + 1;
+
+		where.pos = cp;
+		parse_geocsv_record(a->sst, std::string(cp, next - cp), *a->cols, *a->fname, where, a->layer, a->layername);
+		cp = next;
+	}
+
+	return NULL;
+}
+
+// Records are split at newlines, the same as csv_getline() does, so each
+// chunk can be parsed independently. As in do_read_parallel(), each segment's
+// sequence numbers start from its byte offset within the data, so they do
+// not depend on the order in which the threads run. Since that makes
+// the -ai ids depend on the number of chunks, there is only one unless
+// -P asked for parallel reading.
+static void parse_geocsv_map(std::vector<struct serialization_state> &sst, const char *map, size_t len, std::string const &fname, int layer, std::string const &layername, size_t chunks) {
+	const char *nl = (const char *) memchr(map, '\n', len);
+	const char *data = (nl == NULL) ? map + len : nl + 1;
+	const char *end = map + len;
+
+	geocsv_columns cols;
+	parse_geocsv_header(std::string(map, data - map), fname, cols);
+
+	long long base = *(sst[0].layer_seq);
+
+	std::vector<geocsv_chunk_arg> args;
+	args.resize(chunks);
+
+	const char *here = data;
+	for (size_t i = 0; i < chunks; i++) {
+		const char *there = data + (end - data) * (i + 1) / chunks;
+		if (there < here) {
+			there = here;
+		}
+		if (i + 1 == chunks) {
+			there = end;
+		} else if (there > data && there < end && there[-1] != '\n') {
+			const char *after = (const char *) memchr(there, '\n', end - there);
+			there = (after == NULL) ? end : after + 1;
+		}
+
+		args[i].map = map;
+		args[i].start = here;
+		args[i].end = there;
+		args[i].cols = &cols;
+		args[i].fname = &fname;
+		args[i].sst = &sst[i];
+		args[i].layer = layer;
+		args[i].layername = layername;
+
+		*(sst[i].layer_seq) = base + (here - data);
+		here = there;
+	}
+
+	if (chunks == 1) {
+		run_parse_geocsv_chunk(&args[0]);
+		return;
+	}
+
+	std::vector<pthread_t> pthreads;
+	pthreads.resize(chunks);
+
+	for (size_t i = 0; i < chunks; i++) {
+		if (pthread_create(&pthreads[i], NULL, run_parse_geocsv_chunk, &args[i]) != 0) {
+			perror("pthread_create");
 			exit(EXIT_FAILURE);
 		}
+	}
 
-		seq++;
-		std::vector<std::string> line = csv_split(s.c_str());
+	for (size_t i = 0; i < chunks; i++) {
+		void *retval;
+
+		if (pthread_join(pthreads[i], &retval) != 0) {
+			perror("pthread_join");
+		}
+	}
+
+	// Lack of atomicity is OK, since we are single-threaded again here
+	long long was = *(sst[chunks - 1].layer_seq);
+	*(sst[0].layer_seq) = was;
+}
 
-		if (line.size() != header.size()) {
-			fprintf(stderr, "%s:%zu: Mismatched column count: %zu in line, %zu in header\n", fname.c_str(), seq + 1, line.size(), header.size());
+void parse_geocsv(std::vector<struct serialization_state> &sst, std::string fname, int layer, std::string layername, bool parallel) {
+	if (fname.size() != 0) {
+		int fd = open(fname.c_str(), O_RDONLY | O_CLOEXEC);
+		if (fd < 0) {
+			perror(fname.c_str());
 			exit(EXIT_FAILURE);
 		}
 
-		if (line[loncol].empty() || line[latcol].empty()) {
-			static int warned = 0;
-			if (!warned) {
-				fprintf(stderr, "%s:%zu: null geometry (additional not reported)\n", fname.c_str(), seq + 1);
-				warned = 1;
+		struct stat st;
+		if (fstat(fd, &st) == 0 && st.st_size > 0) {
+			char *map = (char *) mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+			if (map != MAP_FAILED) {
+				madvise(map, st.st_size, MADV_SEQUENTIAL);
+				parse_geocsv_map(sst, map, st.st_size, fname, layer, layername, parallel ? CPUS : 1);
+
+				if (munmap(map, st.st_size) != 0) {
+					perror("munmap");
+					exit(EXIT_FAILURE);
+				}
+				if (close(fd) != 0) {
+					perror("close");
+					exit(EXIT_FAILURE);
+				}
+				return;
 			}
-			continue;
 		}
-		double lon = atof(line[loncol].c_str());
-		double lat = atof(line[latcol].c_str());
-
-		long long x, y;
-		projection->project(lon, lat, 32, &x, &y);
-		drawvec dv;
-		dv.push_back(draw(VT_MOVETO, x, y));
-
-		std::vector<std::string> full_keys;
-		std::vector<serial_val> full_values;
-
-		for (size_t i = 0; i < line.size(); i++) {
-			if (i != (size_t) latcol && i != (size_t) loncol) {
-				line[i] = csv_dequote(line[i]);
-
-				serial_val sv;
-				if (is_number(line[i])) {
-					sv.type = mvt_double;
-				} else if (line[i].size() == 0 && prevent[P_EMPTY_CSV_COLUMNS]) {
-					sv.type = mvt_null;
-					line[i] = "null";
-				} else {
-					sv.type = mvt_string;
-				}
-				sv.s = line[i];
 
-				full_keys.push_back(header[i]);
-				full_values.push_back(sv);
-			}
+		// Not a regular file, so read it as a stream below
+		if (close(fd) != 0) {
+			perror("close");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	FILE *f;
+
+	if (fname.size() == 0) {
+		f = stdin;
+	} else {
+		f = fopen(fname.c_str(), "r");
+		if (f == NULL) {
+			perror(fname.c_str());
+			exit(EXIT_FAILURE);
 		}
+	}
+
+	geocsv_columns cols;
+	parse_geocsv_header(csv_getline(f), fname, cols);
 
-		serial_feature sf;
-
-		sf.layer = layer;
-		sf.layername = layername;
-		sf.segment = sst[0].segment;
-		sf.has_id = false;
-		sf.id = 0;
-		sf.has_tippecanoe_minzoom = false;
-		sf.has_tippecanoe_maxzoom = false;
-		sf.feature_minzoom = false;
-		sf.seq = *(sst[0].layer_seq);
-		sf.geometry = dv;
-		sf.t = 1;  // POINT
-		sf.full_keys = full_keys;
-		sf.full_values = full_values;
-
-		serialize_feature(&sst[0], sf);
+	std::string s;
+	geocsv_where where;
+	size_t seq = 0;
+	while ((s = csv_getline(f)).size() > 0) {
+		seq++;
+		where.line = seq + 1;
+		parse_geocsv_record(&sst[0], s, cols, fname, where, layer, layername);
 	}
 
 	if (fname.size() != 0) {
@@ -8,6 +8,6 @@
 #include "mbtiles.hpp"
 #include "serial.hpp"
 
-void parse_geocsv(std::vector<struct serialization_state> &sst, std::string fname, int layer, std::string layername);
+void parse_geocsv(std::vector<struct serialization_state> &sst, std::string fname, int layer, std::string layername, bool parallel);
 
 #endif
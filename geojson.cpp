@@ -298,6 +298,7 @@ void parse_json(struct serialization_state *sst, json_pull *jp, int layer, std::
 
 void *run_parse_json(void *v) {
 	struct parse_json_args *pja = (struct parse_json_args *) v;
+	trace_span span("parse", "\"segment\":%d", pja->sst->segment);
 
 	parse_json(pja->sst, pja->jp, pja->layer, *pja->layername);
 
@@ -1,8 +1,307 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <stdlib.h>
 #include <stdarg.h>
-#include <fstream>
+#include <unistd.h>
+#include <pthread.h>
 
 #include "json_logger.hpp"
+#include "mvt.hpp"
+#include "write_json.hpp"
+
+double json_logger_now() {
+	struct timespec ts;
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) != 0) {
+		fprintf(stderr, "Can't get the time: %s\n", strerror(errno));
+		return 0;
+	}
+	return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+double json_logger_thread_cpu() {
+	struct timespec ts;
+	if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) != 0) {
+		return 0;
+	}
+	return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+static double per_second(double amount, double seconds) {
+	if (seconds <= 0) {
+		return 0;
+	}
+	return amount / seconds;
+}
 
 void json_logger::progress_tile(double progress) {
-  fprintf(stderr,"{\"progress\":%3.1f}\n",progress);
+	fprintf(stderr, "{\"progress\":%3.1f}\n", progress);
+}
+
+void json_logger::input(const char *fname, long long bytes, long long features, double seconds) {
+	if (!json_enabled) {
+		return;
+	}
+
+	fprintf(stderr, "{\"input\":{\"file\":");
+	fprintq(stderr, fname);
+	if (bytes >= 0) {
+		fprintf(stderr, ",\"bytes\":%lld,\"bytes_per_second\":%.0f", bytes, per_second(bytes, seconds));
+	}
+	fprintf(stderr, ",\"features\":%lld,\"features_per_second\":%.0f,\"seconds\":%.3f}}\n", features, per_second(features, seconds), seconds);
+}
+
+void json_logger::phase(const char *name, double seconds) {
+	phases.push_back(std::pair<std::string, double>(name, seconds));
+
+	if (!json_enabled) {
+		return;
+	}
+
+	fprintf(stderr, "{\"phase\":{\"name\":");
+	fprintq(stderr, name);
+	fprintf(stderr, ",\"seconds\":%.3f}}\n", seconds);
+}
+
+void json_logger::zoom(int z, double seconds, double cpu_seconds, size_t threads, long long read, long long written) {
+	temp_read += read;
+	temp_written += written;
+
+	// The atomic counters are cumulative, so report the change since the previous zoom level
+	long long t = tiles, b = tile_bytes, r = retries, c = compress_ns, w = write_wait_ns;
+
+	if (json_enabled) {
+		fprintf(stderr, "{\"zoom\":{\"zoom\":%d,\"seconds\":%.3f,\"threads\":%zu,\"utilization\":%.3f", z, seconds, threads, per_second(cpu_seconds, seconds * threads));
+		fprintf(stderr, ",\"tiles\":%lld,\"tile_bytes\":%lld,\"retries\":%lld", t - zoom_tiles, b - zoom_tile_bytes, r - zoom_retries);
+		fprintf(stderr, ",\"temp_read\":%lld,\"temp_written\":%lld", read, written);
+		fprintf(stderr, ",\"compress_seconds\":%.3f,\"write_wait_seconds\":%.3f}}\n", (c - zoom_compress_ns) / 1e9, (w - zoom_write_wait_ns) / 1e9);
+	}
+
+	zoom_tiles = t;
+	zoom_tile_bytes = b;
+	zoom_retries = r;
+	zoom_compress_ns = c;
+	zoom_write_wait_ns = w;
+}
+
+void json_logger::summary() {
+	if (!json_enabled) {
+		return;
+	}
+
+	double total = 0;
+	fprintf(stderr, "{\"summary\":{\"phases\":{");
+	for (size_t i = 0; i < phases.size(); i++) {
+		if (i != 0) {
+			fprintf(stderr, ",");
+		}
+		fprintq(stderr, phases[i].first.c_str());
+		fprintf(stderr, ":%.3f", phases[i].second);
+		total += phases[i].second;
+	}
+	fprintf(stderr, "},\"seconds\":%.3f", total);
+	fprintf(stderr, ",\"tiles\":%lld,\"tile_bytes\":%lld,\"retries\":%lld", (long long) tiles, (long long) tile_bytes, (long long) retries);
+	fprintf(stderr, ",\"temp_read\":%lld,\"temp_written\":%lld", temp_read, temp_written);
+	fprintf(stderr, ",\"compress_seconds\":%.3f,\"write_wait_seconds\":%.3f}}\n", compress_ns / 1e9, write_wait_ns / 1e9);
+}
+
+static pthread_mutex_t profile_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void json_logger::open_profile(const char *fname) {
+	profile = fopen(fname, "w");
+	if (profile == NULL) {
+		perror(fname);
+		exit(EXIT_FAILURE);
+	}
+}
+
+void json_logger::profile_tile(std::string &buffer, tile_profile const &tp) {
+	char s[400];
+	snprintf(s, sizeof(s), "{\"z\":%d,\"x\":%u,\"y\":%u,\"detail\":%d,\"iterations\":%d,\"features_read\":%lld,\"features_kept\":%lld,\"vertices_read\":%lld,\"vertices_kept\":%lld,\"encode_seconds\":%.6f,\"compress_seconds\":%.6f,\"bytes\":%lld,\"strategies\":\"",
+		 tp.z, tp.x, tp.y, tp.detail, tp.iterations, tp.features_read, tp.features_kept, tp.vertices_read, tp.vertices_kept, tp.encode_seconds, tp.compress_seconds, tp.bytes);
+	buffer.append(s);
+
+	static const struct {
+		int bit;
+		const char *name;
+	} strategy_names[] = {
+		{STRATEGY_DENSEST, "densest"},
+		{STRATEGY_SMALLEST, "smallest"},
+		{STRATEGY_FRACTION, "fraction"},
+		{STRATEGY_GAMMA, "gamma"},
+		{STRATEGY_MERGE_POLYGONS, "merge-polygons"},
+		{STRATEGY_DETAIL, "detail"},
+	};
+	bool first = true;
+	for (size_t i = 0; i < sizeof(strategy_names) / sizeof(strategy_names[0]); i++) {
+		if (tp.strategies & strategy_names[i].bit) {
+			if (!first) {
+				buffer.push_back(',');
+			}
+			buffer.append(strategy_names[i].name);
+			first = false;
+		}
+	}
+	buffer.append("\"}\n");
+
+	if (buffer.size() > 64 * 1024) {
+		flush_profile(buffer);
+	}
+}
+
+void json_logger::flush_profile(std::string &buffer) {
+	if (profile == NULL || buffer.size() == 0) {
+		return;
+	}
+
+	if (pthread_mutex_lock(&profile_lock) != 0) {
+		perror("pthread_mutex_lock");
+		exit(EXIT_FAILURE);
+	}
+	if (fwrite(buffer.c_str(), buffer.size(), 1, profile) != 1) {
+		perror("write tile profile");
+		exit(EXIT_FAILURE);
+	}
+	if (pthread_mutex_unlock(&profile_lock) != 0) {
+		perror("pthread_mutex_unlock");
+		exit(EXIT_FAILURE);
+	}
+
+	buffer.clear();
+}
+
+void json_logger::close_profile() {
+	if (profile != NULL) {
+		if (fclose(profile) != 0) {
+			perror("close tile profile");
+			exit(EXIT_FAILURE);
+		}
+		profile = NULL;
+	}
+}
+
+static FILE *trace_file = NULL;
+static double trace_origin = 0;
+static std::atomic<int> trace_threads(0);
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Each thread's events, written out when the buffer fills or the thread exits
+struct trace_buffer {
+	std::string events = "";
+	int tid = 0;
+	pid_t pid = 0;	// a forked filter process must not write its copy
+
+	void flush() {
+		if (trace_file == NULL || events.size() == 0 || pid != getpid()) {
+			events.clear();
+			return;
+		}
+
+		if (pthread_mutex_lock(&trace_lock) != 0) {
+			perror("pthread_mutex_lock");
+			exit(EXIT_FAILURE);
+		}
+		if (fwrite(events.c_str(), events.size(), 1, trace_file) != 1) {
+			perror("write trace");
+			exit(EXIT_FAILURE);
+		}
+		if (pthread_mutex_unlock(&trace_lock) != 0) {
+			perror("pthread_mutex_unlock");
+			exit(EXIT_FAILURE);
+		}
+
+		events.clear();
+	}
+
+	~trace_buffer() {
+		flush();
+	}
+};
+
+static thread_local trace_buffer trace_events;
+
+static void name_thread(const char *name) {
+	trace_buffer &b = trace_events;
+	b.tid = ++trace_threads;
+	b.pid = getpid();
+
+	char s[200];
+	snprintf(s, sizeof(s), ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s %d\"}}", b.tid, name, b.tid);
+	b.events.append(s);
+}
+
+static void start_span(trace_span *span, const char *name, const char *fmt, va_list ap) {
+	if (trace_events.tid == 0) {
+		// Name the thread after the first thing it was seen doing
+		name_thread(name);
+	}
+
+	span->name = name;
+	span->args[0] = '\0';
+	if (fmt != NULL) {
+		vsnprintf(span->args, sizeof(span->args), fmt, ap);
+	}
+	span->start = json_logger_now();
+}
+
+trace_span::trace_span(const char *nam, const char *fmt, ...) {
+	if (trace_file != NULL) {
+		va_list ap;
+		va_start(ap, fmt);
+		start_span(this, nam, fmt, ap);
+		va_end(ap);
+	}
+}
+
+void trace_span::begin(const char *nam, const char *fmt, ...) {
+	if (trace_file != NULL) {
+		va_list ap;
+		va_start(ap, fmt);
+		start_span(this, nam, fmt, ap);
+		va_end(ap);
+	}
+}
+
+void trace_span::end() {
+	if (start < 0 || trace_file == NULL) {
+		return;
+	}
+
+	double now = json_logger_now();
+	trace_buffer &b = trace_events;
+	char s[300];
+	snprintf(s, sizeof(s), ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,\"args\":{%s}}",
+		 name, b.tid, (start - trace_origin) * 1e6, (now - start) * 1e6, args);
+	b.events.append(s);
+	start = -1;
+
+	if (b.events.size() > 64 * 1024) {
+		b.flush();
+	}
+}
+
+// The Trace Event Format allows the closing bracket to be missing,
+// so the trace is still usable if tippecanoe exits with an error.
+void json_logger::open_trace(const char *fname) {
+	trace_file = fopen(fname, "w");
+	if (trace_file == NULL) {
+		perror(fname);
+		exit(EXIT_FAILURE);
+	}
+	trace_origin = json_logger_now();
+	fprintf(trace_file, "[{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"tippecanoe\"}}");
+	name_thread("main");
+}
+
+void json_logger::close_trace() {
+	if (trace_file != NULL) {
+		trace_events.flush();  // the other threads' buffers were written when they exited
+		fprintf(trace_file, "\n]\n");
+		if (fclose(trace_file) != 0) {
+			perror("close trace");
+			exit(EXIT_FAILURE);
+		}
+		trace_file = NULL;
+	}
 }
@@ -1,13 +1,104 @@
-#include <iostream>
-
 #ifndef LOGGING_HPP
 #define LOGGING_HPP
 
+#include <stdio.h>
+#include <atomic>
+#include <string>
+#include <vector>
+
+// Wall-clock seconds, for timing phases
+double json_logger_now();
+// CPU seconds used so far by the calling thread
+double json_logger_thread_cpu();
+
+// The ways that a tile can be reduced to make it fit, as tile_profile::strategies bits
+enum tile_strategy {
+	STRATEGY_DENSEST = 1 << 0,
+	STRATEGY_SMALLEST = 1 << 1,
+	STRATEGY_FRACTION = 1 << 2,
+	STRATEGY_GAMMA = 1 << 3,
+	STRATEGY_MERGE_POLYGONS = 1 << 4,
+	STRATEGY_DETAIL = 1 << 5,
+};
+
+// One --tile-profile record, describing the work that went into a finished tile
+struct tile_profile {
+	int z = 0;
+	unsigned x = 0;
+	unsigned y = 0;
+	int detail = 0;
+	int iterations = 0;  // times through write_tile's loop, including retries
+	long long features_read = 0;
+	long long features_kept = 0;
+	long long vertices_read = 0;  // before simplification
+	long long vertices_kept = 0;  // after simplification
+	double encode_seconds = 0;
+	double compress_seconds = 0;
+	long long bytes = 0;
+	int strategies = 0;  // the tile_strategy bits for the ways the tile was reduced to fit
+};
+
+// A --trace span, which covers the time from begin() to end() or to
+// its destruction. Only a check of a flag when tracing is off.
+struct trace_span {
+	const char *name = NULL;
+	double start = -1;
+	char args[120] = "";  // JSON object members, formatted when the span begins
+
+	trace_span() {
+	}
+	trace_span(const char *nam, const char *fmt = NULL, ...);
+	~trace_span() {
+		end();
+	}
+
+	void begin(const char *nam, const char *fmt = NULL, ...);
+	void end();
+
+	trace_span(trace_span const &) = delete;
+	trace_span &operator=(trace_span const &) = delete;
+};
 
 struct json_logger {
-   bool json_enabled = false;
+	bool json_enabled = false;
+
+	// Added to by the tiling threads, and reported per zoom level
+	std::atomic<long long> tiles{0};
+	std::atomic<long long> tile_bytes{0};
+	std::atomic<long long> retries{0};	  // tiles re-encoded because they were too big
+	std::atomic<long long> compress_ns{0};	  // time spent compressing tiles
+	std::atomic<long long> write_wait_ns{0};  // time spent waiting for the output lock
+
+	// Totals for the summary, only touched from the main thread
+	long long temp_read = 0;
+	long long temp_written = 0;
+	std::vector<std::pair<std::string, double>> phases{};
+
+	void progress_tile(double progress);
+	void input(const char *fname, long long bytes, long long features, double seconds);
+	void phase(const char *name, double seconds);
+	void zoom(int z, double seconds, double cpu_seconds, size_t threads, long long read, long long written);
+	void summary();
+
+	// --tile-profile records are collected in a buffer per thread
+	// and written out in large chunks
+	FILE *profile = NULL;
+	void open_profile(const char *fname);
+	void profile_tile(std::string &buffer, tile_profile const &tp);
+	void flush_profile(std::string &buffer);
+	void close_profile();
+
+	// --trace events are collected in a buffer per thread, with no locking
+	// until the buffer is written out
+	void open_trace(const char *fname);
+	void close_trace();
 
-   void progress_tile(double progress);
+       private:
+	long long zoom_tiles = 0;
+	long long zoom_tile_bytes = 0;
+	long long zoom_retries = 0;
+	long long zoom_compress_ns = 0;
+	long long zoom_write_wait_ns = 0;
 };
 
-#endif
\ No newline at end of file
+#endif
@@ -7,6 +7,142 @@
 #include "jsonpull.h"
 
 #define BUFFER 10000
+#define ARENA_BLOCK 65536
+#define ARENA_ALIGN 16
+
+struct json_arena_block {
+	struct json_arena_block *next;
+	size_t size;
+	size_t used;
+	size_t pad;  // keeps data aligned to ARENA_ALIGN
+	char data[];
+};
+
+struct json_arena {
+	// Blocks are in allocation order. Those after current are unused.
+	struct json_arena_block *head;
+	struct json_arena_block *current;
+
+	// The object most recently returned by json_read_separators(),
+	// and the end of the arena at that time
+	json_object *returned;
+	char *returned_top;
+
+	// Strings are built here and then copied into the arena
+	char *scratch;
+	size_t scratch_alloc;
+};
+
+static struct json_arena *arena_begin(void) {
+	struct json_arena *a = malloc(sizeof(struct json_arena));
+	if (a == NULL) {
+		perror("Out of memory");
+		exit(EXIT_FAILURE);
+	}
+
+	a->head = NULL;
+	a->current = NULL;
+	a->returned = NULL;
+	a->returned_top = NULL;
+	a->scratch = NULL;
+	a->scratch_alloc = 0;
+	return a;
+}
+
+static void arena_end(struct json_arena *a) {
+	while (a->head != NULL) {
+		struct json_arena_block *next = a->head->next;
+		free(a->head);
+		a->head = next;
+	}
+
+	free(a->scratch);
+	free(a);
+}
+
+static void *arena_alloc(struct json_arena *a, size_t n) {
+	n = (n + ARENA_ALIGN - 1) & ~((size_t) ARENA_ALIGN - 1);
+
+	struct json_arena_block *b = a->current;
+	while (b != NULL && b->used + n > b->size) {
+		b = b->next;
+		if (b != NULL) {
+			b->used = 0;
+		}
+	}
+
+	if (b == NULL) {
+		size_t size = n > ARENA_BLOCK ? n : ARENA_BLOCK;
+		b = malloc(sizeof(struct json_arena_block) + size);
+		if (b == NULL) {
+			perror("Out of memory");
+			exit(EXIT_FAILURE);
+		}
+
+		b->size = size;
+		b->used = 0;
+
+		if (a->current == NULL) {
+			b->next = a->head;
+			a->head = b;
+		} else {
+			b->next = a->current->next;
+			a->current->next = b;
+		}
+	}
+
+	a->current = b;
+	void *ret = b->data + b->used;
+	b->used += n;
+	return ret;
+}
+
+// Arrays carry their capacity just before them so they can be grown
+static void *arena_realloc(struct json_arena *a, void *old, size_t n) {
+	size_t have = 0;
+
+	if (old != NULL) {
+		have = *(size_t *) ((char *) old - ARENA_ALIGN);
+		if (n <= have) {
+			return old;
+		}
+	}
+
+	char *p = arena_alloc(a, ARENA_ALIGN + n);
+	*(size_t *) p = n;
+	if (old != NULL) {
+		memcpy(p + ARENA_ALIGN, old, have);
+	}
+	return p + ARENA_ALIGN;
+}
+
+static char *arena_top(struct json_arena *a) {
+	if (a->current == NULL) {
+		return NULL;
+	}
+	return a->current->data + a->current->used;
+}
+
+// Release everything allocated at or after p
+static void arena_rewind(struct json_arena *a, char *p) {
+	struct json_arena_block *b;
+	for (b = a->head; b != NULL; b = b->next) {
+		if (p >= b->data && p < b->data + b->size) {
+			b->used = p - b->data;
+			a->current = b;
+			return;
+		}
+	}
+}
+
+static void arena_reset(struct json_arena *a) {
+	a->current = a->head;
+	if (a->current != NULL) {
+		a->current->used = 0;
+	}
+	a->returned = NULL;
+	a->returned_top = NULL;
+}
 
 json_pull *json_begin(ssize_t (*read)(struct json_pull *, char *buffer, size_t n), void *source) {
 	json_pull *j = malloc(sizeof(json_pull));
@@ -24,6 +160,7 @@ json_pull *json_begin(ssize_t (*read)(struct json_pull *, char *buffer, size_t n
 	j->source = source;
 	j->buffer_head = 0;
 	j->buffer_tail = 0;
+	j->arena = arena_begin();
 
 	j->buffer = malloc(BUFFER);
 	if (j->buffer == NULL) {
@@ -87,10 +224,20 @@ json_pull *json_begin_string(const char *s) {
 
 void json_end(json_pull *p) {
 	json_free(p->root);
+	if (p->arena != NULL) {
+		arena_end(p->arena);
+	}
 	free(p->buffer);
 	free(p);
 }
 
+void json_disable_arena(json_pull *j) {
+	if (j->arena != NULL) {
+		arena_end(j->arena);
+		j->arena = NULL;
+	}
+}
+
 static inline int read_wrap(json_pull *j) {
 	int c = next(j);
 
@@ -104,10 +251,17 @@ static inline int read_wrap(json_pull *j) {
 #define SIZE_FOR(i, size) ((size_t)((((i) + 31) & ~31) * size))
 
 static json_object *fabricate_object(json_pull *jp, json_object *parent, json_type type) {
-	json_object *o = malloc(sizeof(struct json_object));
-	if (o == NULL) {
-		perror("Out of memory");
-		exit(EXIT_FAILURE);
+	json_object *o;
+	if (jp != NULL && jp->arena != NULL) {
+		o = arena_alloc(jp->arena, sizeof(struct json_object));
+		o->arena = 1;
+	} else {
+		o = malloc(sizeof(struct json_object));
+		if (o == NULL) {
+			perror("Out of memory");
+			exit(EXIT_FAILURE);
+		}
+		o->arena = 0;
 	}
 	o->type = type;
 	o->parent = parent;
@@ -119,9 +273,24 @@ static json_object *fabricate_object(json_pull *jp, json_object *parent, json_ty
 	return o;
 }
 
+static void *grow_array(json_pull *j, void *a, size_t n) {
+	if (j->arena != NULL) {
+		return arena_realloc(j->arena, a, n);
+	}
+
+	a = realloc(a, n);
+	if (a == NULL) {
+		perror("Out of memory");
+		exit(EXIT_FAILURE);
+	}
+	return a;
+}
+
+// The container's arrays are grown before the new object is made, so that
+// everything in the arena from the object onward belongs to the object.
 static json_object *add_object(json_pull *j, json_type type) {
 	json_object *c = j->container;
-	json_object *o = fabricate_object(j, c, type);
+	json_object *o;
 
 	if (c != NULL) {
 		if (c->type == JSON_ARRAY) {
@@ -131,28 +300,24 @@ static json_object *add_object(json_pull *j, json_type type) {
 						fprintf(stderr, "Array size overflow\n");
 						exit(EXIT_FAILURE);
 					}
-					c->array = realloc(c->array, SIZE_FOR(c->length + 1, sizeof(json_object *)));
-					if (c->array == NULL) {
-						perror("Out of memory");
-						exit(EXIT_FAILURE);
-					}
+					c->array = grow_array(j, c->array, SIZE_FOR(c->length + 1, sizeof(json_object *)));
 				}
 
+				o = fabricate_object(j, c, type);
 				c->array[c->length++] = o;
 				c->expect = JSON_COMMA;
 			} else {
 				j->error = "Expected a comma, not a list item";
-				free(o);
 				return NULL;
 			}
 		} else if (c->type == JSON_HASH) {
 			if (c->expect == JSON_VALUE) {
+				o = fabricate_object(j, c, type);
 				c->values[c->length - 1] = o;
 				c->expect = JSON_COMMA;
 			} else if (c->expect == JSON_KEY) {
 				if (type != JSON_STRING) {
 					j->error = "Hash key is not a string";
-					free(o);
 					return NULL;
 				}
 
@@ -161,29 +326,28 @@ static json_object *add_object(json_pull *j, json_type type) {
 						fprintf(stderr, "Hash size overflow\n");
 						exit(EXIT_FAILURE);
 					}
-					c->keys = realloc(c->keys, SIZE_FOR(c->length + 1, sizeof(json_object *)));
-					c->values = realloc(c->values, SIZE_FOR(c->length + 1, sizeof(json_object *)));
-					if (c->keys == NULL || c->values == NULL) {
-						perror("Out of memory");
-						exit(EXIT_FAILURE);
-					}
+					c->keys = grow_array(j, c->keys, SIZE_FOR(c->length + 1, sizeof(json_object *)));
+					c->values = grow_array(j, c->values, SIZE_FOR(c->length + 1, sizeof(json_object *)));
 				}
 
+				o = fabricate_object(j, c, type);
 				c->keys[c->length] = o;
 				c->values[c->length] = NULL;
 				c->length++;
 				c->expect = JSON_COLON;
 			} else {
 				j->error = "Expected a comma or colon";
-				free(o);
 				return NULL;
 			}
+		} else {
+			o = fabricate_object(j, c, type);
 		}
 	} else {
 		if (j->root != NULL) {
 			json_free(j->root);
 		}
 
+		o = fabricate_object(j, c, type);
 		j->root = o;
 	}
 
@@ -243,9 +407,7 @@ static void string_append(struct string *s, char c) {
 	s->buf[s->n] = '\0';
 }
 
-static void string_append_string(struct string *s, char *add) {
-	size_t len = strlen(add);
-
+static void string_append_span(struct string *s, const char *add, size_t len) {
 	if (s->n + len + 1 >= s->nalloc) {
 		size_t prev = s->nalloc;
 		s->nalloc += 500 + len;
@@ -260,18 +422,163 @@ static void string_append_string(struct string *s, char *add) {
 		}
 	}
 
-	for (; *add != '\0'; add++) {
-		s->buf[s->n++] = *add;
-	}
-
+	memcpy(s->buf + s->n, add, len);
+	s->n += len;
 	s->buf[s->n] = '\0';
 }
 
+static void string_append_string(struct string *s, char *add) {
+	string_append_span(s, add, strlen(add));
+}
+
+// Copy a run of digits straight out of the read buffer instead of
+// going through read_wrap() and string_append() for each one
+static void read_digits(json_pull *j, struct string *val) {
+	while (1) {
+		const char *start = j->buffer + j->buffer_head;
+		const char *end = j->buffer + j->buffer_tail;
+		const char *cp = start;
+
+		while (cp < end && *cp >= '0' && *cp <= '9') {
+			cp++;
+		}
+
+		string_append_span(val, start, cp - start);
+		j->buffer_head += cp - start;
+
+		if (cp < end) {
+			return;
+		}
+
+		// Ran off the end of the buffer, so see whether there are more
+		int c = peek(j);
+		if (c < '0' || c > '9') {
+			return;
+		}
+	}
+}
+
 static void string_free(struct string *s) {
 	free(s->buf);
 }
 
-json_object *json_read_separators(json_pull *j, json_separator_callback cb, void *state) {
+// Powers of ten that are exactly representable as doubles
+static const double exact_powers_of_ten[] = {
+	1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+	1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+};
+
+// Convert an already-validated JSON number. If the significant digits fit
+// in 53 bits and the power of ten is exact, a single multiplication or
+// division gives the correctly rounded result, so there is no need for
+// the much slower general case in atof().
+static double json_number(const char *s) {
+	const char *cp = s;
+	int negative = 0;
+	unsigned long long mantissa = 0;
+	int digits = 0;
+	int exponent = 0;
+
+	if (*cp == '-') {
+		negative = 1;
+		cp++;
+	}
+
+	for (; *cp >= '0' && *cp <= '9'; cp++) {
+		if (mantissa != 0 || *cp != '0') {
+			digits++;
+		}
+		mantissa = mantissa * 10 + (*cp - '0');
+		if (digits > 15) {
+			return atof(s);
+		}
+	}
+
+	if (*cp == '.') {
+		for (cp++; *cp >= '0' && *cp <= '9'; cp++) {
+			if (mantissa != 0 || *cp != '0') {
+				digits++;
+			}
+			mantissa = mantissa * 10 + (*cp - '0');
+			exponent--;
+			if (digits > 15) {
+				return atof(s);
+			}
+		}
+	}
+
+	if (*cp == 'e' || *cp == 'E') {
+		int esign = 1;
+		int e = 0;
+
+		cp++;
+		if (*cp == '+') {
+			cp++;
+		} else if (*cp == '-') {
+			esign = -1;
+			cp++;
+		}
+
+		for (; *cp >= '0' && *cp <= '9'; cp++) {
+			e = e * 10 + (*cp - '0');
+			if (e > 1000) {
+				return atof(s);
+			}
+		}
+
+		exponent += esign * e;
+	}
+
+	if (exponent < -22 || exponent > 22) {
+		return atof(s);
+	}
+
+	double d = (double) mantissa;
+	if (exponent < 0) {
+		d /= exact_powers_of_ten[-exponent];
+	} else {
+		d *= exact_powers_of_ten[exponent];
+	}
+
+	return negative ? -d : d;
+}
+
+// With an arena, strings are built in its reusable scratch buffer
+// and then copied into the arena at their final size
+static void string_begin(json_pull *j, struct string *s) {
+	if (j->arena == NULL || j->arena->scratch == NULL) {
+		string_init(s);
+		return;
+	}
+
+	s->buf = j->arena->scratch;
+	s->nalloc = j->arena->scratch_alloc;
+	s->n = 0;
+	s->buf[0] = '\0';
+}
+
+static void string_discard(json_pull *j, struct string *s) {
+	if (j->arena == NULL) {
+		string_free(s);
+		return;
+	}
+
+	j->arena->scratch = s->buf;
+	j->arena->scratch_alloc = s->nalloc;
+}
+
+static char *string_keep(json_pull *j, struct string *s) {
+	if (j->arena == NULL) {
+		return s->buf;
+	}
+
+	char *ret = arena_alloc(j->arena, s->n + 1);
+	memcpy(ret, s->buf, s->n + 1);
+	string_discard(j, s);
+	return ret;
+}
+
+static json_object *read_value(json_pull *j, json_separator_callback cb, void *state) {
 	int c;
 
 	// In case there is an error at the top level
@@ -281,6 +588,11 @@ json_object *json_read_separators(json_pull *j, json_separator_callback cb, void
 		}
 
 		j->root = NULL;
+
+		// Nothing from the previous top-level value is still in use
+		if (j->arena != NULL) {
+			arena_reset(j->arena);
+		}
 	}
 
 again:
@@ -497,7 +809,7 @@ again:
 
 	if (c == '-' || (c >= '0' && c <= '9')) {
 		struct string val;
-		string_init(&val);
+		string_begin(j, &val);
 
 		if (c == '-') {
 			string_append(&val, c);
@@ -508,12 +820,7 @@ again:
 			string_append(&val, c);
 		} else if (c >= '1' && c <= '9') {
 			string_append(&val, c);
-			c = peek(j);
-
-			while (c >= '0' && c <= '9') {
-				string_append(&val, read_wrap(j));
-				c = peek(j);
-			}
+			read_digits(j, &val);
 		}
 
 		if (peek(j) == '.') {
@@ -522,13 +829,10 @@ again:
 			c = peek(j);
 			if (c < '0' || c > '9') {
 				j->error = "Decimal point without digits";
-				string_free(&val);
+				string_discard(j, &val);
 				return NULL;
 			}
-			while (c >= '0' && c <= '9') {
-				string_append(&val, read_wrap(j));
-				c = peek(j);
-			}
+			read_digits(j, &val);
 		}
 
 		c = peek(j);
@@ -543,22 +847,19 @@ again:
 			c = peek(j);
 			if (c < '0' || c > '9') {
 				j->error = "Exponent without digits";
-				string_free(&val);
+				string_discard(j, &val);
 				return NULL;
 			}
-			while (c >= '0' && c <= '9') {
-				string_append(&val, read_wrap(j));
-				c = peek(j);
-			}
+			read_digits(j, &val);
 		}
 
 		json_object *n = add_object(j, JSON_NUMBER);
 		if (n != NULL) {
-			n->number = atof(val.buf);
-			n->string = val.buf;
+			n->number = json_number(val.buf);
 			n->length = val.n;
+			n->string = string_keep(j, &val);
 		} else {
-			string_free(&val);
+			string_discard(j, &val);
 		}
 		return n;
 	}
@@ -567,10 +868,33 @@ again:
 
 	if (c == '"') {
 		struct string val;
-		string_init(&val);
+		string_begin(j, &val);
 
 		int surrogate = -1;
-		while ((c = read_wrap(j)) != EOF) {
+		while (1) {
+			// Copy characters that need no special handling straight
+			// out of the read buffer. They can't include newlines,
+			// so the line count is unaffected.
+			if (surrogate < 0) {
+				const char *start = j->buffer + j->buffer_head;
+				const char *end = j->buffer + j->buffer_tail;
+				const char *cp = start;
+
+				while (cp < end && *cp != '"' && *cp != '\\' && (unsigned char) *cp >= ' ') {
+					cp++;
+				}
+
+				if (cp > start) {
+					string_append_span(&val, start, cp - start);
+					j->buffer_head += cp - start;
+				}
+			}
+
+			c = read_wrap(j);
+			if (c == EOF) {
+				break;
+			}
+
 			if (c == '"') {
 				if (surrogate >= 0) {
 					string_append(&val, 0xE0 | (surrogate >> 12));
@@ -590,7 +914,7 @@ again:
 						hex[i] = read_wrap(j);
 						if (hex[i] < '0' || (hex[i] > '9' && hex[i] < 'A') || (hex[i] > 'F' && hex[i] < 'a') || hex[i] > 'f') {
 							j->error = "Invalid \\u hex character";
-							string_free(&val);
+							string_discard(j, &val);
 							return NULL;
 						}
 					}
@@ -665,13 +989,13 @@ again:
 						string_append(&val, '\t');
 					} else {
 						j->error = "Found backslash followed by unknown character";
-						string_free(&val);
+						string_discard(j, &val);
 						return NULL;
 					}
 				}
 			} else if (c < ' ') {
 				j->error = "Found control character in string";
-				string_free(&val);
+				string_discard(j, &val);
 				return NULL;
 			} else {
 				if (surrogate >= 0) {
@@ -686,16 +1010,16 @@ again:
 		}
 		if (c == EOF) {
 			j->error = "String without closing quote mark";
-			string_free(&val);
+			string_discard(j, &val);
 			return NULL;
 		}
 
 		json_object *s = add_object(j, JSON_STRING);
 		if (s != NULL) {
-			s->string = val.buf;
 			s->length = val.n;
+			s->string = string_keep(j, &val);
 		} else {
-			string_free(&val);
+			string_discard(j, &val);
 		}
 		return s;
 	}
@@ -704,6 +1028,17 @@ again:
 	return NULL;
 }
 
+json_object *json_read_separators(json_pull *j, json_separator_callback cb, void *state) {
+	json_object *o = read_value(j, cb, state);
+
+	if (j->arena != NULL) {
+		j->arena->returned = o;
+		j->arena->returned_top = arena_top(j->arena);
+	}
+
+	return o;
+}
+
 json_object *json_read(json_pull *j) {
 	return json_read_separators(j, NULL, NULL);
 }
@@ -720,6 +1055,8 @@ json_object *json_read_tree(json_pull *p) {
 	return NULL;
 }
 
+static void json_detach(json_object *o);
+
 void json_free(json_object *o) {
 	size_t i;
 
@@ -727,6 +1064,25 @@ void json_free(json_object *o) {
 		return;
 	}
 
+	if (o->arena) {
+		// Arena objects are not released individually, but if nothing
+		// has been read since this one, its space can be reused now.
+		// That keeps the arena small while reading the features of a
+		// long FeatureCollection, which are never top-level values.
+		json_pull *j = o->parser;
+		int reclaim = j != NULL && j->arena != NULL && j->arena->returned == o &&
+			     j->arena->returned_top == arena_top(j->arena) &&
+			     (o->parent == NULL || o->parent->type == JSON_ARRAY);
+
+		json_detach(o);
+
+		if (reclaim) {
+			arena_rewind(j->arena, (char *) o);
+			j->arena->returned = NULL;
+		}
+		return;
+	}
+
 	// Free any data linked from here
 
 	if (o->type == JSON_ARRAY) {
@@ -783,10 +1139,9 @@ static void json_disconnect_parser(json_object *o) {
 	o->parser = NULL;
 }
 
-void json_disconnect(json_object *o) {
-	// Expunge references to this as an array element
-	// or a hash key or value.
-
+// Expunge references to this as an array element
+// or a hash key or value, or as the parser's root.
+static void json_detach(json_object *o) {
 	if (o->parent != NULL) {
 		if (o->parent->type == JSON_ARRAY) {
 			size_t i;
@@ -820,8 +1175,12 @@ void json_disconnect(json_object *o) {
 			if (i < o->parent->length) {
 				if (o->parent->keys[i] != NULL && o->parent->keys[i]->type == JSON_NULL) {
 					if (o->parent->values[i] != NULL && o->parent->values[i]->type == JSON_NULL) {
-						free(o->parent->keys[i]);
-						free(o->parent->values[i]);
+						if (!o->parent->keys[i]->arena) {
+							free(o->parent->keys[i]);
+						}
+						if (!o->parent->values[i]->arena) {
+							free(o->parent->values[i]);
+						}
 
 						memmove(o->parent->keys + i, o->parent->keys + i + 1, o->parent->length - i - 1);
 						memmove(o->parent->values + i, o->parent->values + i + 1, o->parent->length - i - 1);
@@ -835,7 +1194,10 @@ void json_disconnect(json_object *o) {
 	if (o->parser != NULL && o->parser->root == o) {
 		o->parser->root = NULL;
 	}
+}
 
+void json_disconnect(json_object *o) {
+	json_detach(o);
 	json_disconnect_parser(o);
 	o->parent = NULL;
 }
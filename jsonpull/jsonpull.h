@@ -25,6 +25,8 @@ typedef enum json_type {
 	JSON_VALUE,
 } json_type;
 
+struct json_arena;
+
 typedef struct json_object {
 	json_type type;
 	struct json_object *parent;
@@ -39,6 +41,7 @@ typedef struct json_object {
 	size_t length;
 
 	int expect;
+	int arena;  // allocated from the parser's arena rather than with malloc
 } json_object;
 
 typedef struct json_pull {
@@ -53,6 +56,11 @@ typedef struct json_pull {
 
 	json_object *container;
 	json_object *root;
+
+	// Objects are bump-allocated from here, and all of them are released
+	// when the next top-level value is read, unless json_disable_arena()
+	// has been called.
+	struct json_arena *arena;
 } json_pull;
 
 json_pull *json_begin_file(FILE *f);
@@ -61,6 +69,10 @@ json_pull *json_begin_string(const char *s);
 json_pull *json_begin(ssize_t (*read)(struct json_pull *, char *buffer, size_t n), void *source);
 void json_end(json_pull *p);
 
+// For callers that keep objects after reading the next top-level value
+// or after json_end(), or that modify them. Call before reading.
+void json_disable_arena(json_pull *j);
+
 typedef void (*json_separator_callback)(json_type type, json_pull *j, void *state);
 
 json_object *json_read_tree(json_pull *j);
@@ -342,6 +342,7 @@ void join_csv(json_object *j) {
 				ko->keys = vo->keys = NULL;
 				ko->values = vo->values = NULL;
 				ko->parser = vo->parser = properties->parser;
+				ko->arena = vo->arena = 0;
 
 				ko->string = strdup(k.c_str());
 				vo->string = strdup(v.c_str());
@@ -388,6 +389,7 @@ struct json_join_action : json_feature_action {
 
 void process(FILE *fp, const char *fname) {
 	json_pull *jp = json_begin_file(fp);
+	json_disable_arena(jp);  // joined properties are added with malloc
 
 	json_join_action jja;
 	jja.fname = fname;
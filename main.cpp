@@ -32,6 +32,7 @@
 #include <string>
 #include <set>
 #include <map>
+#include <queue>
 #include <cmath>
 
 #ifdef __APPLE__
@@ -59,6 +60,7 @@
 #include "serial.hpp"
 #include "options.hpp"
 #include "mvt.hpp"
+#include "plugin.hpp"
 #include "dirtiles.hpp"
 #include "evaluator.hpp"
 #include "text.hpp"
@@ -79,6 +81,8 @@ size_t max_tile_features = 200000;
 int cluster_distance = 0;
 long justx = -1, justy = -1;
 std::string attribute_for_id = "";
+bool postfilter_mvt = false;
+compiled_filter const *ingest_filter = NULL;
 
 int prevent[256];
 int additional[256];
@@ -103,7 +107,7 @@ void checkdisk(std::vector<struct reader> *r) {
 	for (size_t i = 0; i < r->size(); i++) {
 		// Meta, pool, and tree are used once.
 		// Geometry and index will be duplicated during sorting and tiling.
-		used += (*r)[i].metapos + 2 * (*r)[i].geompos + 2 * (*r)[i].indexpos + (*r)[i].poolfile->len + (*r)[i].treefile->len;
+		used += (*r)[i].metapos + 2 * (*r)[i].geompos + 2 * (*r)[i].indexpos + (*r)[i].poolfile->off + (*r)[i].treefile->off;
 	}
 
 	static int warned = 0;
@@ -295,7 +299,19 @@ int calc_feature_minzoom(struct index *ix, struct drop_state *ds, int maxzoom, d
 	return feature_minzoom;
 }
 
-static void merge(struct mergelist *merges, size_t nmerges, unsigned char *map, FILE *indexfile, int bytes, char *geom_map, FILE *geom_out, std::atomic<long long> *geompos, long long *progress, long long *progress_max, long long *progress_reported, int maxzoom, double gamma, struct drop_state *ds) {
+// Copy a feature into the sorted output, pointing its string references
+// into the consolidated string pool if the segments' pools were merged
+static void copy_feature(FILE *geom_out, char *feature, long long len, std::vector<segment_remap> const &remaps, std::atomic<long long> *geompos) {
+	if (remaps.size() > 0) {
+		serialize_remapped_feature(geom_out, feature, len, remaps, geompos, "merge geometry");
+	} else {
+		fwrite_check(feature, 1, len, geom_out, "merge geometry");
+		*geompos += len;
+	}
+}
+
+static void merge(struct mergelist *merges, size_t nmerges, unsigned char *map, FILE *indexfile, int bytes, char *geom_map, FILE *geom_out, std::atomic<long long> *geompos, long long *progress, long long *progress_max, long long *progress_reported, int maxzoom, double gamma, struct drop_state *ds, std::vector<segment_remap> const &remaps) {
+	trace_span span("merge", "\"chunks\":%zu", nmerges);
 	struct mergelist *head = NULL;
 
 	for (size_t i = 0; i < nmerges; i++) {
@@ -309,8 +325,7 @@ static void merge(struct mergelist *merges, size_t nmerges, unsigned char *map,
 	while (head != NULL) {
 		struct index ix = *((struct index *) (map + head->start));
 		long long pos = *geompos;
-		fwrite_check(geom_map + ix.start, 1, ix.end - ix.start, geom_out, "merge geometry");
-		*geompos += ix.end - ix.start;
+		copy_feature(geom_out, geom_map + ix.start, ix.end - ix.start, remaps, geompos);
 		int feature_minzoom = calc_feature_minzoom(&ix, ds, maxzoom, gamma);
 		serialize_byte(geom_out, feature_minzoom, geompos, "merge geometry");
 
@@ -360,6 +375,7 @@ void *run_sort(void *v) {
 		if (end > a->indexpos) {
 			end = a->indexpos;
 		}
+		trace_span span("sort", "\"start\":%lld,\"end\":%lld", start, end);
 
 		a->merges[start / a->unit].start = start;
 		a->merges[start / a->unit].end = end;
@@ -396,6 +412,51 @@ void *run_sort(void *v) {
 	return NULL;
 }
 
+#define DETECT_LEN (1024 * 1024)
+#define DETECT_LINES 16
+
+// With -aj, guess whether input can be split at newlines for parallel
+// parsing even without -P: each of its first few lines, or as many as
+// there are within len, must hold exactly one complete JSON object.
+// This is only a guess, so it is not done unless asked for.
+static bool is_newline_delimited(const char *s, size_t len, bool complete) {
+	const char *end = s + len;
+	size_t lines = 0;
+
+	while (s < end && lines < DETECT_LINES) {
+		const char *nl = (const char *) memchr(s, '\n', end - s);
+		if (nl == NULL) {
+			if (!complete) {
+				break;
+			}
+			nl = end;
+		}
+
+		std::string line(s, nl - s);
+		s = nl + 1;
+
+		size_t first = line.find_first_not_of(" \t\r");
+		if (first == std::string::npos) {
+			continue;
+		}
+		if (line[first] != '{') {
+			return false;
+		}
+
+		json_pull *jp = json_begin_string(line.c_str());
+		json_object *o = json_read_tree(jp);
+		bool ok = o != NULL && json_read(jp) == NULL && jp->error == NULL;
+		json_end(jp);
+
+		if (!ok) {
+			return false;
+		}
+		lines++;
+	}
+
+	return lines > 0;
+}
+
 void do_read_parallel(char *map, long long len, long long initial_offset, const char *reading, std::vector<struct reader> *readers, std::atomic<long long> *progress_seq, std::set<std::string> *exclude, std::set<std::string> *include, int exclude_all, int basezoom, int source, std::vector<std::map<std::string, layermap_entry> > *layermaps, int *initialized, unsigned *initial_x, unsigned *initial_y, int maxzoom, std::string layername, bool uses_gamma, std::map<std::string, int> const *attribute_types, int separator, double *dist_sum, size_t *dist_count, bool want_dist, bool filters) {
 	long long segs[CPUS + 1];
 	segs[0] = 0;
@@ -485,14 +546,70 @@ void do_read_parallel(char *map, long long len, long long initial_offset, const
 
 static ssize_t read_stream(json_pull *j, char *buffer, size_t n);
 
+#define INFLATE_BLOCK (1024 * 1024)
+
 struct STREAM {
 	FILE *fp = NULL;
 	gzFile gz = NULL;
 
+	// Compressed input is inflated on its own thread, up to two
+	// blocks ahead of the reader
+	pthread_t inflater;
+	pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+	pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+	char *block[2] = {NULL, NULL};
+	int block_len[2] = {0, 0};
+	bool block_full[2] = {false, false};
+	bool stopping = false;
+	int current = 0;
+	int pos = 0;
+
+	// Input that has been looked at with peek() but not yet read
+	std::string lookahead;
+	size_t lookahead_pos = 0;
+
+	void lock_blocks() {
+		if (pthread_mutex_lock(&lock) != 0) {
+			perror("pthread_mutex_lock (inflate)");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	void unlock_blocks() {
+		if (pthread_mutex_unlock(&lock) != 0) {
+			perror("pthread_mutex_unlock (inflate)");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	// Wait for the current block, and return whether there is anything in it
+	bool fill() {
+		lock_blocks();
+		while (!block_full[current]) {
+			pthread_cond_wait(&cond, &lock);
+		}
+		bool more = pos < block_len[current];
+		unlock_blocks();
+
+		return more;
+	}
+
 	int fclose() {
 		int ret;
 
 		if (gz != NULL) {
+			lock_blocks();
+			stopping = true;
+			pthread_cond_broadcast(&cond);
+			unlock_blocks();
+
+			if (pthread_join(inflater, NULL) != 0) {
+				perror("pthread_join inflater");
+				exit(EXIT_FAILURE);
+			}
+
+			free(block[0]);
+			free(block[1]);
 			ret = gzclose(gz);
 		} else {
 			ret = ::fclose(fp);
@@ -503,12 +620,15 @@ struct STREAM {
 	}
 
 	int peekc() {
+		if (lookahead_pos < lookahead.size()) {
+			return (unsigned char) lookahead[lookahead_pos];
+		}
+
 		if (gz != NULL) {
-			int c = gzgetc(gz);
-			if (c != EOF) {
-				gzungetc(c, gz);
+			if (!fill()) {
+				return EOF;
 			}
-			return c;
+			return (unsigned char) block[current][pos];
 		} else {
 			int c = getc(fp);
 			if (c != EOF) {
@@ -518,14 +638,58 @@ struct STREAM {
 		}
 	}
 
+	// Look at up to count bytes from the current position without consuming them
+	std::string const &peek(size_t count) {
+		char buf[4096];
+
+		while (lookahead.size() - lookahead_pos < count) {
+			size_t n = read_source(buf, std::min(sizeof(buf), count - (lookahead.size() - lookahead_pos)));
+			if (n == 0) {
+				break;
+			}
+			lookahead.append(buf, n);
+		}
+
+		if (lookahead_pos > 0) {
+			lookahead.erase(0, lookahead_pos);
+			lookahead_pos = 0;
+		}
+
+		return lookahead;
+	}
+
 	size_t read(char *out, size_t count) {
+		if (lookahead_pos < lookahead.size()) {
+			size_t n = std::min(count, lookahead.size() - lookahead_pos);
+			memcpy(out, lookahead.data() + lookahead_pos, n);
+			lookahead_pos += n;
+			return n;
+		}
+
+		return read_source(out, count);
+	}
+
+	size_t read_source(char *out, size_t count) {
 		if (gz != NULL) {
-			int ret = gzread(gz, out, count);
-			if (ret < 0) {
-				fprintf(stderr, "%s: Error reading compressed data\n", *av);
-				exit(EXIT_FAILURE);
+			if (!fill()) {
+				return 0;
 			}
-			return ret;
+
+			size_t n = std::min(count, (size_t) (block_len[current] - pos));
+			memcpy(out, block[current] + pos, n);
+			pos += n;
+
+			if (pos == block_len[current]) {
+				lock_blocks();
+				block_full[current] = false;
+				pthread_cond_broadcast(&cond);
+				unlock_blocks();
+
+				current ^= 1;
+				pos = 0;
+			}
+
+			return n;
 		} else {
 			return ::fread(out, 1, count, fp);
 		}
@@ -536,21 +700,70 @@ struct STREAM {
 	}
 };
 
+static void *run_inflater(void *v) {
+	STREAM *s = (STREAM *) v;
+
+	for (int i = 0;; i ^= 1) {
+		s->lock_blocks();
+		while (s->block_full[i] && !s->stopping) {
+			pthread_cond_wait(&s->cond, &s->lock);
+		}
+		bool stopping = s->stopping;
+		s->unlock_blocks();
+
+		if (stopping) {
+			break;
+		}
+
+		int n = gzread(s->gz, s->block[i], INFLATE_BLOCK);
+		if (n < 0) {
+			fprintf(stderr, "%s: Error reading compressed data\n", *av);
+			exit(EXIT_FAILURE);
+		}
+
+		s->lock_blocks();
+		s->block_len[i] = n;
+		s->block_full[i] = true;
+		pthread_cond_broadcast(&s->cond);
+		s->unlock_blocks();
+
+		if (n == 0) {
+			break;
+		}
+	}
+
+	return NULL;
+}
+
 static ssize_t read_stream(json_pull *j, char *buffer, size_t n) {
 	return ((STREAM *) j->source)->read(buffer, n);
 }
 
-STREAM *streamfdopen(int fd, const char *mode, std::string const &fname) {
+STREAM *streamfdopen(int fd, const char *mode, std::string const &fname, bool gzipped) {
 	STREAM *s = new STREAM;
 	s->fp = NULL;
 	s->gz = NULL;
 
-	if (fname.size() > 3 && fname.substr(fname.size() - 3) == std::string(".gz")) {
+	if (gzipped) {
 		s->gz = gzdopen(fd, mode);
 		if (s->gz == NULL) {
 			fprintf(stderr, "%s: %s: Decompression error\n", *av, fname.c_str());
 			exit(EXIT_FAILURE);
 		}
+		gzbuffer(s->gz, 128 * 1024);
+
+		for (size_t i = 0; i < 2; i++) {
+			s->block[i] = (char *) malloc(INFLATE_BLOCK);
+			if (s->block[i] == NULL) {
+				perror("Out of memory");
+				exit(EXIT_FAILURE);
+			}
+		}
+
+		if (pthread_create(&s->inflater, NULL, run_inflater, s) != 0) {
+			perror("pthread_create inflater");
+			exit(EXIT_FAILURE);
+		}
 	} else {
 		s->fp = fdopen(fd, mode);
 		if (s->fp == NULL) {
@@ -570,6 +783,282 @@ STREAM *streamfpopen(FILE *fp) {
 	return s;
 }
 
+// Files made of several gzip members, as written by bgzip or by
+// concatenating gzip files, can be inflated in parallel, since each
+// member can be inflated without reference to the others.
+
+#define INFLATE_PARALLEL_MIN (1024 * 1024)
+
+struct inflate_range_arg {
+	const unsigned char *map = NULL;
+	size_t start = 0;
+	size_t end = 0;
+	bool last = false;
+	FILE *out = NULL;
+	const char *fname = NULL;
+	bool ok = false;
+};
+
+static bool is_gzip_header(const unsigned char *p, size_t len) {
+	return len >= 10 && p[0] == 0x1F && p[1] == 0x8B && p[2] == Z_DEFLATED && (p[3] & 0xE0) == 0;
+}
+
+// Make sure that what looks like a gzip header really starts a member
+static bool gzip_member_starts(const unsigned char *p, size_t len) {
+	z_stream z;
+	memset(&z, 0, sizeof(z));
+	if (inflateInit2(&z, 16 + MAX_WBITS) != Z_OK) {
+		return false;
+	}
+
+	unsigned char buf[4096];
+	z.next_in = (Bytef *) p;
+	z.avail_in = std::min(len, (size_t) 65536);
+	z.next_out = buf;
+	z.avail_out = sizeof(buf);
+
+	int ret = inflate(&z, Z_NO_FLUSH);
+	inflateEnd(&z);
+	return ret == Z_OK || ret == Z_STREAM_END;
+}
+
+// Inflate up to want bytes from the start of a file of one or more gzip members
+static std::string gzip_head(const unsigned char *map, size_t len, size_t want) {
+	std::string out;
+
+	z_stream z;
+	memset(&z, 0, sizeof(z));
+	if (inflateInit2(&z, 16 + MAX_WBITS) != Z_OK) {
+		return out;
+	}
+
+	unsigned char buf[4096];
+	size_t pos = 0;
+
+	while (pos < len && out.size() < want) {
+		z.next_in = (Bytef *) (map + pos);
+		z.avail_in = std::min(len - pos, (size_t) INT_MAX);
+		z.next_out = buf;
+		z.avail_out = sizeof(buf);
+
+		int ret = inflate(&z, Z_NO_FLUSH);
+		if (ret != Z_OK && ret != Z_STREAM_END) {
+			break;
+		}
+
+		pos = (const unsigned char *) z.next_in - map;
+		out.append((char *) buf, sizeof(buf) - z.avail_out);
+
+		if (ret == Z_STREAM_END) {
+			if (pos >= len || !is_gzip_header(map + pos, len - pos)) {
+				break;
+			}
+			inflateReset(&z);
+		}
+	}
+
+	inflateEnd(&z);
+	if (out.size() > want) {
+		out.resize(want);
+	}
+	return out;
+}
+
+static void *run_inflate_range(void *v) {
+	inflate_range_arg *a = (inflate_range_arg *) v;
+
+	z_stream z;
+	memset(&z, 0, sizeof(z));
+	if (inflateInit2(&z, 16 + MAX_WBITS) != Z_OK) {
+		return NULL;
+	}
+
+	std::vector<unsigned char> buf;
+	buf.resize(INFLATE_BLOCK);
+
+	size_t pos = a->start;
+	bool at_boundary = false;
+
+	while (pos < a->end) {
+		z.next_in = (Bytef *) (a->map + pos);
+		z.avail_in = std::min(a->end - pos, (size_t) INT_MAX);
+		z.next_out = buf.data();
+		z.avail_out = buf.size();
+
+		int ret = inflate(&z, Z_NO_FLUSH);
+		if (ret != Z_OK && ret != Z_STREAM_END) {
+			inflateEnd(&z);
+			return NULL;
+		}
+
+		pos = (const unsigned char *) z.next_in - a->map;
+		fwrite_check(buf.data(), sizeof(char), buf.size() - z.avail_out, a->out, a->fname);
+		at_boundary = false;
+
+		if (ret == Z_STREAM_END) {
+			at_boundary = true;
+
+			if (pos < a->end && !is_gzip_header(a->map + pos, a->end - pos)) {
+				// Like gzread(), ignore anything after the last member
+				// that isn't another member
+				if (a->last) {
+					pos = a->end;
+				}
+				break;
+			}
+
+			inflateReset(&z);
+		}
+	}
+
+	inflateEnd(&z);
+	a->ok = at_boundary && pos == a->end;
+	return NULL;
+}
+
+// If fd is a multi-member gzip file whose contents will be parsed in
+// parallel, inflates each thread's share of its members into a temporary
+// file, and returns the descriptors of these files in order. *separator
+// is the -P separator, if any, and is set to the one that the contents call
+// for. Returns no descriptors if fd should be read as a stream instead.
+static std::vector<int> inflate_parallel(int fd, const char *fname, const char *tmpdir, int *separator) {
+	std::vector<int> ret;
+
+	struct stat st;
+	if (CPUS < 2 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size < INFLATE_PARALLEL_MIN || lseek(fd, 0, SEEK_CUR) != 0) {
+		return ret;
+	}
+
+	size_t len = st.st_size;
+	const unsigned char *map = (const unsigned char *) mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED) {
+		return ret;
+	}
+
+	// Inflating in parallel only helps if the parsing is also parallel,
+	// so check the start of the contents the same way as for other input
+
+	std::string head = gzip_head(map, len, DETECT_LEN);
+	if (head.size() > 0 && head[0] == 0x1E) {
+		*separator = 0x1E;
+	} else if (*separator == 0 && additional[A_DETECT_NEWLINE_DELIMITED] && is_newline_delimited(head.c_str(), head.size(), head.size() < DETECT_LEN)) {
+		*separator = '\n';
+	}
+
+	// Look for a member boundary within each thread's share of the file
+
+	std::vector<size_t> starts;
+	if (*separator != 0 && is_gzip_header(map, len)) {
+		starts.push_back(0);
+
+		for (size_t i = 1; i < CPUS; i++) {
+			size_t p = std::max(len * i / CPUS, starts.back() + 1);
+			size_t limit = len * (i + 1) / CPUS;
+
+			while (p < limit) {
+				const unsigned char *cp = (const unsigned char *) memchr(map + p, 0x1F, limit - p);
+				if (cp == NULL) {
+					p = limit;
+					break;
+				}
+
+				p = cp - map;
+				if (is_gzip_header(cp, len - p) && gzip_member_starts(cp, len - p)) {
+					break;
+				}
+				p++;
+			}
+
+			if (p < limit) {
+				starts.push_back(p);
+			}
+		}
+	}
+
+	if (starts.size() < 2) {
+		if (munmap((void *) map, len) != 0) {
+			perror("munmap compressed input");
+			exit(EXIT_FAILURE);
+		}
+		return ret;
+	}
+
+	std::vector<inflate_range_arg> args;
+	args.resize(starts.size());
+
+	for (size_t i = 0; i < starts.size(); i++) {
+		char outname[strlen(tmpdir) + strlen("/inflate.XXXXXXXX") + 1];
+		sprintf(outname, "%s%s", tmpdir, "/inflate.XXXXXXXX");
+		int outfd = mkstemp_cloexec(outname);
+		if (outfd < 0) {
+			perror(outname);
+			exit(EXIT_FAILURE);
+		}
+		args[i].out = fdopen(outfd, "w+");
+		if (args[i].out == NULL) {
+			perror(outname);
+			exit(EXIT_FAILURE);
+		}
+		unlink(outname);
+
+		args[i].map = map;
+		args[i].start = starts[i];
+		args[i].end = (i + 1 < starts.size()) ? starts[i + 1] : len;
+		args[i].last = (i + 1 == starts.size());
+		args[i].fname = fname;
+	}
+
+	std::vector<pthread_t> pthreads;
+	pthreads.resize(args.size());
+
+	for (size_t i = 0; i < args.size(); i++) {
+		if (pthread_create(&pthreads[i], NULL, run_inflate_range, &args[i]) != 0) {
+			perror("pthread_create inflate");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	bool ok = true;
+	for (size_t i = 0; i < args.size(); i++) {
+		if (pthread_join(pthreads[i], NULL) != 0) {
+			perror("pthread_join inflate");
+			exit(EXIT_FAILURE);
+		}
+		ok = ok && args[i].ok;
+	}
+
+	if (munmap((void *) map, len) != 0) {
+		perror("munmap compressed input");
+		exit(EXIT_FAILURE);
+	}
+
+	// If a boundary was a false match, the data was corrupt, or there is
+	// something gzread() would accept that this doesn't, return nothing so
+	// that it is read as a stream
+	for (size_t i = 0; i < args.size(); i++) {
+		if (fflush(args[i].out) != 0) {
+			perror("fflush inflated");
+			exit(EXIT_FAILURE);
+		}
+
+		if (ok) {
+			int piece = dup(fileno(args[i].out));
+			if (piece < 0) {
+				perror("dup inflated");
+				exit(EXIT_FAILURE);
+			}
+			ret.push_back(piece);
+		}
+
+		if (::fclose(args[i].out) != 0) {
+			perror("fclose inflated");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	return ret;
+}
+
 struct read_parallel_arg {
 	int fd = 0;
 	STREAM *fp = NULL;
@@ -684,7 +1173,7 @@ void start_parsing(int fd, STREAM *fp, long long offset, long long len, std::ato
 	parser_created = true;
 }
 
-void radix1(int *geomfds_in, int *indexfds_in, int inputs, int prefix, int splits, long long mem, const char *tmpdir, long long *availfiles, FILE *geomfile, FILE *indexfile, std::atomic<long long> *geompos_out, long long *progress, long long *progress_max, long long *progress_reported, int maxzoom, int basezoom, double droprate, double gamma, struct drop_state *ds) {
+void radix1(int *geomfds_in, int *indexfds_in, int inputs, int prefix, int splits, long long mem, const char *tmpdir, long long *availfiles, FILE *geomfile, FILE *indexfile, std::atomic<long long> *geompos_out, long long *progress, long long *progress_max, long long *progress_reported, int maxzoom, int basezoom, double droprate, double gamma, struct drop_state *ds, std::vector<segment_remap> const &remaps) {
 	// Arranged as bits to facilitate subdividing again if a subdivided file is still huge
 	int splitbits = log(splits) / log(2);
 	splits = 1 << splitbits;
@@ -902,7 +1391,7 @@ void radix1(int *geomfds_in, int *indexfds_in, int inputs, int prefix, int split
 				madvise(geommap, geomst.st_size, MADV_RANDOM);
 				madvise(geommap, geomst.st_size, MADV_WILLNEED);
 
-				merge(merges, nmerges, (unsigned char *) indexmap, indexfile, bytes, geommap, geomfile, geompos_out, progress, progress_max, progress_reported, maxzoom, gamma, ds);
+				merge(merges, nmerges, (unsigned char *) indexmap, indexfile, bytes, geommap, geomfile, geompos_out, progress, progress_max, progress_reported, maxzoom, gamma, ds, remaps);
 
 				madvise(indexmap, indexst.st_size, MADV_DONTNEED);
 				if (munmap(indexmap, indexst.st_size) < 0) {
@@ -935,8 +1424,7 @@ void radix1(int *geomfds_in, int *indexfds_in, int inputs, int prefix, int split
 					struct index ix = indexmap[a];
 					long long pos = *geompos_out;
 
-					fwrite_check(geommap + ix.start, ix.end - ix.start, 1, geomfile, "geom");
-					*geompos_out += ix.end - ix.start;
+					copy_feature(geomfile, geommap + ix.start, ix.end - ix.start, remaps, geompos_out);
 					int feature_minzoom = calc_feature_minzoom(&ix, ds, maxzoom, gamma);
 					serialize_byte(geomfile, feature_minzoom, geompos_out, "merge geometry");
 
@@ -970,7 +1458,7 @@ void radix1(int *geomfds_in, int *indexfds_in, int inputs, int prefix, int split
 				// counter backward but will be an honest estimate of the work remaining.
 				*progress_max += geomst.st_size / 4;
 
-				radix1(&geomfds[i], &indexfds[i], 1, prefix + splitbits, *availfiles / 4, mem, tmpdir, availfiles, geomfile, indexfile, geompos_out, progress, progress_max, progress_reported, maxzoom, basezoom, droprate, gamma, ds);
+				radix1(&geomfds[i], &indexfds[i], 1, prefix + splitbits, *availfiles / 4, mem, tmpdir, availfiles, geomfile, indexfile, geompos_out, progress, progress_max, progress_reported, maxzoom, basezoom, droprate, gamma, ds, remaps);
 				already_closed = 1;
 			}
 		}
@@ -1009,7 +1497,132 @@ void prep_drop_states(struct drop_state *ds, int maxzoom, int basezoom, double d
 	}
 }
 
-void radix(std::vector<struct reader> &readers, int nreaders, FILE *geomfile, FILE *indexfile, const char *tmpdir, std::atomic<long long> *geompos, int maxzoom, int basezoom, double droprate, double gamma) {
+// The next unmerged index entry of one reader, for the min-heap in merge_presorted()
+struct presorted_head {
+	struct index *ix;
+	int reader;
+
+	presorted_head(struct index *ix1, int reader1)
+	    : ix(ix1), reader(reader1) {
+	}
+};
+
+struct presorted_head_greater {
+	bool operator()(const presorted_head &a, const presorted_head &b) const {
+		int cmp = indexcmp(a.ix, b.ix);
+		if (cmp != 0) {
+			return cmp > 0;
+		}
+		return a.reader > b.reader;
+	}
+};
+
+// If every reader wrote its index in sorted order, the external sort is
+// unnecessary: just merge the readers' outputs directly into the final output.
+static void merge_presorted(std::vector<struct reader> &readers, int nreaders, FILE *geomfile, FILE *indexfile, std::atomic<long long> *geompos, long long *progress, long long *progress_max, long long *progress_reported, int maxzoom, double gamma, struct drop_state *ds, std::vector<segment_remap> const &remaps) {
+	struct index *indexmaps[nreaders];
+	char *geommaps[nreaders];
+	size_t counts[nreaders];
+	size_t next[nreaders];
+
+	for (int i = 0; i < nreaders; i++) {
+		struct stat geomst, indexst;
+		if (fstat(readers[i].geomfd, &geomst) < 0) {
+			perror("stat geom");
+			exit(EXIT_FAILURE);
+		}
+		if (fstat(readers[i].indexfd, &indexst) < 0) {
+			perror("stat index");
+			exit(EXIT_FAILURE);
+		}
+
+		counts[i] = indexst.st_size / sizeof(struct index);
+		next[i] = 0;
+		indexmaps[i] = NULL;
+		geommaps[i] = NULL;
+
+		if (counts[i] > 0) {
+			indexmaps[i] = (struct index *) mmap(NULL, indexst.st_size, PROT_READ, MAP_PRIVATE, readers[i].indexfd, 0);
+			if (indexmaps[i] == MAP_FAILED) {
+				fprintf(stderr, "fd %lld, len %lld\n", (long long) readers[i].indexfd, (long long) indexst.st_size);
+				perror("map index");
+				exit(EXIT_FAILURE);
+			}
+			madvise(indexmaps[i], indexst.st_size, MADV_SEQUENTIAL);
+			madvise(indexmaps[i], indexst.st_size, MADV_WILLNEED);
+			geommaps[i] = (char *) mmap(NULL, geomst.st_size, PROT_READ, MAP_PRIVATE, readers[i].geomfd, 0);
+			if (geommaps[i] == MAP_FAILED) {
+				perror("map geom");
+				exit(EXIT_FAILURE);
+			}
+			madvise(geommaps[i], geomst.st_size, MADV_SEQUENTIAL);
+			madvise(geommaps[i], geomst.st_size, MADV_WILLNEED);
+		}
+	}
+
+	std::priority_queue<presorted_head, std::vector<presorted_head>, presorted_head_greater> heads;
+	for (int i = 0; i < nreaders; i++) {
+		if (counts[i] > 0) {
+			heads.push(presorted_head(&indexmaps[i][0], i));
+		}
+	}
+
+	while (!heads.empty()) {
+		int which = heads.top().reader;
+		heads.pop();
+
+		struct index ix = indexmaps[which][next[which]];
+		next[which]++;
+		if (next[which] < counts[which]) {
+			heads.push(presorted_head(&indexmaps[which][next[which]], which));
+		}
+
+		long long pos = *geompos;
+		copy_feature(geomfile, geommaps[which] + ix.start, ix.end - ix.start, remaps, geompos);
+		int feature_minzoom = calc_feature_minzoom(&ix, ds, maxzoom, gamma);
+		serialize_byte(geomfile, feature_minzoom, geompos, "merge geometry");
+
+		*progress += ix.end - ix.start;
+		if (!quiet && !quiet_progress && progress_time() && 100 * *progress / *progress_max != *progress_reported) {
+			fprintf(stderr, "Reordering geometry: %lld%% \r", 100 * *progress / *progress_max);
+			*progress_reported = 100 * *progress / *progress_max;
+		}
+
+		ix.start = pos;
+		ix.end = *geompos;
+		fwrite_check(&ix, sizeof(struct index), 1, indexfile, "merge temporary");
+	}
+
+	for (int i = 0; i < nreaders; i++) {
+		if (counts[i] > 0) {
+			struct stat geomst;
+			if (fstat(readers[i].geomfd, &geomst) < 0) {
+				perror("stat geom");
+				exit(EXIT_FAILURE);
+			}
+
+			if (munmap(indexmaps[i], counts[i] * sizeof(struct index)) < 0) {
+				perror("unmap index");
+				exit(EXIT_FAILURE);
+			}
+			if (munmap(geommaps[i], geomst.st_size) < 0) {
+				perror("unmap geom");
+				exit(EXIT_FAILURE);
+			}
+		}
+
+		if (close(readers[i].geomfd) < 0) {
+			perror("close geom");
+			exit(EXIT_FAILURE);
+		}
+		if (close(readers[i].indexfd) < 0) {
+			perror("close index");
+			exit(EXIT_FAILURE);
+		}
+	}
+}
+
+void radix(std::vector<struct reader> &readers, int nreaders, FILE *geomfile, FILE *indexfile, const char *tmpdir, std::atomic<long long> *geompos, int maxzoom, int basezoom, double droprate, double gamma, std::vector<segment_remap> const &remaps) {
 	// Run through the index and geometry for each reader,
 	// splitting the contents out by index into as many
 	// sub-files as we can write to simultaneously.
@@ -1077,8 +1690,20 @@ void radix(std::vector<struct reader> &readers, int nreaders, FILE *geomfile, FI
 	prep_drop_states(ds, maxzoom, basezoom, droprate);
 
 	long long progress = 0, progress_max = geom_total, progress_reported = -1;
+
+	bool presorted = !additional[A_PREFER_RADIX_SORT];
+	for (int i = 0; i < nreaders; i++) {
+		if (!readers[i].sorted) {
+			presorted = false;
+		}
+	}
+	if (presorted) {
+		merge_presorted(readers, nreaders, geomfile, indexfile, geompos, &progress, &progress_max, &progress_reported, maxzoom, gamma, ds, remaps);
+		return;
+	}
+
 	long long availfiles_before = availfiles;
-	radix1(geomfds, indexfds, nreaders, 0, splits, mem, tmpdir, &availfiles, geomfile, indexfile, geompos, &progress, &progress_max, &progress_reported, maxzoom, basezoom, droprate, gamma, ds);
+	radix1(geomfds, indexfds, nreaders, 0, splits, mem, tmpdir, &availfiles, geomfile, indexfile, geompos, &progress, &progress_max, &progress_reported, maxzoom, basezoom, droprate, gamma, ds, remaps);
 
 	if (availfiles - 2 * nreaders != availfiles_before) {
 		fprintf(stderr, "Internal error: miscounted available file descriptors: %lld vs %lld\n", availfiles - 2 * nreaders, availfiles);
@@ -1137,9 +1762,152 @@ void choose_first_zoom(long long *file_bbox, std::vector<struct reader> &readers
 	}
 }
 
+// Merge the string pools of all the input threads into a single
+// deduplicated pool, and rewrite the metadata so that its string
+// references point into it. The merged pool and metadata are written
+// to poolfile and metafile, so segments no longer need separate pool
+// or metadata offsets. The geometry still refers to each segment's
+// own pool and metadata until the sort copies it with remaps.
+static void consolidate_pools(std::vector<struct reader> &readers, const char *tmpdir, FILE *poolfile, std::atomic<long long> *poolpos, FILE *metafile, std::atomic<long long> *metapos, std::vector<segment_remap> &remaps) {
+	char poolname[strlen(tmpdir) + strlen("/pool.XXXXXXXX") + 1];
+	sprintf(poolname, "%s%s", tmpdir, "/pool.XXXXXXXX");
+	char treename[strlen(tmpdir) + strlen("/tree.XXXXXXXX") + 1];
+	sprintf(treename, "%s%s", tmpdir, "/tree.XXXXXXXX");
+
+	int poolfd = mkstemp_cloexec(poolname);
+	if (poolfd < 0) {
+		perror(poolname);
+		exit(EXIT_FAILURE);
+	}
+	int treefd = mkstemp_cloexec(treename);
+	if (treefd < 0) {
+		perror(treename);
+		exit(EXIT_FAILURE);
+	}
+	unlink(poolname);
+	unlink(treename);
+
+	struct memfile *pool = memfile_open(poolfd);
+	if (pool == NULL) {
+		perror(poolname);
+		exit(EXIT_FAILURE);
+	}
+	struct memfile *tree = memfile_open(treefd);
+	if (tree == NULL) {
+		perror(treename);
+		exit(EXIT_FAILURE);
+	}
+
+	// To distinguish a null value
+	{
+		struct stringpool p;
+		memfile_write(tree, &p, sizeof(struct stringpool));
+	}
+
+	remaps.resize(CPUS);
+
+	for (size_t i = 0; i < CPUS; i++) {
+		struct reader *r = &readers[i];
+		std::vector<long long> &pool_from = remaps[i].pool_from;
+		std::vector<long long> &pool_to = remaps[i].pool_to;
+		std::vector<long long> &meta_from = remaps[i].meta_from;
+		std::vector<long long> &meta_to = remaps[i].meta_to;
+
+		// Strings
+
+		for (long long off = 0; off < r->poolfile->off;) {
+			char *s = r->poolfile->map + off;
+
+			pool_from.push_back(off);
+			pool_to.push_back(addpool(pool, tree, s + 1, s[0]));
+			off += strlen(s + 1) + 2;
+		}
+		memfile_close(r->poolfile);
+
+		// Metadata
+
+		if (r->metapos > 0) {
+			char *map = (char *) mmap(NULL, r->metapos, PROT_READ, MAP_PRIVATE, r->metafd, 0);
+			if (map == MAP_FAILED) {
+				perror("mmap unmerged meta");
+				exit(EXIT_FAILURE);
+			}
+			madvise(map, r->metapos, MADV_SEQUENTIAL);
+
+			for (char *m = map; m < map + r->metapos;) {
+				meta_from.push_back(m - map);
+				meta_to.push_back(*metapos);
+
+				long long count;
+				deserialize_long_long(&m, &count);
+				serialize_long_long(metafile, count, metapos, "meta");
+
+				for (long long j = 0; j < 2 * count; j++) {
+					long long off;
+					deserialize_long_long(&m, &off);
+					serialize_long_long(metafile, remap_offset(pool_from, pool_to, off), metapos, "meta");
+				}
+			}
+
+			madvise(map, r->metapos, MADV_DONTNEED);
+			if (munmap(map, r->metapos) != 0) {
+				perror("unmap unmerged meta");
+			}
+		}
+		if (close(r->metafd) != 0) {
+			perror("close unmerged meta");
+		}
+	}
+
+	if (pool->off > 0) {
+		if (fwrite(pool->map, pool->off, 1, poolfile) != 1) {
+			perror("Reunify string pool");
+			exit(EXIT_FAILURE);
+		}
+	}
+	*poolpos = pool->off;
+
+	memfile_close(pool);
+	memfile_close(tree);
+}
+
+// Reports the parse throughput of one input source for --json-progress
+// when it goes out of scope, however the reading of that source ends.
+struct input_timer {
+	std::string fname;
+	long long bytes = -1;  // -1 if the size of the input is not known
+	std::atomic<long long> *features;
+	long long features_before;
+	double start;
+
+	input_timer(std::string const &name, int fd, std::atomic<long long> *progress_seq)
+	    : fname(name),
+	      features(progress_seq),
+	      features_before(*progress_seq),
+	      start(json_logger_now()) {
+		struct stat st;
+		if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+			bytes = st.st_size;
+		}
+	}
+
+	~input_timer() {
+		logger.input(fname.c_str(), bytes, *features - features_before, json_logger_now() - start);
+	}
+};
+
 int read_input(std::vector<source> &sources, char *fname, int maxzoom, int minzoom, int basezoom, double basezoom_marker_width, sqlite3 *outdb, const char *outdir, std::set<std::string> *exclude, std::set<std::string> *include, int exclude_all, json_object *filter, double droprate, int buffer, const char *tmpdir, double gamma, int read_parallel, int forcetable, const char *attribution, bool uses_gamma, long long *file_bbox, const char *prefilter, const char *postfilter, const char *description, bool guess_maxzoom, std::map<std::string, int> const *attribute_types, const char *pgm, std::map<std::string, attribute_op> const *attribute_accum, std::map<std::string, std::string> const &attribute_descriptions, std::string const &commandline) {
 	int ret = EXIT_SUCCESS;
 
+	// Features that fail the zoom-independent parts of the filter are dropped
+	// as they are read, and only the rest of the filter is left for tiling.
+	compiled_filter compiled, residue;
+	if (filter != NULL) {
+		compiled = compile_filter(filter);
+		residue = zoom_residue(compiled);
+		ingest_filter = &compiled;
+	}
+
 	std::vector<struct reader> readers;
 	readers.resize(CPUS);
 	for (size_t i = 0; i < CPUS; i++) {
@@ -1331,6 +2099,7 @@ int read_input(std::vector<source> &sources, char *fname, int maxzoom, int minzo
 		exit(EXIT_FAILURE);
 	}
 
+	double read_start = json_logger_now();
 	size_t nsources = sources.size();
 	for (size_t source = 0; source < nsources; source++) {
 		std::string reading;
@@ -1348,6 +2117,8 @@ int read_input(std::vector<source> &sources, char *fname, int maxzoom, int minzo
 			}
 		}
 
+		input_timer timer(reading, fd, &progress_seq);
+
 		auto a = layermap.find(sources[source].layer);
 		if (a == layermap.end()) {
 			fprintf(stderr, "Internal error: couldn't find layer %s", sources[source].layer.c_str());
@@ -1531,7 +2302,7 @@ int read_input(std::vector<source> &sources, char *fname, int maxzoom, int minzo
 				sst[i].attribute_types = attribute_types;
 			}
 
-			parse_geocsv(sst, sources[source].file, layer, sources[layer].layer);
+			parse_geocsv(sst, sources[source].file, layer, sources[layer].layer, read_parallel);
 
 			if (close(fd) != 0) {
 				perror("close");
@@ -1549,7 +2320,90 @@ int read_input(std::vector<source> &sources, char *fname, int maxzoom, int minzo
 
 		int read_parallel_this = read_parallel ? '\n' : 0;
 
-		if (!(sources[source].file.size() > 3 && sources[source].file.substr(sources[source].file.size() - 3) == std::string(".gz"))) {
+		bool gzipped = sources[source].file.size() > 3 && sources[source].file.substr(sources[source].file.size() - 3) == std::string(".gz");
+		if (gzipped) {
+			int separator = read_parallel_this;
+			std::vector<int> pieces = inflate_parallel(fd, reading.c_str(), tmpdir, &separator);
+			if (pieces.size() > 0) {
+				if (close(fd) != 0) {
+					perror("close compressed input");
+					exit(EXIT_FAILURE);
+				}
+
+				// Each piece is parsed in turn from its first separator to its last.
+				// A feature can straddle the boundary between two pieces, so the
+				// text between them is put back together and parsed by itself.
+				std::string between;
+				for (size_t i = 0; i <= pieces.size(); i++) {
+					char *piece = NULL;
+					size_t len = 0;
+
+					if (i < pieces.size()) {
+						if (fstat(pieces[i], &st) != 0) {
+							perror("stat inflated");
+							exit(EXIT_FAILURE);
+						}
+						len = st.st_size;
+
+						if (len > 0) {
+							piece = (char *) mmap(NULL, len, PROT_READ, MAP_PRIVATE, pieces[i], 0);
+							if (piece == MAP_FAILED) {
+								perror("map inflated");
+								exit(EXIT_FAILURE);
+							}
+							madvise(piece, len, MADV_RANDOM);  // sequential, but from several pointers at once
+						}
+					}
+
+					size_t first = 0, last = len;
+					while (first < len && piece[first] != separator) {
+						first++;
+					}
+					if (first < len) {
+						while (piece[last - 1] != separator) {
+							last--;
+						}
+						last--;
+					}
+
+					if (first > 0) {
+						between.append(piece, first);
+					}
+					std::vector<std::pair<char *, size_t>> parse;
+					if (between.size() > 0 && (first < len || i == pieces.size())) {
+						parse.push_back(std::pair<char *, size_t>(&between[0], between.size()));
+					}
+					if (first < last) {
+						parse.push_back(std::pair<char *, size_t>(piece + first, last - first));
+					}
+
+					for (auto const &p : parse) {
+						do_read_parallel(p.first, p.second, overall_offset, reading.c_str(), &readers, &progress_seq, exclude, include, exclude_all, basezoom, layer, &layermaps, initialized, initial_x, initial_y, maxzoom, sources[layer].layer, uses_gamma, attribute_types, separator, &dist_sum, &dist_count, guess_maxzoom, prefilter != NULL || postfilter != NULL);
+						overall_offset += p.second;
+						checkdisk(&readers);
+					}
+
+					if (first < len) {
+						between.assign(piece + last, len - last);
+					}
+
+					if (i < pieces.size()) {
+						if (len > 0 && munmap(piece, len) != 0) {
+							perror("munmap inflated");
+							exit(EXIT_FAILURE);
+						}
+						if (close(pieces[i]) != 0) {
+							perror("close inflated");
+							exit(EXIT_FAILURE);
+						}
+					}
+				}
+
+				continue;
+			}
+		}
+
+		if (!gzipped) {
 			if (fstat(fd, &st) == 0) {
 				off = lseek(fd, 0, SEEK_CUR);
 				if (off >= 0) {
@@ -1565,6 +2419,11 @@ int read_input(std::vector<source> &sources, char *fname, int maxzoom, int minzo
 		if (map != NULL && map != MAP_FAILED && st.st_size - off > 0) {
 			if (map[0] == 0x1E) {
 				read_parallel_this = 0x1E;
+			} else if (!read_parallel_this && CPUS > 1 && additional[A_DETECT_NEWLINE_DELIMITED]) {
+				size_t len = std::min((size_t) (st.st_size - off), (size_t) DETECT_LEN);
+				if (is_newline_delimited(map, len, len == (size_t) (st.st_size - off))) {
+					read_parallel_this = '\n';
+				}
 			}
 
 			if (!read_parallel_this) {
@@ -1594,7 +2453,7 @@ int read_input(std::vector<source> &sources, char *fname, int maxzoom, int minzo
 				exit(EXIT_FAILURE);
 			}
 		} else {
-			STREAM *fp = streamfdopen(fd, "r", sources[layer].file);
+			STREAM *fp = streamfdopen(fd, "r", sources[layer].file, gzipped);
 			if (fp == NULL) {
 				perror(sources[layer].file.c_str());
 				if (close(fd) != 0) {
@@ -1607,6 +2466,11 @@ int read_input(std::vector<source> &sources, char *fname, int maxzoom, int minzo
 			int c = fp->peekc();
 			if (c == 0x1E) {
 				read_parallel_this = 0x1E;
+			} else if (!read_parallel_this && CPUS > 1 && additional[A_DETECT_NEWLINE_DELIMITED]) {
+				std::string const &head = fp->peek(DETECT_LEN);
+				if (is_newline_delimited(head.c_str(), head.size(), head.size() < DETECT_LEN)) {
+					read_parallel_this = '\n';
+				}
 			}
 
 			if (read_parallel_this) {
@@ -1632,53 +2496,69 @@ int read_input(std::vector<source> &sources, char *fname, int maxzoom, int minzo
 				pthread_t parallel_parser;
 				bool parser_created = false;
 
-#define READ_BUF 2000
+#define READ_BUF (1024 * 1024)
 #define PARSE_MIN 10000000
 #define PARSE_MAX (1LL * 1024 * 1024 * 1024)
 
-				char buf[READ_BUF];
-				int n;
+				std::vector<char> readbuf;
+				readbuf.resize(READ_BUF);
+				char *buf = readbuf.data();
+				ssize_t n;
 
 				while ((n = fp->read(buf, READ_BUF)) > 0) {
-					fwrite_check(buf, sizeof(char), n, readfp, reading.c_str());
-					ahead += n;
-
-					if (buf[n - 1] == read_parallel_this && ahead > PARSE_MIN) {
-						// Don't let the streaming reader get too far ahead of the parsers.
-						// If the buffered input gets huge, even if the parsers are still running,
-						// wait for the parser thread instead of continuing to stream input.
-
-						if (is_parsing == 0 || ahead >= PARSE_MAX) {
-							if (parser_created) {
-								if (pthread_join(parallel_parser, NULL) != 0) {
-									perror("pthread_join 1088");
-									exit(EXIT_FAILURE);
-								}
-								parser_created = false;
-							}
+					// Once enough has been read, hand off everything through the last
+					// separator in this block to be parsed, and start a new spool file
+					// with the rest.
+					// Don't let the streaming reader get too far ahead of the parsers.
+					// If the buffered input gets huge, even if the parsers are still running,
+					// wait for the parser thread instead of continuing to stream input.
+
+					ssize_t split = 0;
+					if (ahead + n > PARSE_MIN && (is_parsing == 0 || ahead + n >= PARSE_MAX)) {
+						for (split = n; split > 0 && buf[split - 1] != read_parallel_this; split--) {
+						}
+					}
 
-							fflush(readfp);
-							start_parsing(readfd, streamfpopen(readfp), initial_offset, ahead, &is_parsing, &parallel_parser, parser_created, reading.c_str(), &readers, &progress_seq, exclude, include, exclude_all, basezoom, layer, layermaps, initialized, initial_x, initial_y, maxzoom, sources[layer].layer, gamma != 0, attribute_types, read_parallel_this, &dist_sum, &dist_count, guess_maxzoom, prefilter != NULL || postfilter != NULL);
+					if (split == 0) {
+						fwrite_check(buf, sizeof(char), n, readfp, reading.c_str());
+						ahead += n;
+						continue;
+					}
 
-							initial_offset += ahead;
-							overall_offset += ahead;
-							checkdisk(&readers);
-							ahead = 0;
+					fwrite_check(buf, sizeof(char), split, readfp, reading.c_str());
+					ahead += split;
 
-							sprintf(readname, "%s%s", tmpdir, "/read.XXXXXXXX");
-							readfd = mkstemp_cloexec(readname);
-							if (readfd < 0) {
-								perror(readname);
-								exit(EXIT_FAILURE);
-							}
-							readfp = fdopen(readfd, "w");
-							if (readfp == NULL) {
-								perror(readname);
-								exit(EXIT_FAILURE);
-							}
-							unlink(readname);
+					if (parser_created) {
+						if (pthread_join(parallel_parser, NULL) != 0) {
+							perror("pthread_join 1088");
+							exit(EXIT_FAILURE);
 						}
+						parser_created = false;
 					}
+
+					fflush(readfp);
+					start_parsing(readfd, streamfpopen(readfp), initial_offset, ahead, &is_parsing, &parallel_parser, parser_created, reading.c_str(), &readers, &progress_seq, exclude, include, exclude_all, basezoom, layer, layermaps, initialized, initial_x, initial_y, maxzoom, sources[layer].layer, gamma != 0, attribute_types, read_parallel_this, &dist_sum, &dist_count, guess_maxzoom, prefilter != NULL || postfilter != NULL);
+
+					initial_offset += ahead;
+					overall_offset += ahead;
+					checkdisk(&readers);
+					ahead = 0;
+
+					sprintf(readname, "%s%s", tmpdir, "/read.XXXXXXXX");
+					readfd = mkstemp_cloexec(readname);
+					if (readfd < 0) {
+						perror(readname);
+						exit(EXIT_FAILURE);
+					}
+					readfp = fdopen(readfd, "w");
+					if (readfp == NULL) {
+						perror(readname);
+						exit(EXIT_FAILURE);
+					}
+					unlink(readname);
+
+					fwrite_check(buf + split, sizeof(char), n - split, readfp, reading.c_str());
+					ahead += n - split;
 				}
 				if (n < 0) {
 					perror(reading.c_str());
@@ -1765,6 +2645,9 @@ int read_input(std::vector<source> &sources, char *fname, int maxzoom, int minzo
 		ret = EXIT_FAILURE;
 	}
 
+	logger.phase("read", json_logger_now() - read_start);
+	double merge_start = json_logger_now();
+
 	if (!quiet) {
 		fprintf(stderr, "                              \r");
 		//     (stderr, "Read 10000.00 million features\r", *progress_seq / 1000000.0);
@@ -1843,41 +2726,55 @@ int read_input(std::vector<source> &sources, char *fname, int maxzoom, int minzo
 	std::atomic<long long> metapos(0);
 	std::atomic<long long> poolpos(0);
 
+	std::vector<segment_remap> remaps;
+	size_t pools = 0;
 	for (size_t i = 0; i < CPUS; i++) {
-		if (readers[i].metapos > 0) {
-			void *map = mmap(NULL, readers[i].metapos, PROT_READ, MAP_PRIVATE, readers[i].metafd, 0);
-			if (map == MAP_FAILED) {
-				perror("mmap unmerged meta");
-				exit(EXIT_FAILURE);
-			}
-			madvise(map, readers[i].metapos, MADV_SEQUENTIAL);
-			madvise(map, readers[i].metapos, MADV_WILLNEED);
-			if (fwrite(map, readers[i].metapos, 1, metafile) != 1) {
-				perror("Reunify meta");
-				exit(EXIT_FAILURE);
-			}
-			madvise(map, readers[i].metapos, MADV_DONTNEED);
-			if (munmap(map, readers[i].metapos) != 0) {
-				perror("unmap unmerged meta");
-			}
+		if (readers[i].poolfile->off > 0) {
+			pools++;
 		}
+	}
 
-		meta_off[i] = metapos;
-		metapos += readers[i].metapos;
-		if (close(readers[i].metafd) != 0) {
-			perror("close unmerged meta");
-		}
+	if (pools > 1) {
+		// Several input threads have strings, which probably overlap,
+		// so combine them into one pool shared by all segments.
+		consolidate_pools(readers, tmpdir, poolfile, &poolpos, metafile, &metapos, remaps);
+	} else {
+		for (size_t i = 0; i < CPUS; i++) {
+			if (readers[i].metapos > 0) {
+				void *map = mmap(NULL, readers[i].metapos, PROT_READ, MAP_PRIVATE, readers[i].metafd, 0);
+				if (map == MAP_FAILED) {
+					perror("mmap unmerged meta");
+					exit(EXIT_FAILURE);
+				}
+				madvise(map, readers[i].metapos, MADV_SEQUENTIAL);
+				madvise(map, readers[i].metapos, MADV_WILLNEED);
+				if (fwrite(map, readers[i].metapos, 1, metafile) != 1) {
+					perror("Reunify meta");
+					exit(EXIT_FAILURE);
+				}
+				madvise(map, readers[i].metapos, MADV_DONTNEED);
+				if (munmap(map, readers[i].metapos) != 0) {
+					perror("unmap unmerged meta");
+				}
+			}
 
-		if (readers[i].poolfile->off > 0) {
-			if (fwrite(readers[i].poolfile->map, readers[i].poolfile->off, 1, poolfile) != 1) {
-				perror("Reunify string pool");
-				exit(EXIT_FAILURE);
+			meta_off[i] = metapos;
+			metapos += readers[i].metapos;
+			if (close(readers[i].metafd) != 0) {
+				perror("close unmerged meta");
+			}
+
+			if (readers[i].poolfile->off > 0) {
+				if (fwrite(readers[i].poolfile->map, readers[i].poolfile->off, 1, poolfile) != 1) {
+					perror("Reunify string pool");
+					exit(EXIT_FAILURE);
+				}
 			}
-		}
 
-		pool_off[i] = poolpos;
-		poolpos += readers[i].poolfile->off;
-		memfile_close(readers[i].poolfile);
+			pool_off[i] = poolpos;
+			poolpos += readers[i].poolfile->off;
+			memfile_close(readers[i].poolfile);
+		}
 	}
 
 	if (fclose(poolfile) != 0) {
@@ -1953,7 +2850,12 @@ int read_input(std::vector<source> &sources, char *fname, int maxzoom, int minzo
 	serialize_uint(geomfile, ix, &geompos, fname);
 	serialize_uint(geomfile, iy, &geompos, fname);
 
-	radix(readers, CPUS, geomfile, indexfile, tmpdir, &geompos, maxzoom, basezoom, droprate, gamma);
+	logger.phase("merge", json_logger_now() - merge_start);
+	double sort_start = json_logger_now();
+	radix(readers, CPUS, geomfile, indexfile, tmpdir, &geompos, maxzoom, basezoom, droprate, gamma, remaps);
+	remaps.clear();  // the sorted geometry refers only to the consolidated pool
+	logger.phase("sort", json_logger_now() - sort_start);
+	double analyze_start = json_logger_now();
 
 	/* end of tile */
 	serialize_byte(geomfile, -2, &geompos, fname);
@@ -1974,6 +2876,7 @@ int read_input(std::vector<source> &sources, char *fname, int maxzoom, int minzo
 	}
 	std::atomic<long long> indexpos(indexst.st_size);
 	progress_seq = indexpos / sizeof(struct index);
+	logger.temp_written += geompos + indexpos + metapos + poolpos;
 
 	last_progress = 0;
 	if (!quiet) {
@@ -2339,7 +3242,13 @@ int read_input(std::vector<source> &sources, char *fname, int maxzoom, int minzo
 
 	std::atomic<unsigned> midx(0);
 	std::atomic<unsigned> midy(0);
-	int written = traverse_zooms(fd, size, meta, stringpool, &midx, &midy, maxzoom, minzoom, outdb, outdir, buffer, fname, tmpdir, gamma, full_detail, low_detail, min_detail, meta_off, pool_off, initial_x, initial_y, simplification, layermaps, prefilter, postfilter, attribute_accum, filter);
+	ingest_filter = NULL;
+
+	logger.phase("analyze", json_logger_now() - analyze_start);
+	double tile_start = json_logger_now();
+	int written = traverse_zooms(fd, size, meta, stringpool, &midx, &midy, maxzoom, minzoom, outdb, outdir, buffer, fname, tmpdir, gamma, full_detail, low_detail, min_detail, meta_off, pool_off, initial_x, initial_y, simplification, layermaps, prefilter, postfilter, attribute_accum, residue.empty() ? NULL : &residue);
+
+	logger.phase("tile", json_logger_now() - tile_start);
 
 	if (maxzoom != written) {
 		if (written > minzoom) {
@@ -2401,7 +3310,9 @@ int read_input(std::vector<source> &sources, char *fname, int maxzoom, int minzo
 		ai->second.maxzoom = maxzoom;
 	}
 
+	double metadata_start = json_logger_now();
 	mbtiles_write_metadata(outdb, outdir, fname, minzoom, maxzoom, minlat, minlon, maxlat, maxlon, midlat, midlon, forcetable, attribution, merged_lm, true, description, !prevent[P_TILE_STATS], attribute_descriptions, "tippecanoe", commandline);
+	logger.phase("metadata", json_logger_now() - metadata_start);
 
 	return ret;
 }
@@ -2583,6 +3494,7 @@ int main(int argc, char **argv) {
 
 		{"Parallel processing of input", 0, 0, 0},
 		{"read-parallel", no_argument, 0, 'P'},
+		{"detect-newline-delimited", no_argument, &additional[A_DETECT_NEWLINE_DELIMITED], 1},
 
 		{"Projection of input", 0, 0, 0},
 		{"projection", required_argument, 0, 's'},
@@ -2672,6 +3584,9 @@ int main(int argc, char **argv) {
 		{"Filtering tile contents", 0, 0, 0},
 		{"prefilter", required_argument, 0, 'C'},
 		{"postfilter", required_argument, 0, 'c'},
+		{"postfilter-format", required_argument, 0, '~'},
+		{"persistent-filters", no_argument, &additional[A_PERSISTENT_FILTERS], 1},
+		{"filter-plugin", required_argument, 0, '~'},
 
 		{"Setting or disabling tile size limits", 0, 0, 0},
 		{"maximum-tile-bytes", required_argument, 0, 'M'},
@@ -2686,12 +3601,15 @@ int main(int argc, char **argv) {
 
 		{"Temporary storage", 0, 0, 0},
 		{"temporary-directory", required_argument, 0, 't'},
+		{"preallocate-temporary-files", no_argument, &memfile_preallocate, 1},
 
 		{"Progress indicator", 0, 0, 0},
 		{"quiet", no_argument, 0, 'q'},
 		{"no-progress-indicator", no_argument, 0, 'Q'},
 		{"progress-interval", required_argument, 0, 'U'},
 		{"json-progress", no_argument, 0, 'u'},
+		{"tile-profile", required_argument, 0, '~'},
+		{"trace", required_argument, 0, '~'},
 		{"version", no_argument, 0, 'v'},
 
 		{"", 0, 0, 0},
@@ -2770,6 +3688,21 @@ int main(int argc, char **argv) {
 				}
 			} else if (strcmp(opt, "use-attribute-for-id") == 0) {
 				attribute_for_id = optarg;
+			} else if (strcmp(opt, "filter-plugin") == 0) {
+				load_filter_plugin(optarg);
+			} else if (strcmp(opt, "tile-profile") == 0) {
+				logger.open_profile(optarg);
+			} else if (strcmp(opt, "trace") == 0) {
+				logger.open_trace(optarg);
+			} else if (strcmp(opt, "postfilter-format") == 0) {
+				if (strcmp(optarg, "mvt") == 0) {
+					postfilter_mvt = true;
+				} else if (strcmp(optarg, "geojson") == 0) {
+					postfilter_mvt = false;
+				} else {
+					fprintf(stderr, "%s: Unknown postfilter format --%s=%s\n", argv[0], opt, optarg);
+					exit(EXIT_FAILURE);
+				}
 			} else {
 				fprintf(stderr, "%s: Unrecognized option --%s\n", argv[0], opt);
 				exit(EXIT_FAILURE);
@@ -3263,6 +4196,9 @@ int main(int argc, char **argv) {
 	if (outdb != NULL) {
 		mbtiles_close(outdb, argv[0]);
 	}
+	logger.summary();
+	logger.close_profile();
+	logger.close_trace();
 
 #ifdef MTRACE
 	muntrace();
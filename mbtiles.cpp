@@ -11,6 +11,7 @@
 #include <string>
 #include <set>
 #include <map>
+#include <algorithm>
 #include <sys/stat.h>
 #include "mvt.hpp"
 #include "mbtiles.hpp"
@@ -130,7 +131,7 @@ void tilestats(std::map<std::string, layermap_entry> const &layermap1, size_t el
 	state.json_write_string("layers");
 	state.json_write_array();
 
-	for (auto layer : layermap) {
+	for (auto const &layer : layermap) {
 		state.nospace = true;
 		state.json_write_hash();
 
@@ -168,7 +169,7 @@ void tilestats(std::map<std::string, layermap_entry> const &layermap1, size_t el
 		state.json_write_array();
 
 		size_t attrs = 0;
-		for (auto attribute : layer.second.file_keys) {
+		for (auto const &attribute : layer.second.file_keys) {
 			if (attrs == elements) {
 				break;
 			}
@@ -191,7 +192,7 @@ void tilestats(std::map<std::string, layermap_entry> const &layermap1, size_t el
 			state.json_write_unsigned(val_count);
 
 			int type = 0;
-			for (auto s : attribute.second.sample_values) {
+			for (auto const &s : attribute.second.sample_values) {
 				type |= (1 << s.type);
 			}
 
@@ -216,7 +217,7 @@ void tilestats(std::map<std::string, layermap_entry> const &layermap1, size_t el
 			state.json_write_array();
 
 			size_t vals = 0;
-			for (auto value : attribute.second.sample_values) {
+			for (auto const &value : attribute.second.sample_values) {
 				if (vals == elements) {
 					break;
 				}
@@ -442,7 +443,7 @@ void mbtiles_write_metadata(sqlite3 *outdb, const char *outdir, const char *fnam
 					auto f = attribute_descriptions.find(j->first);
 					if (f == attribute_descriptions.end()) {
 						int type = 0;
-						for (auto s : j->second.sample_values) {
+						for (auto const &s : j->second.sample_values) {
 							type |= (1 << s.type);
 						}
 
@@ -556,6 +557,26 @@ std::map<std::string, layermap_entry> merge_layermaps(std::vector<std::map<std::
 	return merge_layermaps(maps, false);
 }
 
+// Merge two sorted lists of sample values, keeping the lowest-sorting ones
+static void merge_sample_values(std::vector<type_and_string> &into, std::vector<type_and_string> const &from) {
+	std::vector<type_and_string> out;
+	out.reserve(std::min(into.size() + from.size(), max_tilestats_sample_values));
+
+	size_t i = 0, j = 0;
+	while (out.size() < max_tilestats_sample_values && (i < into.size() || j < from.size())) {
+		if (j >= from.size() || (i < into.size() && into[i] < from[j])) {
+			out.push_back(std::move(into[i++]));
+		} else if (i >= into.size() || from[j] < into[i]) {
+			out.push_back(from[j++]);
+		} else {
+			out.push_back(std::move(into[i++]));
+			j++;
+		}
+	}
+
+	into.swap(out);
+}
+
 std::map<std::string, layermap_entry> merge_layermaps(std::vector<std::map<std::string, layermap_entry>> const &maps, bool trunc) {
 	std::map<std::string, layermap_entry> out;
 
@@ -595,16 +616,7 @@ std::map<std::string, layermap_entry> merge_layermaps(std::vector<std::map<std::
 				if (fk2 == out_entry->second.file_keys.end()) {
 					out_entry->second.file_keys.insert(std::pair<std::string, type_and_string_stats>(attribname, fk->second));
 				} else {
-					for (auto val : fk->second.sample_values) {
-						auto pt = std::lower_bound(fk2->second.sample_values.begin(), fk2->second.sample_values.end(), val);
-						if (pt == fk2->second.sample_values.end() || *pt != val) {  // not found
-							fk2->second.sample_values.insert(pt, val);
-
-							if (fk2->second.sample_values.size() > max_tilestats_sample_values) {
-								fk2->second.sample_values.pop_back();
-							}
-						}
-					}
+					merge_sample_values(fk2->second.sample_values, fk->second.sample_values);
 
 					fk2->second.type |= fk->second.type;
 
@@ -633,41 +645,71 @@ std::map<std::string, layermap_entry> merge_layermaps(std::vector<std::map<std::
 	return out;
 }
 
-void add_to_file_keys(std::map<std::string, type_and_string_stats> &file_keys, std::string const &attrib, type_and_string const &val) {
-	if (val.type == mvt_null) {
+// Compare a value to a sample value, in the same order as type_and_string::operator<
+static int sample_compare(int type, std::string const &string, type_and_string const &o) {
+	int cmp = string.compare(o.string);
+	if (cmp != 0) {
+		return cmp;
+	}
+	return type - o.type;
+}
+
+void add_to_file_keys(std::map<std::string, type_and_string_stats> &file_keys, std::string const &attrib, int type, std::string const &string) {
+	if (type == mvt_null) {
 		return;
 	}
 
 	auto fka = file_keys.find(attrib);
 	if (fka == file_keys.end()) {
-		file_keys.insert(std::pair<std::string, type_and_string_stats>(attrib, type_and_string_stats()));
-		fka = file_keys.find(attrib);
+		fka = file_keys.insert(std::pair<std::string, type_and_string_stats>(attrib, type_and_string_stats())).first;
 	}
 
-	if (fka == file_keys.end()) {
-		fprintf(stderr, "Can't happen (tilestats)\n");
-		exit(EXIT_FAILURE);
+	type_and_string_stats &stats = fka->second;
+
+	if (type == mvt_double) {
+		double d = atof(string.c_str());
+
+		if (d < stats.min) {
+			stats.min = d;
+		}
+		if (d > stats.max) {
+			stats.max = d;
+		}
 	}
 
-	if (val.type == mvt_double) {
-		double d = atof(val.string.c_str());
+	stats.type |= (1 << type);
 
-		if (d < fka->second.min) {
-			fka->second.min = d;
+	// Only the lowest-sorting values are kept, so once the samples are full,
+	// most values can be turned away with a single comparison
+	std::vector<type_and_string> &samples = stats.sample_values;
+	if (samples.size() >= max_tilestats_sample_values) {
+		if (samples.size() == 0 || sample_compare(type, string, samples.back()) >= 0) {
+			return;
 		}
-		if (d > fka->second.max) {
-			fka->second.max = d;
+	}
+
+	size_t lo = 0, hi = samples.size();
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (sample_compare(type, string, samples[mid]) > 0) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
 		}
 	}
 
-	auto pt = std::lower_bound(fka->second.sample_values.begin(), fka->second.sample_values.end(), val);
-	if (pt == fka->second.sample_values.end() || *pt != val) {  // not found
-		fka->second.sample_values.insert(pt, val);
+	if (lo == samples.size() || sample_compare(type, string, samples[lo]) != 0) {  // not found
+		type_and_string val;
+		val.type = type;
+		val.string = string;
+		samples.insert(samples.begin() + lo, val);
 
-		if (fka->second.sample_values.size() > max_tilestats_sample_values) {
-			fka->second.sample_values.pop_back();
+		if (samples.size() > max_tilestats_sample_values) {
+			samples.pop_back();
 		}
 	}
+}
 
-	fka->second.type |= (1 << val.type);
+void add_to_file_keys(std::map<std::string, type_and_string_stats> &file_keys, std::string const &attrib, type_and_string const &val) {
+	add_to_file_keys(file_keys, attrib, val.type, val.string);
 }
@@ -53,5 +53,6 @@ std::map<std::string, layermap_entry> merge_layermaps(std::vector<std::map<std::
 std::map<std::string, layermap_entry> merge_layermaps(std::vector<std::map<std::string, layermap_entry> > const &maps, bool trunc);
 
 void add_to_file_keys(std::map<std::string, type_and_string_stats> &file_keys, std::string const &layername, type_and_string const &val);
+void add_to_file_keys(std::map<std::string, type_and_string_stats> &file_keys, std::string const &attrib, int type, std::string const &string);
 
 #endif
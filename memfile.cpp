@@ -1,12 +1,39 @@
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE  // for mremap() and fallocate()
+#endif
+
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
 #include <sys/mman.h>
 #include "memfile.hpp"
 
 #define INCREMENT 131072
 #define INITIAL 256
 
+int memfile_preallocate = 0;
+
+// Extend the file to the new length. With memfile_preallocate, also reserve
+// the disk space for it where the filesystem allows, so that running out of
+// space is reported here rather than as a bus error when the mapping is
+// written to, at the cost of reserving space that may never be used.
+static int memfile_extend(struct memfile *file, long long len) {
+#ifdef __linux__
+	if (memfile_preallocate) {
+		if (fallocate(file->fd, 0, file->len, len - file->len) == 0) {
+			return 0;
+		}
+		if (errno != EOPNOTSUPP && errno != ENOSYS) {
+			return -1;
+		}
+	}
+#endif
+
+	return ftruncate(file->fd, len);
+}
+
 struct memfile *memfile_open(int fd) {
 	if (ftruncate(fd, INITIAL) != 0) {
 		return NULL;
@@ -49,20 +76,36 @@ int memfile_close(struct memfile *file) {
 
 int memfile_write(struct memfile *file, void *s, long long len) {
 	if (file->off + len > file->len) {
-		if (munmap(file->map, file->len) != 0) {
-			return -1;
+		// Grow geometrically, so that huge pools don't need to be
+		// remapped over and over again.
+		long long newlen = file->len + file->len / 2;
+		if (newlen < file->off + len) {
+			newlen = file->off + len;
 		}
+		newlen = (newlen + INCREMENT - 1) / INCREMENT * INCREMENT;
 
-		file->len += (len + INCREMENT + 1) / INCREMENT * INCREMENT;
+		if (memfile_extend(file, newlen) != 0) {
+			return -1;
+		}
 
-		if (ftruncate(file->fd, file->len) != 0) {
+#ifdef MREMAP_MAYMOVE
+		char *map = (char *) mremap(file->map, file->len, newlen, MREMAP_MAYMOVE);
+		if (map == MAP_FAILED) {
+			return -1;
+		}
+#else
+		if (munmap(file->map, file->len) != 0) {
 			return -1;
 		}
 
-		file->map = (char *) mmap(NULL, file->len, PROT_READ | PROT_WRITE, MAP_SHARED, file->fd, 0);
-		if (file->map == MAP_FAILED) {
+		char *map = (char *) mmap(NULL, newlen, PROT_READ | PROT_WRITE, MAP_SHARED, file->fd, 0);
+		if (map == MAP_FAILED) {
 			return -1;
 		}
+#endif
+
+		file->map = map;
+		file->len = newlen;
 	}
 
 	memcpy(file->map + file->off, s, len);
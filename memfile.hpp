@@ -15,6 +15,9 @@ struct memfile {
 	}
 };
 
+// Reserve disk space for memfiles as they grow, with --preallocate-temporary-files
+extern int memfile_preallocate;
+
 struct memfile *memfile_open(int fd);
 int memfile_close(struct memfile *file);
 int memfile_write(struct memfile *file, void *s, long long len);
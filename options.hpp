@@ -25,6 +25,8 @@
 #define A_GENERATE_IDS ((int) 'i')
 #define A_CONVERT_NUMERIC_IDS ((int) 'I')
 #define A_HILBERT ((int) 'h')
+#define A_PERSISTENT_FILTERS ((int) 'F')
+#define A_DETECT_NEWLINE_DELIMITED ((int) 'j')
 
 #define P_SIMPLIFY ((int) 's')
 #define P_SIMPLIFY_LOW ((int) 'S')
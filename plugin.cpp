@@ -18,12 +18,14 @@
 #include <sys/wait.h>
 #include <sqlite3.h>
 #include <limits.h>
+#include <dlfcn.h>
 #include "main.hpp"
 #include "mvt.hpp"
 #include "mbtiles.hpp"
 #include "projection.hpp"
 #include "geometry.hpp"
 #include "serial.hpp"
+#include "options.hpp"
 
 extern "C" {
 #include "jsonpull/jsonpull.h"
@@ -32,37 +34,81 @@ extern "C" {
 #include "plugin.hpp"
 #include "write_json.hpp"
 #include "read_json.hpp"
+#include "filter-plugin.h"
 
 struct writer_arg {
-	int write_to;
+	FILE *fp;
 	std::vector<mvt_layer> *layers;
 	unsigned z;
 	unsigned x;
 	unsigned y;
 	int extent;
+	bool framed;
+	bool mvt;
 };
 
+static void warn_postfilter_pipe() {
+	static bool warned = false;
+	if (!warned) {
+		fprintf(stderr, "Warning: broken pipe in postfilter\n");
+		warned = true;
+	}
+}
+
 void *run_writer(void *a) {
 	writer_arg *wa = (writer_arg *) a;
 
-	FILE *fp = fdopen(wa->write_to, "w");
-	if (fp == NULL) {
-		perror("fdopen (pipe writer)");
-		exit(EXIT_FAILURE);
-	}
+	if (wa->mvt) {
+		mvt_tile tile;
+		tile.layers = *(wa->layers);
+		std::string data = tile.encode();
+
+		if (wa->framed) {
+			fprintf(wa->fp, "%u %u %u %zu\n", wa->z, wa->x, wa->y, data.size());
+		}
+		if (fwrite(data.c_str(), sizeof(char), data.size(), wa->fp) != data.size()) {
+			if (wa->framed) {
+				if (errno == EPIPE) {
+					fprintf(stderr, "Persistent postfilter stopped reading before the end of tile %u/%u/%u\n", wa->z, wa->x, wa->y);
+				} else {
+					fprintf(stderr, "write output to postfilter: %s\n", strerror(errno));
+				}
+				exit(EXIT_FAILURE);
+			}
+
+			if (errno == EPIPE) {
+				warn_postfilter_pipe();
+				fclose(wa->fp);
+				return NULL;
+			}
+
+			perror("write output to postfilter");
+			exit(EXIT_FAILURE);
+		}
+
+		if (wa->framed) {
+			flush_filter(wa->fp, wa->z, wa->x, wa->y, "postfilter");
+			return NULL;
+		}
+	} else {
+		if (wa->framed) {
+			write_filter_begin(wa->fp, wa->z, wa->x, wa->y);
+		}
+
+		json_writer state(wa->fp);
+		for (size_t i = 0; i < wa->layers->size(); i++) {
+			layer_to_geojson((*(wa->layers))[i], wa->z, wa->x, wa->y, false, true, false, true, 0, 0, 0, true, state);
+		}
 
-	json_writer state(fp);
-	for (size_t i = 0; i < wa->layers->size(); i++) {
-		layer_to_geojson((*(wa->layers))[i], wa->z, wa->x, wa->y, false, true, false, true, 0, 0, 0, true, state);
+		if (wa->framed) {
+			write_filter_end(wa->fp, wa->z, wa->x, wa->y, "postfilter");
+			return NULL;
+		}
 	}
 
-	if (fclose(fp) != 0) {
+	if (fclose(wa->fp) != 0) {
 		if (errno == EPIPE) {
-			static bool warned = false;
-			if (!warned) {
-				fprintf(stderr, "Warning: broken pipe in postfilter\n");
-				warned = true;
-			}
+			warn_postfilter_pipe();
 		} else {
 			perror("fclose output to filter");
 			exit(EXIT_FAILURE);
@@ -83,16 +129,63 @@ static std::vector<mvt_geometry> to_feature(drawvec &geom) {
 	return out;
 }
 
-// Reads from the postfilter
-std::vector<mvt_layer> parse_layers(int fd, int z, unsigned x, unsigned y, std::vector<std::map<std::string, layermap_entry>> *layermaps, size_t tiling_seg, std::vector<std::vector<std::string>> *layer_unmaps, int extent) {
-	std::map<std::string, mvt_layer> ret;
+static drawvec clean_filtered_geometry(drawvec &dv, int t) {
+	if (t == VT_POLYGON) {
+		dv = clean_or_clip_poly(dv, 0, 0, false);
+		if (dv.size() < 3) {
+			dv.clear();
+		}
+	}
+	dv = remove_noop(dv, t, 0);
+	if (t == VT_POLYGON) {
+		dv = close_poly(dv);
+	}
+	return dv;
+}
+
+// Finds or creates the layermap entry for a layer that came out of the postfilter
+// and counts a feature of the specified type in it
+static std::map<std::string, layermap_entry>::iterator filtered_layermap_entry(std::string const &layername, int type, int z, std::vector<std::map<std::string, layermap_entry>> *layermaps, size_t tiling_seg, std::vector<std::vector<std::string>> *layer_unmaps) {
+	std::map<std::string, layermap_entry> &layermap = (*layermaps)[tiling_seg];
+	if (layermap.count(layername) == 0) {
+		layermap_entry lme = layermap_entry(layermap.size());
+		lme.minzoom = z;
+		lme.maxzoom = z;
 
-	FILE *f = fdopen(fd, "r");
-	if (f == NULL) {
-		perror("fdopen filter output");
+		layermap.insert(std::pair<std::string, layermap_entry>(layername, lme));
+
+		if (lme.id >= (*layer_unmaps)[tiling_seg].size()) {
+			(*layer_unmaps)[tiling_seg].resize(lme.id + 1);
+			(*layer_unmaps)[tiling_seg][lme.id] = layername;
+		}
+	}
+
+	auto fk = layermap.find(layername);
+	if (fk == layermap.end()) {
+		fprintf(stderr, "Internal error: layer %s not found\n", layername.c_str());
 		exit(EXIT_FAILURE);
 	}
-	json_pull *jp = json_begin_file(f);
+	if (z < fk->second.minzoom) {
+		fk->second.minzoom = z;
+	}
+	if (z > fk->second.maxzoom) {
+		fk->second.maxzoom = z;
+	}
+
+	if (type == mvt_point) {
+		fk->second.points++;
+	} else if (type == mvt_linestring) {
+		fk->second.lines++;
+	} else if (type == mvt_polygon) {
+		fk->second.polygons++;
+	}
+
+	return fk;
+}
+
+// Reads from the postfilter
+std::vector<mvt_layer> parse_layers(json_pull *jp, int z, unsigned x, unsigned y, std::vector<std::map<std::string, layermap_entry>> *layermaps, size_t tiling_seg, std::vector<std::vector<std::string>> *layer_unmaps, int extent, bool framed) {
+	std::map<std::string, mvt_layer> ret;
 
 	while (1) {
 		json_object *j = json_read(jp);
@@ -104,6 +197,10 @@ std::vector<mvt_layer> parse_layers(int fd, int z, unsigned x, unsigned y, std::
 				}
 				exit(EXIT_FAILURE);
 			}
+			if (framed) {
+				fprintf(stderr, "Filter output:%d: postfilter exited before the end of tile %d/%u/%u\n", jp->line, z, x, y);
+				exit(EXIT_FAILURE);
+			}
 
 			json_free(jp->root);
 			break;
@@ -113,6 +210,10 @@ std::vector<mvt_layer> parse_layers(int fd, int z, unsigned x, unsigned y, std::
 		if (type == NULL || type->type != JSON_STRING) {
 			continue;
 		}
+		if (framed && strcmp(type->string, "TileEnd") == 0) {
+			json_free(j);
+			break;
+		}
 		if (strcmp(type->string, "Feature") != 0) {
 			continue;
 		}
@@ -198,16 +299,7 @@ std::vector<mvt_layer> parse_layers(int fd, int z, unsigned x, unsigned y, std::
 			dv[i].y = std::round((dv[i].y - scale * y) * extent / (double) scale);
 		}
 
-		if (mb_geometry[t] == VT_POLYGON) {
-			dv = clean_or_clip_poly(dv, 0, 0, false);
-			if (dv.size() < 3) {
-				dv.clear();
-			}
-		}
-		dv = remove_noop(dv, mb_geometry[t], 0);
-		if (mb_geometry[t] == VT_POLYGON) {
-			dv = close_poly(dv);
-		}
+		dv = clean_filtered_geometry(dv, mb_geometry[t]);
 
 		if (dv.size() > 0) {
 			mvt_feature feature;
@@ -220,39 +312,7 @@ std::vector<mvt_layer> parse_layers(int fd, int z, unsigned x, unsigned y, std::
 				feature.has_id = true;
 			}
 
-			std::map<std::string, layermap_entry> &layermap = (*layermaps)[tiling_seg];
-			if (layermap.count(layername) == 0) {
-				layermap_entry lme = layermap_entry(layermap.size());
-				lme.minzoom = z;
-				lme.maxzoom = z;
-
-				layermap.insert(std::pair<std::string, layermap_entry>(layername, lme));
-
-				if (lme.id >= (*layer_unmaps)[tiling_seg].size()) {
-					(*layer_unmaps)[tiling_seg].resize(lme.id + 1);
-					(*layer_unmaps)[tiling_seg][lme.id] = layername;
-				}
-			}
-
-			auto fk = layermap.find(layername);
-			if (fk == layermap.end()) {
-				fprintf(stderr, "Internal error: layer %s not found\n", layername.c_str());
-				exit(EXIT_FAILURE);
-			}
-			if (z < fk->second.minzoom) {
-				fk->second.minzoom = z;
-			}
-			if (z > fk->second.maxzoom) {
-				fk->second.maxzoom = z;
-			}
-
-			if (feature.type == mvt_point) {
-				fk->second.points++;
-			} else if (feature.type == mvt_linestring) {
-				fk->second.lines++;
-			} else if (feature.type == mvt_polygon) {
-				fk->second.polygons++;
-			}
+			auto fk = filtered_layermap_entry(layername, feature.type, z, layermaps, tiling_seg, layer_unmaps);
 
 			for (size_t i = 0; i < properties->length; i++) {
 				int tp = -1;
@@ -281,12 +341,6 @@ std::vector<mvt_layer> parse_layers(int fd, int z, unsigned x, unsigned y, std::
 		json_free(j);
 	}
 
-	json_end(jp);
-	if (fclose(f) != 0) {
-		perror("fclose postfilter output");
-		exit(EXIT_FAILURE);
-	}
-
 	std::vector<mvt_layer> final;
 	for (auto a : ret) {
 		final.push_back(a.second);
@@ -295,7 +349,7 @@ std::vector<mvt_layer> parse_layers(int fd, int z, unsigned x, unsigned y, std::
 }
 
 // Reads from the prefilter
-serial_feature parse_feature(json_pull *jp, int z, unsigned x, unsigned y, std::vector<std::map<std::string, layermap_entry>> *layermaps, size_t tiling_seg, std::vector<std::vector<std::string>> *layer_unmaps, bool postfilter) {
+serial_feature parse_feature(json_pull *jp, int z, unsigned x, unsigned y, std::vector<std::map<std::string, layermap_entry>> *layermaps, size_t tiling_seg, std::vector<std::vector<std::string>> *layer_unmaps, bool postfilter, bool framed) {
 	serial_feature sf;
 
 	while (1) {
@@ -308,6 +362,10 @@ serial_feature parse_feature(json_pull *jp, int z, unsigned x, unsigned y, std::
 				}
 				exit(EXIT_FAILURE);
 			}
+			if (framed) {
+				fprintf(stderr, "Filter output:%d: prefilter exited before the end of tile %d/%u/%u\n", jp->line, z, x, y);
+				exit(EXIT_FAILURE);
+			}
 
 			json_free(jp->root);
 			sf.t = -1;
@@ -318,6 +376,11 @@ serial_feature parse_feature(json_pull *jp, int z, unsigned x, unsigned y, std::
 		if (type == NULL || type->type != JSON_STRING) {
 			continue;
 		}
+		if (framed && strcmp(type->string, "TileEnd") == 0) {
+			json_free(j);
+			sf.t = -1;
+			return sf;
+		}
 		if (strcmp(type->string, "Feature") != 0) {
 			continue;
 		}
@@ -522,14 +585,203 @@ serial_feature parse_feature(json_pull *jp, int z, unsigned x, unsigned y, std::
 	}
 }
 
+// Reads a vector tile from the postfilter, with its geometry cleaned and
+// its attributes accounted for in the same way as by parse_layers()
+static std::vector<mvt_layer> parse_mvt_layers(std::string &message, int z, unsigned x, unsigned y, std::vector<std::map<std::string, layermap_entry>> *layermaps, size_t tiling_seg, std::vector<std::vector<std::string>> *layer_unmaps, int extent) {
+	std::map<std::string, mvt_layer> ret;
+
+	mvt_tile tile;
+	bool was_compressed;
+	if (!tile.decode(message, was_compressed)) {
+		fprintf(stderr, "Filter output: can't decode vector tile %d/%u/%u\n", z, x, y);
+		exit(EXIT_FAILURE);
+	}
+
+	for (size_t i = 0; i < tile.layers.size(); i++) {
+		mvt_layer &layer = tile.layers[i];
+		if (layer.extent <= 0) {
+			fprintf(stderr, "Filter output: layer %s in tile %d/%u/%u has no extent\n", layer.name.c_str(), z, x, y);
+			exit(EXIT_FAILURE);
+		}
+		double scale = (double) extent / layer.extent;
+
+		for (size_t j = 0; j < layer.features.size(); j++) {
+			mvt_feature &feature = layer.features[j];
+			if (feature.type != mvt_point && feature.type != mvt_linestring && feature.type != mvt_polygon) {
+				continue;
+			}
+
+			// ClosePath becomes an explicit return to the start of the ring,
+			// as it would have been in GeoJSON
+			drawvec dv;
+			long long startx = 0, starty = 0;
+			for (size_t k = 0; k < feature.geometry.size(); k++) {
+				mvt_geometry &g = feature.geometry[k];
+
+				if (g.op == mvt_closepath) {
+					dv.push_back(draw(VT_LINETO, startx, starty));
+				} else {
+					long long gx = std::llround(g.x * scale);
+					long long gy = std::llround(g.y * scale);
+
+					if (g.op == mvt_moveto) {
+						startx = gx;
+						starty = gy;
+					}
+					dv.push_back(draw(g.op, gx, gy));
+				}
+			}
+
+			dv = clean_filtered_geometry(dv, feature.type);
+			if (dv.size() == 0) {
+				continue;
+			}
+
+			if (ret.count(layer.name) == 0) {
+				mvt_layer l;
+				l.name = layer.name;
+				l.version = 2;
+				l.extent = extent;
+
+				ret.insert(std::pair<std::string, mvt_layer>(layer.name, l));
+			}
+			auto l = ret.find(layer.name);
+
+			mvt_feature out;
+			out.type = feature.type;
+			out.geometry = to_feature(dv);
+			out.id = feature.id;
+			out.has_id = feature.has_id;
+
+			auto fk = filtered_layermap_entry(layer.name, out.type, z, layermaps, tiling_seg, layer_unmaps);
+
+			for (size_t k = 0; k + 1 < feature.tags.size(); k += 2) {
+				if (feature.tags[k] >= layer.keys.size() || feature.tags[k + 1] >= layer.values.size()) {
+					fprintf(stderr, "Filter output: attribute index out of range in layer %s of tile %d/%u/%u\n", layer.name.c_str(), z, x, y);
+					exit(EXIT_FAILURE);
+				}
+
+				std::string const &key = layer.keys[feature.tags[k]];
+				mvt_value &v = layer.values[feature.tags[k + 1]];
+				if (v.type == mvt_null) {
+					continue;
+				}
+
+				l->second.tag(out, key, v);
+
+				type_and_string attrib;
+				if (v.type == mvt_string) {
+					attrib.type = mvt_string;
+					attrib.string = v.string_value;
+				} else if (v.type == mvt_bool) {
+					attrib.type = mvt_bool;
+					attrib.string = v.toString();
+				} else {
+					attrib.type = mvt_double;
+					attrib.string = v.toString();
+				}
+
+				add_to_file_keys(fk->second.file_keys, key, attrib);
+			}
+
+			l->second.features.push_back(out);
+		}
+	}
+
+	std::vector<mvt_layer> final;
+	for (auto a : ret) {
+		final.push_back(a.second);
+	}
+	return final;
+}
+
+static void read_fully(int fd, char *buf, size_t len, int z, unsigned x, unsigned y) {
+	while (len > 0) {
+		ssize_t r = read(fd, buf, len);
+		if (r < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			perror("read from postfilter");
+			exit(EXIT_FAILURE);
+		}
+		if (r == 0) {
+			fprintf(stderr, "Filter output: postfilter exited before the end of tile %d/%u/%u\n", z, x, y);
+			exit(EXIT_FAILURE);
+		}
+
+		buf += r;
+		len -= r;
+	}
+}
+
+// Reads a "z x y length" line followed by that many bytes of vector tile from a persistent postfilter
+static std::string read_mvt_frame(int fd, int z, unsigned x, unsigned y) {
+	std::string header;
+	while (1) {
+		char c;
+		read_fully(fd, &c, 1, z, x, y);
+		if (c == '\n') {
+			break;
+		}
+		if (header.size() > 100) {
+			fprintf(stderr, "Filter output: header for tile %d/%u/%u is too long\n", z, x, y);
+			exit(EXIT_FAILURE);
+		}
+		header.push_back(c);
+	}
+
+	int hz;
+	unsigned hx, hy;
+	size_t len;
+	if (sscanf(header.c_str(), "%d %u %u %zu", &hz, &hx, &hy, &len) != 4) {
+		fprintf(stderr, "Filter output: expected \"%d %u %u length\", not \"%s\"\n", z, x, y, header.c_str());
+		exit(EXIT_FAILURE);
+	}
+	if (hz != z || hx != x || hy != y) {
+		fprintf(stderr, "Filter output: expected tile %d/%u/%u, not %d/%u/%u\n", z, x, y, hz, hx, hy);
+		exit(EXIT_FAILURE);
+	}
+
+	std::string message;
+	message.resize(len);
+	if (len > 0) {
+		read_fully(fd, &message[0], len, z, x, y);
+	}
+	return message;
+}
+
+// Reads a vector tile from a postfilter that exits at the end of the tile
+static std::string read_mvt_output(int fd) {
+	std::string message;
+	char buf[65536];
+
+	while (1) {
+		ssize_t r = read(fd, buf, sizeof(buf));
+		if (r < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			perror("read from postfilter");
+			exit(EXIT_FAILURE);
+		}
+		if (r == 0) {
+			break;
+		}
+		message.append(buf, r);
+	}
+
+	return message;
+}
+
 static pthread_mutex_t pipe_lock = PTHREAD_MUTEX_INITIALIZER;
 
-void setup_filter(const char *filter, int *write_to, int *read_from, pid_t *pid, unsigned z, unsigned x, unsigned y) {
-	// This will create two pipes, a new thread, and a new process.
+// Starts the filter with the tile coordinates as its arguments,
+// or with no arguments if z_str is NULL, for a persistent filter.
+static void start_filter(const char *filter, int *write_to, int *read_from, pid_t *pid, const char *z_str, const char *x_str, const char *y_str) {
+	// This will create two pipes and a new process.
 	//
 	// The new process will read from one pipe and write to the other, and execute the filter.
-	// The new thread will write the GeoJSON to the pipe that leads to the filter.
-	// The original thread will read the GeoJSON from the filter and convert it back into vector tiles.
 
 	if (pthread_mutex_lock(&pipe_lock) != 0) {
 		perror("pthread_mutex_lock (pipe)");
@@ -546,10 +798,6 @@ void setup_filter(const char *filter, int *write_to, int *read_from, pid_t *pid,
 		exit(EXIT_FAILURE);
 	}
 
-	std::string z_str = std::to_string(z);
-	std::string x_str = std::to_string(x);
-	std::string y_str = std::to_string(y);
-
 	*pid = fork();
 	if (*pid < 0) {
 		perror("fork");
@@ -584,9 +832,16 @@ void setup_filter(const char *filter, int *write_to, int *read_from, pid_t *pid,
 
 		// XXX close other fds?
 
-		if (execlp("sh", "sh", "-c", filter, "sh", z_str.c_str(), x_str.c_str(), y_str.c_str(), NULL) != 0) {
-			perror("exec");
-			exit(EXIT_FAILURE);
+		if (z_str == NULL) {
+			if (execlp("sh", "sh", "-c", filter, "sh", NULL) != 0) {
+				perror("exec");
+				exit(EXIT_FAILURE);
+			}
+		} else {
+			if (execlp("sh", "sh", "-c", filter, "sh", z_str, x_str, y_str, NULL) != 0) {
+				perror("exec");
+				exit(EXIT_FAILURE);
+			}
 		}
 	} else {
 		// parent
@@ -618,18 +873,188 @@ void setup_filter(const char *filter, int *write_to, int *read_from, pid_t *pid,
 	}
 }
 
-std::vector<mvt_layer> filter_layers(const char *filter, std::vector<mvt_layer> &layers, unsigned z, unsigned x, unsigned y, std::vector<std::map<std::string, layermap_entry>> *layermaps, size_t tiling_seg, std::vector<std::vector<std::string>> *layer_unmaps, int extent) {
-	int write_to, read_from;
-	pid_t pid;
-	setup_filter(filter, &write_to, &read_from, &pid, z, x, y);
+void setup_filter(const char *filter, int *write_to, int *read_from, pid_t *pid, unsigned z, unsigned x, unsigned y) {
+	// The caller will also create a new thread to write the GeoJSON to the pipe that leads to the filter,
+	// while the original thread reads the GeoJSON from the filter and converts it back into vector tiles.
+
+	std::string z_str = std::to_string(z);
+	std::string x_str = std::to_string(x);
+	std::string y_str = std::to_string(y);
+
+	start_filter(filter, write_to, read_from, pid, z_str.c_str(), x_str.c_str(), y_str.c_str());
+}
+
+static void wait_for_filter(pid_t pid, const char *which) {
+	while (1) {
+		int stat_loc;
+		if (waitpid(pid, &stat_loc, 0) < 0) {
+			fprintf(stderr, "waitpid for %s: %s\n", which, strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+		if (WIFEXITED(stat_loc) || WIFSIGNALED(stat_loc)) {
+			break;
+		}
+	}
+}
+
+// Persistent filters: each process is started once and then sent one tile
+// after another, each framed by a TileBegin and a TileEnd object, instead of
+// forking a new filter for every tile. There are as many processes for each
+// filter as there are tiles being filtered at the same time.
+
+static pthread_mutex_t filter_workers_lock = PTHREAD_MUTEX_INITIALIZER;
+static std::vector<filter_worker *> filter_workers;
+
+// Unlike fread(), returns whatever is available from the pipe,
+// so that reading the end of one tile doesn't wait for the next
+static ssize_t read_filter_worker(json_pull *jp, char *buffer, size_t n) {
+	filter_worker *fw = (filter_worker *) jp->source;
+
+	while (1) {
+		ssize_t r = read(fw->read_from, buffer, n);
+		if (r >= 0) {
+			return r;
+		}
+		if (errno != EINTR) {
+			perror("read from persistent filter");
+			exit(EXIT_FAILURE);
+		}
+	}
+}
+
+filter_worker *acquire_filter_worker(const char *filter, bool mvt) {
+	if (pthread_mutex_lock(&filter_workers_lock) != 0) {
+		perror("pthread_mutex_lock (filter workers)");
+		exit(EXIT_FAILURE);
+	}
+
+	filter_worker *fw = NULL;
+	for (size_t i = 0; i < filter_workers.size(); i++) {
+		if (!filter_workers[i]->busy && filter_workers[i]->filter == filter && filter_workers[i]->mvt == mvt) {
+			fw = filter_workers[i];
+			break;
+		}
+	}
+
+	if (fw == NULL) {
+		fw = new filter_worker;
+		fw->filter = filter;
+		fw->mvt = mvt;
+
+		int write_to;
+		start_filter(filter, &write_to, &fw->read_from, &fw->pid, NULL, NULL, NULL);
+
+		fw->write_to = fdopen(write_to, "w");
+		if (fw->write_to == NULL) {
+			perror("fdopen (persistent filter)");
+			exit(EXIT_FAILURE);
+		}
+		fw->jp = json_begin(read_filter_worker, fw);
+
+		filter_workers.push_back(fw);
+	}
+
+	fw->busy = true;
+
+	if (pthread_mutex_unlock(&filter_workers_lock) != 0) {
+		perror("pthread_mutex_unlock (filter workers)");
+		exit(EXIT_FAILURE);
+	}
+
+	return fw;
+}
+
+void release_filter_worker(filter_worker *fw) {
+	if (pthread_mutex_lock(&filter_workers_lock) != 0) {
+		perror("pthread_mutex_lock (filter workers)");
+		exit(EXIT_FAILURE);
+	}
+
+	fw->busy = false;
+
+	if (pthread_mutex_unlock(&filter_workers_lock) != 0) {
+		perror("pthread_mutex_unlock (filter workers)");
+		exit(EXIT_FAILURE);
+	}
+}
+
+// Closes the input of each persistent filter and waits for it to exit
+void close_filter_workers() {
+	for (size_t i = 0; i < filter_workers.size(); i++) {
+		filter_worker *fw = filter_workers[i];
 
+		if (fclose(fw->write_to) != 0) {
+			perror("fclose output to persistent filter");
+			exit(EXIT_FAILURE);
+		}
+		json_end(fw->jp);
+		if (close(fw->read_from) != 0) {
+			perror("close input from persistent filter");
+			exit(EXIT_FAILURE);
+		}
+		wait_for_filter(fw->pid, "persistent filter");
+
+		delete fw;
+	}
+
+	filter_workers.clear();
+}
+
+void write_filter_begin(FILE *fp, unsigned z, unsigned x, unsigned y) {
+	fprintf(fp, "{\"type\":\"TileBegin\",\"z\":%u,\"x\":%u,\"y\":%u}\n", z, x, y);
+}
+
+void write_filter_end(FILE *fp, unsigned z, unsigned x, unsigned y, const char *which) {
+	fprintf(fp, "{\"type\":\"TileEnd\",\"z\":%u,\"x\":%u,\"y\":%u}\n", z, x, y);
+	flush_filter(fp, z, x, y, which);
+}
+
+void flush_filter(FILE *fp, unsigned z, unsigned x, unsigned y, const char *which) {
+	if (fflush(fp) != 0) {
+		if (errno == EPIPE) {
+			fprintf(stderr, "Persistent %s stopped reading before the end of tile %u/%u/%u\n", which, z, x, y);
+		} else {
+			fprintf(stderr, "flush output to %s: %s\n", which, strerror(errno));
+		}
+		exit(EXIT_FAILURE);
+	}
+}
+
+std::vector<mvt_layer> filter_layers(const char *filter, std::vector<mvt_layer> &layers, unsigned z, unsigned x, unsigned y, std::vector<std::map<std::string, layermap_entry>> *layermaps, size_t tiling_seg, std::vector<std::vector<std::string>> *layer_unmaps, int extent) {
 	writer_arg wa;
-	wa.write_to = write_to;
 	wa.layers = &layers;
 	wa.z = z;
 	wa.x = x;
 	wa.y = y;
 	wa.extent = extent;
+	wa.framed = additional[A_PERSISTENT_FILTERS];
+	wa.mvt = postfilter_mvt;
+
+	int write_to, read_from;
+	pid_t pid;
+	filter_worker *fw = NULL;
+	json_pull *jp;
+	FILE *read_fp = NULL;
+
+	if (wa.framed) {
+		fw = acquire_filter_worker(filter, wa.mvt);
+		wa.fp = fw->write_to;
+		jp = fw->jp;
+	} else {
+		setup_filter(filter, &write_to, &read_from, &pid, z, x, y);
+
+		wa.fp = fdopen(write_to, "w");
+		if (wa.fp == NULL) {
+			perror("fdopen (pipe writer)");
+			exit(EXIT_FAILURE);
+		}
+		read_fp = fdopen(read_from, "r");
+		if (read_fp == NULL) {
+			perror("fdopen filter output");
+			exit(EXIT_FAILURE);
+		}
+		jp = json_begin_file(read_fp);
+	}
 
 	pthread_t writer;
 	if (pthread_create(&writer, NULL, run_writer, &wa) != 0) {
@@ -637,17 +1062,27 @@ std::vector<mvt_layer> filter_layers(const char *filter, std::vector<mvt_layer>
 		exit(EXIT_FAILURE);
 	}
 
-	std::vector<mvt_layer> nlayers = parse_layers(read_from, z, x, y, layermaps, tiling_seg, layer_unmaps, extent);
+	std::vector<mvt_layer> nlayers;
+	if (wa.mvt) {
+		std::string message;
+		if (wa.framed) {
+			message = read_mvt_frame(fw->read_from, z, x, y);
+		} else {
+			message = read_mvt_output(read_from);
+		}
+		nlayers = parse_mvt_layers(message, z, x, y, layermaps, tiling_seg, layer_unmaps, extent);
+	} else {
+		nlayers = parse_layers(jp, z, x, y, layermaps, tiling_seg, layer_unmaps, extent, wa.framed);
+	}
 
-	while (1) {
-		int stat_loc;
-		if (waitpid(pid, &stat_loc, 0) < 0) {
-			perror("waitpid for filter\n");
+	if (!wa.framed) {
+		json_end(jp);
+		if (fclose(read_fp) != 0) {
+			perror("fclose postfilter output");
 			exit(EXIT_FAILURE);
 		}
-		if (WIFEXITED(stat_loc) || WIFSIGNALED(stat_loc)) {
-			break;
-		}
+
+		wait_for_filter(pid, "filter");
 	}
 
 	void *ret;
@@ -656,5 +1091,169 @@ std::vector<mvt_layer> filter_layers(const char *filter, std::vector<mvt_layer>
 		exit(EXIT_FAILURE);
 	}
 
+	if (fw != NULL) {
+		release_filter_worker(fw);
+	}
+
 	return nlayers;
 }
+
+// The feature that the --filter-plugin is being asked about
+struct tippecanoe_filter_feature {
+	serial_feature *sf = NULL;
+	const char *layer = NULL;
+	int z = 0;
+	long long sx = 0;
+	long long sy = 0;
+	const char *pool = NULL;
+	std::set<std::string> *changed = NULL;
+};
+
+static tippecanoe_filter_function filter_plugin = NULL;
+
+static const char *plugin_layer(tippecanoe_filter_feature *f) {
+	return f->layer;
+}
+
+static int plugin_type(tippecanoe_filter_feature *f) {
+	return f->sf->t;
+}
+
+static int plugin_zoom(tippecanoe_filter_feature *f) {
+	return f->z;
+}
+
+static int plugin_has_id(tippecanoe_filter_feature *f) {
+	return f->sf->has_id;
+}
+
+static unsigned long long plugin_id(tippecanoe_filter_feature *f) {
+	return f->sf->id;
+}
+
+static size_t plugin_geometry_count(tippecanoe_filter_feature *f) {
+	return f->sf->geometry.size();
+}
+
+static void plugin_geometry(tippecanoe_filter_feature *f, size_t i, int *op, long long *x, long long *y) {
+	draw const &d = f->sf->geometry[i];
+	*op = d.op;
+	*x = d.x + f->sx;
+	*y = d.y + f->sy;
+}
+
+static size_t plugin_attribute_count(tippecanoe_filter_feature *f) {
+	return f->sf->keys.size() + f->sf->full_keys.size();
+}
+
+// Attributes from the string pool come first, then any that have been set since
+static void plugin_attribute(tippecanoe_filter_feature *f, size_t i, const char **key, int *type, const char **value) {
+	serial_feature *sf = f->sf;
+
+	if (i < sf->keys.size()) {
+		*key = f->pool + sf->keys[i] + 1;
+		*type = f->pool[sf->values[i]];
+		*value = f->pool + sf->values[i] + 1;
+	} else {
+		i -= sf->keys.size();
+		*key = sf->full_keys[i].c_str();
+		*type = sf->full_values[i].type;
+		*value = sf->full_values[i].s.c_str();
+	}
+}
+
+static void plugin_remove_attribute(tippecanoe_filter_feature *f, const char *key) {
+	serial_feature *sf = f->sf;
+
+	for (ssize_t i = sf->keys.size() - 1; i >= 0; i--) {
+		if (strcmp(f->pool + sf->keys[i] + 1, key) == 0) {
+			sf->keys.erase(sf->keys.begin() + i);
+			sf->values.erase(sf->values.begin() + i);
+		}
+	}
+	for (ssize_t i = sf->full_keys.size() - 1; i >= 0; i--) {
+		if (sf->full_keys[i] == key) {
+			sf->full_keys.erase(sf->full_keys.begin() + i);
+			sf->full_values.erase(sf->full_values.begin() + i);
+		}
+	}
+}
+
+static void plugin_set_attribute(tippecanoe_filter_feature *f, const char *key, int type, const char *value) {
+	std::string k = key;  // in case key points at the attribute being removed
+	plugin_remove_attribute(f, k.c_str());
+
+	if (type == TIPPECANOE_FILTER_NULL) {
+		return;
+	}
+
+	serial_val sv;
+	if (type == TIPPECANOE_FILTER_STRING) {
+		sv.type = mvt_string;
+	} else if (type == TIPPECANOE_FILTER_BOOL) {
+		sv.type = mvt_bool;
+	} else {
+		sv.type = mvt_double;
+	}
+	sv.s = value;
+
+	f->sf->full_keys.push_back(k);
+	f->sf->full_values.push_back(sv);
+	f->changed->insert(k);
+}
+
+static const tippecanoe_filter_host filter_plugin_host = {
+	TIPPECANOE_FILTER_VERSION,
+	plugin_layer,
+	plugin_type,
+	plugin_zoom,
+	plugin_has_id,
+	plugin_id,
+	plugin_geometry_count,
+	plugin_geometry,
+	plugin_attribute_count,
+	plugin_attribute,
+	plugin_set_attribute,
+	plugin_remove_attribute,
+};
+
+void load_filter_plugin(const char *fname) {
+	void *lib = dlopen(fname, RTLD_NOW | RTLD_LOCAL);
+	if (lib == NULL) {
+		fprintf(stderr, "Can't load filter plugin: %s\n", dlerror());
+		exit(EXIT_FAILURE);
+	}
+
+	filter_plugin = (tippecanoe_filter_function) dlsym(lib, "tippecanoe_filter");
+	if (filter_plugin == NULL) {
+		fprintf(stderr, "%s: no tippecanoe_filter function\n", fname);
+		exit(EXIT_FAILURE);
+	}
+
+	tippecanoe_filter_init_function init = (tippecanoe_filter_init_function) dlsym(lib, "tippecanoe_filter_init");
+	if (init != NULL && !init(&filter_plugin_host)) {
+		fprintf(stderr, "%s: plugin initialization failed\n", fname);
+		exit(EXIT_FAILURE);
+	}
+}
+
+bool filter_plugin_loaded() {
+	return filter_plugin != NULL;
+}
+
+// Returns false if the plugin drops the feature. The names of attributes
+// that it set, which are now in full_keys, are added to changed.
+bool plugin_filter_feature(serial_feature &sf, int z, unsigned tx, unsigned ty, const char *stringpool, long long *pool_off, std::string const &layername, std::set<std::string> &changed) {
+	tippecanoe_filter_feature f;
+	f.sf = &sf;
+	f.layer = layername.c_str();
+	f.z = z;
+	if (z != 0) {
+		f.sx = (long long) tx << (32 - z);
+		f.sy = (long long) ty << (32 - z);
+	}
+	f.pool = stringpool + pool_off[sf.segment];
+	f.changed = &changed;
+
+	return filter_plugin(&filter_plugin_host, &f) != 0;
+}
@@ -1,3 +1,25 @@
+// A filter process that is started once and then sent one tile after another
+struct filter_worker {
+	std::string filter;
+	pid_t pid = 0;
+	FILE *write_to = NULL;
+	int read_from = -1;
+	json_pull *jp = NULL;
+	bool mvt = false;
+	bool busy = false;
+};
+
 std::vector<mvt_layer> filter_layers(const char *filter, std::vector<mvt_layer> &layer, unsigned z, unsigned x, unsigned y, std::vector<std::map<std::string, layermap_entry>> *layermaps, size_t tiling_seg, std::vector<std::vector<std::string>> *layer_unmaps, int extent);
 void setup_filter(const char *filter, int *write_to, int *read_from, pid_t *pid, unsigned z, unsigned x, unsigned y);
-serial_feature parse_feature(json_pull *jp, int z, unsigned x, unsigned y, std::vector<std::map<std::string, layermap_entry>> *layermaps, size_t tiling_seg, std::vector<std::vector<std::string>> *layer_unmaps, bool filters);
+serial_feature parse_feature(json_pull *jp, int z, unsigned x, unsigned y, std::vector<std::map<std::string, layermap_entry>> *layermaps, size_t tiling_seg, std::vector<std::vector<std::string>> *layer_unmaps, bool filters, bool framed);
+
+filter_worker *acquire_filter_worker(const char *filter, bool mvt);
+void release_filter_worker(filter_worker *fw);
+void close_filter_workers();
+void write_filter_begin(FILE *fp, unsigned z, unsigned x, unsigned y);
+void write_filter_end(FILE *fp, unsigned z, unsigned x, unsigned y, const char *which);
+void flush_filter(FILE *fp, unsigned z, unsigned x, unsigned y, const char *which);
+
+void load_filter_plugin(const char *fname);
+bool filter_plugin_loaded();
+bool plugin_filter_feature(serial_feature &sf, int z, unsigned tx, unsigned ty, const char *stringpool, long long *pool_off, std::string const &layername, std::set<std::string> &changed);
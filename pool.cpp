@@ -1,84 +1,95 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <limits.h>
-#include <math.h>
 #include "memfile.hpp"
 #include "pool.hpp"
 
-int swizzlecmp(const char *a, const char *b) {
-	ssize_t alen = strlen(a);
-	ssize_t blen = strlen(b);
+#define INITIAL_SLOTS 1024
 
-	if (strcmp(a, b) == 0) {
-		return 0;
-	}
-
-	long long hash1 = 0, hash2 = 0;
-	for (ssize_t i = alen - 1; i >= 0; i--) {
-		hash1 = (hash1 * 37 + a[i]) & INT_MAX;
-	}
-	for (ssize_t i = blen - 1; i >= 0; i--) {
-		hash2 = (hash2 * 37 + b[i]) & INT_MAX;
-	}
+static unsigned long long poolhash(const char *s, char type) {
+	// FNV-1a
+	unsigned long long h = 14695981039346656037ULL;
 
-	int h1 = hash1, h2 = hash2;
-	if (h1 == h2) {
-		return strcmp(a, b);
+	h = (h ^ (unsigned char) type) * 1099511628211ULL;
+	for (; *s != '\0'; s++) {
+		h = (h ^ (unsigned char) *s) * 1099511628211ULL;
 	}
 
-	return h1 - h2;
+	return h;
 }
 
-long long addpool(struct memfile *poolfile, struct memfile *treefile, const char *s, char type) {
-	unsigned long *sp = &treefile->tree;
-	size_t depth = 0;
+static void insert_slot(struct stringpool_table *t, unsigned long long hash, unsigned long long off) {
+	struct stringpool *slots = (struct stringpool *) (t + 1);
+	unsigned long long mask = t->slots - 1;
+	unsigned long long i;
 
-	// In typical data, traversal depth generally stays under 2.5x
-	size_t max = 3 * log(treefile->off / sizeof(struct stringpool)) / log(2);
-	if (max < 30) {
-		max = 30;
+	for (i = hash & mask; slots[i].off != 0; i = (i + 1) & mask) {
 	}
 
-	while (*sp != 0) {
-		int cmp = swizzlecmp(s, poolfile->map + ((struct stringpool *) (treefile->map + *sp))->off + 1);
+	slots[i].hash = hash;
+	slots[i].off = off;
+	t->count++;
+}
+
+// Append a new, empty table with the specified number of slots to the tree file,
+// and move the contents of the old table, if any, into it. The space
+// used by the old table is abandoned.
+static void grow_table(struct memfile *treefile, unsigned long long slots) {
+	static char zeroes[65536];
 
-		if (cmp == 0) {
-			cmp = type - (poolfile->map + ((struct stringpool *) (treefile->map + *sp))->off)[0];
-		}
+	long long old = treefile->tree;
+	long long p = treefile->off;
+
+	struct stringpool_table t;
+	t.slots = slots;
+	t.count = 0;
+	if (memfile_write(treefile, &t, sizeof(struct stringpool_table)) < 0) {
+		perror("memfile write");
+		exit(EXIT_FAILURE);
+	}
 
-		if (cmp < 0) {
-			sp = &(((struct stringpool *) (treefile->map + *sp))->left);
-		} else if (cmp > 0) {
-			sp = &(((struct stringpool *) (treefile->map + *sp))->right);
-		} else {
-			return ((struct stringpool *) (treefile->map + *sp))->off;
+	for (long long todo = slots * sizeof(struct stringpool); todo > 0; todo -= sizeof(zeroes)) {
+		long long len = todo < (long long) sizeof(zeroes) ? todo : sizeof(zeroes);
+		if (memfile_write(treefile, zeroes, len) < 0) {
+			perror("memfile write");
+			exit(EXIT_FAILURE);
 		}
+	}
 
-		depth++;
-		if (depth > max) {
-			// Search is very deep, so string is probably unique.
-			// Add it to the pool without adding it to the search tree.
+	// The map may have moved during the writes, so only find the tables now
+	struct stringpool_table *nt = (struct stringpool_table *) (treefile->map + p);
+	if (old != 0) {
+		struct stringpool_table *ot = (struct stringpool_table *) (treefile->map + old);
+		struct stringpool *oslots = (struct stringpool *) (ot + 1);
 
-			long long off = poolfile->off;
-			if (memfile_write(poolfile, &type, 1) < 0) {
-				perror("memfile write");
-				exit(EXIT_FAILURE);
+		for (unsigned long long i = 0; i < ot->slots; i++) {
+			if (oslots[i].off != 0) {
+				insert_slot(nt, oslots[i].hash, oslots[i].off);
 			}
-			if (memfile_write(poolfile, (void *) s, strlen(s) + 1) < 0) {
-				perror("memfile write");
-				exit(EXIT_FAILURE);
-			}
-			return off;
 		}
 	}
 
-	// *sp is probably in the memory-mapped file, and will move if the file grows.
-	long long ssp;
-	if (sp == &treefile->tree) {
-		ssp = -1;
-	} else {
-		ssp = ((char *) sp) - treefile->map;
+	treefile->tree = p;
+}
+
+long long addpool(struct memfile *poolfile, struct memfile *treefile, const char *s, char type) {
+	if (treefile->tree == 0) {
+		grow_table(treefile, INITIAL_SLOTS);
+	}
+
+	unsigned long long hash = poolhash(s, type);
+	struct stringpool_table *t = (struct stringpool_table *) (treefile->map + treefile->tree);
+	struct stringpool *slots = (struct stringpool *) (t + 1);
+	unsigned long long mask = t->slots - 1;
+
+	for (unsigned long long i = hash & mask; slots[i].off != 0; i = (i + 1) & mask) {
+		if (slots[i].hash == hash) {
+			const char *found = poolfile->map + slots[i].off - 1;
+
+			if (found[0] == type && strcmp(found + 1, s) == 0) {
+				return slots[i].off - 1;
+			}
+		}
 	}
 
 	long long off = poolfile->off;
@@ -91,31 +102,12 @@ long long addpool(struct memfile *poolfile, struct memfile *treefile, const char
 		exit(EXIT_FAILURE);
 	}
 
-	if (off >= LONG_MAX || treefile->off >= LONG_MAX) {
-		// Tree or pool is bigger than 2GB
-		static bool warned = false;
-		if (!warned) {
-			fprintf(stderr, "Warning: string pool is very large.\n");
-			warned = true;
-		}
-		return off;
-	}
+	// Writing to the pool does not move the tree file, so t is still valid
+	insert_slot(t, hash, off + 1);
 
-	struct stringpool tsp;
-	tsp.left = 0;
-	tsp.right = 0;
-	tsp.off = off;
-
-	long long p = treefile->off;
-	if (memfile_write(treefile, &tsp, sizeof(struct stringpool)) < 0) {
-		perror("memfile write");
-		exit(EXIT_FAILURE);
+	if (t->count * 2 > t->slots) {
+		grow_table(treefile, t->slots * 2);
 	}
 
-	if (ssp == -1) {
-		treefile->tree = p;
-	} else {
-		*((long long *) (treefile->map + ssp)) = p;
-	}
 	return off;
 }
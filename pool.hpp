@@ -1,10 +1,16 @@
 #ifndef POOL_HPP
 #define POOL_HPP
 
+// One slot of the open-addressing hash table kept in the tree file
 struct stringpool {
-	unsigned long left = 0;
-	unsigned long right = 0;
-	unsigned long off = 0;
+	unsigned long long hash = 0;
+	unsigned long long off = 0;  // offset in the pool plus 1, or 0 if the slot is empty
+};
+
+// Header that precedes the slots of the hash table
+struct stringpool_table {
+	unsigned long long slots = 0;
+	unsigned long long count = 0;
 };
 
 long long addpool(struct memfile *poolfile, struct memfile *treefile, const char *s, char type);
@@ -103,7 +103,9 @@ void parse_geometry(int t, json_object *j, drawvec &out, int op, const char *fna
 	}
 }
 
-void canonicalize(json_object *o) {
+// Substitutes canonical forms of numbers, keeping the originals in saved
+// to be put back afterward, since they may belong to the parser's arena
+void canonicalize(json_object *o, std::vector<std::pair<json_object *, char *>> &saved) {
 	if (o->type == JSON_NUMBER) {
 		std::string s;
 		long long v;
@@ -116,15 +118,15 @@ void canonicalize(json_object *o) {
 		} else {
 			s = milo::dtoa_milo(o->number);
 		}
-		free(o->string);
+		saved.push_back(std::pair<json_object *, char *>(o, o->string));
 		o->string = strdup(s.c_str());
 	} else if (o->type == JSON_HASH) {
 		for (size_t i = 0; i < o->length; i++) {
-			canonicalize(o->values[i]);
+			canonicalize(o->values[i], saved);
 		}
 	} else if (o->type == JSON_ARRAY) {
 		for (size_t i = 0; i < o->length; i++) {
-			canonicalize(o->array[i]);
+			canonicalize(o->array[i], saved);
 		}
 	}
 }
@@ -143,10 +145,16 @@ void stringify_value(json_object *value, int &type, std::string &stringified, co
 		} else if (vt == JSON_NULL) {
 			val = "null";
 		} else {
-			canonicalize(value);
+			std::vector<std::pair<json_object *, char *>> saved;
+			canonicalize(value, saved);
 			const char *v = json_stringify(value);
 			val = std::string(v);
 			free((void *) v);  // stringify
+
+			for (auto &sv : saved) {
+				free(sv.first->string);
+				sv.first->string = sv.second;
+			}
 		}
 
 		if (vt == JSON_STRING) {
@@ -241,74 +241,159 @@ void serialize_feature(FILE *geomfile, serial_feature *sf, std::atomic<long long
 	}
 }
 
-serial_feature deserialize_feature(FILE *geoms, std::atomic<long long> *geompos_in, char *metabase, long long *meta_off, unsigned z, unsigned tx, unsigned ty, unsigned *initial_x, unsigned *initial_y) {
-	serial_feature sf;
+// Reads back the fields of a feature in the order that serialize_feature()
+// wrote them, from either a temporary file or a memory map of one.
+// deserialize_feature() and serialize_remapped_feature() both go through
+// here so that there is only one reader of the layout.
+
+struct feature_file_source {
+	FILE *f;
+	std::atomic<long long> *pos;
+	unsigned z, tx, ty;
+	unsigned *initial_x, *initial_y;
+
+	void byte(signed char *n) {
+		deserialize_byte_io(f, n, pos);
+	}
+
+	void number(long long *n) {
+		deserialize_long_long_io(f, n, pos);
+	}
+
+	void unsigned_number(unsigned long long *n) {
+		deserialize_ulong_long_io(f, n, pos);
+	}
+
+	void geometry(serial_feature &sf) {
+		sf.geometry = decode_geometry(f, pos, z, tx, ty, sf.bbox, initial_x[sf.segment], initial_y[sf.segment]);
+	}
+};
+
+struct feature_map_source {
+	char *p;
+
+	void byte(signed char *n) {
+		deserialize_byte(&p, n);
+	}
+
+	void number(long long *n) {
+		deserialize_long_long(&p, n);
+	}
+
+	void unsigned_number(unsigned long long *n) {
+		deserialize_ulong_long(&p, n);
+	}
+
+	// The geometry is only skipped over, not decoded
+	void geometry(serial_feature &) {
+		while (true) {
+			signed char op;
+			deserialize_byte(&p, &op);
 
-	deserialize_byte_io(geoms, &sf.t, geompos_in);
+			if (op == VT_END) {
+				break;
+			}
+			if (op == VT_MOVETO || op == VT_LINETO) {
+				long long ll;
+				deserialize_long_long(&p, &ll);
+				deserialize_long_long(&p, &ll);
+			}
+		}
+	}
+};
+
+// Everything before the metadata reference.
+// Returns false at the end of a list of features.
+template <typename S>
+static bool read_feature_head(S &s, serial_feature &sf) {
+	s.byte(&sf.t);
 	if (sf.t < 0) {
-		return sf;
+		return false;
 	}
 
-	deserialize_long_long_io(geoms, &sf.layer, geompos_in);
+	s.number(&sf.layer);
 
 	sf.seq = 0;
 	if (sf.layer & (1 << 5)) {
-		deserialize_long_long_io(geoms, &sf.seq, geompos_in);
+		s.number(&sf.seq);
 	}
 
 	sf.tippecanoe_minzoom = -1;
 	sf.tippecanoe_maxzoom = -1;
 	sf.id = 0;
 	sf.has_id = false;
+	long long ll;
 	if (sf.layer & (1 << 1)) {
-		deserialize_int_io(geoms, &sf.tippecanoe_minzoom, geompos_in);
+		s.number(&ll);
+		sf.tippecanoe_minzoom = ll;
 	}
 	if (sf.layer & (1 << 0)) {
-		deserialize_int_io(geoms, &sf.tippecanoe_maxzoom, geompos_in);
+		s.number(&ll);
+		sf.tippecanoe_maxzoom = ll;
 	}
 	if (sf.layer & (1 << 2)) {
 		sf.has_id = true;
-		deserialize_ulong_long_io(geoms, &sf.id, geompos_in);
+		s.unsigned_number(&sf.id);
 	}
 
-	deserialize_int_io(geoms, &sf.segment, geompos_in);
+	s.number(&ll);
+	sf.segment = ll;
 
 	sf.index = 0;
 	sf.extent = 0;
 
-	sf.geometry = decode_geometry(geoms, geompos_in, z, tx, ty, sf.bbox, initial_x[sf.segment], initial_y[sf.segment]);
+	s.geometry(sf);
 	if (sf.layer & (1 << 4)) {
-		deserialize_ulong_long_io(geoms, &sf.index, geompos_in);
+		s.unsigned_number(&sf.index);
 	}
 	if (sf.layer & (1 << 3)) {
-		deserialize_long_long_io(geoms, &sf.extent, geompos_in);
+		s.number(&sf.extent);
 	}
 
 	sf.layer >>= 6;
+	return true;
+}
 
+// The metadata reference, followed by the keys and values if they are inline
+template <typename S>
+static void read_feature_attributes(S &s, serial_feature &sf) {
+	sf.keys.clear();
+	sf.values.clear();
 	sf.metapos = 0;
-	deserialize_long_long_io(geoms, &sf.metapos, geompos_in);
+	s.number(&sf.metapos);
 
-	if (sf.metapos >= 0) {
-		char *meta = metabase + sf.metapos + meta_off[sf.segment];
+	if (sf.metapos < 0) {
 		long long count;
-		deserialize_long_long(&meta, &count);
+		s.number(&count);
 
 		for (long long i = 0; i < count; i++) {
 			long long k, v;
-			deserialize_long_long(&meta, &k);
-			deserialize_long_long(&meta, &v);
+			s.number(&k);
+			s.number(&v);
 			sf.keys.push_back(k);
 			sf.values.push_back(v);
 		}
-	} else {
+	}
+}
+
+serial_feature deserialize_feature(FILE *geoms, std::atomic<long long> *geompos_in, char *metabase, long long *meta_off, unsigned z, unsigned tx, unsigned ty, unsigned *initial_x, unsigned *initial_y) {
+	serial_feature sf;
+	feature_file_source s = {geoms, geompos_in, z, tx, ty, initial_x, initial_y};
+
+	if (!read_feature_head(s, sf)) {
+		return sf;
+	}
+	read_feature_attributes(s, sf);
+
+	if (sf.metapos >= 0) {
+		char *meta = metabase + sf.metapos + meta_off[sf.segment];
 		long long count;
-		deserialize_long_long_io(geoms, &count, geompos_in);
+		deserialize_long_long(&meta, &count);
 
 		for (long long i = 0; i < count; i++) {
 			long long k, v;
-			deserialize_long_long_io(geoms, &k, geompos_in);
-			deserialize_long_long_io(geoms, &v, geompos_in);
+			deserialize_long_long(&meta, &k);
+			deserialize_long_long(&meta, &v);
 			sf.keys.push_back(k);
 			sf.values.push_back(v);
 		}
@@ -319,6 +404,47 @@ serial_feature deserialize_feature(FILE *geoms, std::atomic<long long> *geompos_
 	return sf;
 }
 
+long long remap_offset(std::vector<long long> const &from, std::vector<long long> const &to, long long off) {
+	auto f = std::lower_bound(from.begin(), from.end(), off);
+	if (f == from.end() || *f != off) {
+		fprintf(stderr, "Internal error: no mapping for offset %lld\n", off);
+		exit(EXIT_FAILURE);
+	}
+	return to[f - from.begin()];
+}
+
+// Copy a feature written by serialize_feature(), pointing its metadata and
+// inline string references at where its segment's strings were moved to
+void serialize_remapped_feature(FILE *out, char *feature, long long len, std::vector<segment_remap> const &remaps, std::atomic<long long> *pos, const char *fname) {
+	feature_map_source s = {feature};
+	// Reused from feature to feature to keep the key and value vectors allocated
+	static thread_local serial_feature sf;
+
+	read_feature_head(s, sf);
+	fwrite_check(feature, 1, s.p - feature, out, fname);
+	*pos += s.p - feature;
+
+	read_feature_attributes(s, sf);
+	segment_remap const &r = remaps[sf.segment];
+
+	if (sf.metapos >= 0) {
+		serialize_long_long(out, remap_offset(r.meta_from, r.meta_to, sf.metapos), pos, fname);
+	} else {
+		serialize_long_long(out, sf.metapos, pos, fname);
+		serialize_long_long(out, sf.keys.size(), pos, fname);
+
+		for (size_t i = 0; i < sf.keys.size(); i++) {
+			serialize_long_long(out, remap_offset(r.pool_from, r.pool_to, sf.keys[i]), pos, fname);
+			serialize_long_long(out, remap_offset(r.pool_from, r.pool_to, sf.values[i]), pos, fname);
+		}
+	}
+
+	if (s.p < feature + len) {
+		fwrite_check(s.p, 1, feature + len - s.p, out, fname);
+		*pos += feature + len - s.p;
+	}
+}
+
 static long long scale_geometry(struct serialization_state *sst, long long *bbox, drawvec &geom) {
 	long long offset = 0;
 	long long prev = 0;
@@ -461,33 +587,6 @@ int serialize_feature(struct serialization_state *sst, serial_feature &sf) {
 		}
 	}
 
-	if (sst->want_dist) {
-		std::vector<unsigned long long> locs;
-		for (size_t i = 0; i < sf.geometry.size(); i++) {
-			if (sf.geometry[i].op == VT_MOVETO || sf.geometry[i].op == VT_LINETO) {
-				locs.push_back(encode_index(SHIFT_LEFT(sf.geometry[i].x), SHIFT_LEFT(sf.geometry[i].y)));
-			}
-		}
-		std::sort(locs.begin(), locs.end());
-		size_t n = 0;
-		double sum = 0;
-		for (size_t i = 1; i < locs.size(); i++) {
-			if (locs[i - 1] != locs[i]) {
-				sum += log(locs[i] - locs[i - 1]);
-				n++;
-			}
-		}
-		if (n > 0) {
-			double avg = exp(sum / n);
-			// Convert approximately from tile units to feet
-			double dist_ft = sqrt(avg) / 33;
-
-			*(sst->dist_sum) += log(dist_ft) * n;
-			*(sst->dist_count) += n;
-		}
-		locs.clear();
-	}
-
 	bool inline_meta = true;
 	// Don't inline metadata for features that will span several tiles at maxzoom
 	if (sf.geometry.size() > 0 && (sf.bbox[2] < sf.bbox[0] || sf.bbox[3] < sf.bbox[1])) {
@@ -572,16 +671,6 @@ int serialize_feature(struct serialization_state *sst, serial_feature &sf) {
 	auto ai = sst->layermap->find(sf.layername);
 	if (ai != sst->layermap->end()) {
 		sf.layer = ai->second.id;
-
-		if (!sst->filters) {
-			if (sf.t == VT_POINT) {
-				ai->second.points++;
-			} else if (sf.t == VT_LINE) {
-				ai->second.lines++;
-			} else if (sf.t == VT_POLYGON) {
-				ai->second.polygons++;
-			}
-		}
 	} else {
 		fprintf(stderr, "Internal error: can't find layer name %s\n", sf.layername.c_str());
 		exit(EXIT_FAILURE);
@@ -640,14 +729,63 @@ int serialize_feature(struct serialization_state *sst, serial_feature &sf) {
 		}
 	}
 
-	if (!sst->filters) {
+	if (ingest_filter != NULL) {
+		compiled_filter const &cf = *ingest_filter;
+		filter_values values;
+		values.clear(cf);
+
 		for (size_t i = 0; i < sf.full_keys.size(); i++) {
-			type_and_string attrib;
-			attrib.type = sf.full_values[i].type;
-			attrib.string = sf.full_values[i].s;
+			int slot = cf.slot(sf.full_keys[i]);
+			if (values.wants(slot)) {
+				values.set_stringified(slot, sf.full_values[i].type, sf.full_values[i].s.c_str());
+			}
+		}
+		values.set_special(cf, sf.has_id, sf.id, sf.t, -1);
 
-			auto fk = sst->layermap->find(sf.layername);
-			add_to_file_keys(fk->second.file_keys, sf.full_keys[i], attrib);
+		if (!may_pass_filter(cf, values, sf.layername)) {
+			return 1;
+		}
+	}
+
+	// Only after the filter, so that rejected features don't affect the -zg guess
+	if (sst->want_dist) {
+		std::vector<unsigned long long> locs;
+		for (size_t i = 0; i < sf.geometry.size(); i++) {
+			if (sf.geometry[i].op == VT_MOVETO || sf.geometry[i].op == VT_LINETO) {
+				locs.push_back(encode_index(SHIFT_LEFT(sf.geometry[i].x), SHIFT_LEFT(sf.geometry[i].y)));
+			}
+		}
+		std::sort(locs.begin(), locs.end());
+		size_t n = 0;
+		double sum = 0;
+		for (size_t i = 1; i < locs.size(); i++) {
+			if (locs[i - 1] != locs[i]) {
+				sum += log(locs[i] - locs[i - 1]);
+				n++;
+			}
+		}
+		if (n > 0) {
+			double avg = exp(sum / n);
+			// Convert approximately from tile units to feet
+			double dist_ft = sqrt(avg) / 33;
+
+			*(sst->dist_sum) += log(dist_ft) * n;
+			*(sst->dist_count) += n;
+		}
+		locs.clear();
+	}
+
+	if (!sst->filters) {
+		if (sf.t == VT_POINT) {
+			ai->second.points++;
+		} else if (sf.t == VT_LINE) {
+			ai->second.lines++;
+		} else if (sf.t == VT_POLYGON) {
+			ai->second.polygons++;
+		}
+
+		for (size_t i = 0; i < sf.full_keys.size(); i++) {
+			add_to_file_keys(ai->second.file_keys, sf.full_keys[i], sf.full_values[i].type, sf.full_values[i].s);
 		}
 	}
 
@@ -680,6 +818,12 @@ int serialize_feature(struct serialization_state *sst, serial_feature &sf) {
 	fwrite_check(&index, sizeof(struct index), 1, r->indexfile, sst->fname);
 	r->indexpos += sizeof(struct index);
 
+	if (index.ix < r->last_ix || (index.ix == r->last_ix && (long long) index.seq < r->last_seq)) {
+		r->sorted = false;
+	}
+	r->last_ix = index.ix;
+	r->last_seq = index.seq;
+
 	for (size_t i = 0; i < 2; i++) {
 		if (sf.bbox[i] < r->file_bbox[i]) {
 			r->file_bbox[i] = sf.bbox[i];
@@ -74,6 +74,18 @@ struct serial_feature {
 void serialize_feature(FILE *geomfile, serial_feature *sf, std::atomic<long long> *geompos, const char *fname, long long wx, long long wy, bool include_minzoom);
 serial_feature deserialize_feature(FILE *geoms, std::atomic<long long> *geompos_in, char *metabase, long long *meta_off, unsigned z, unsigned tx, unsigned ty, unsigned *initial_x, unsigned *initial_y);
 
+// Where the strings and metadata of one input segment went
+// when the segments' string pools were consolidated
+struct segment_remap {
+	std::vector<long long> pool_from{};
+	std::vector<long long> pool_to{};
+	std::vector<long long> meta_from{};
+	std::vector<long long> meta_to{};
+};
+
+long long remap_offset(std::vector<long long> const &from, std::vector<long long> const &to, long long off);
+void serialize_remapped_feature(FILE *out, char *feature, long long len, std::vector<segment_remap> const &remaps, std::atomic<long long> *pos, const char *fname);
+
 struct reader {
 	int metafd = -1;
 	int poolfd = -1;
@@ -98,6 +110,11 @@ struct reader {
 
 	char *geom_map = NULL;
 
+	// Whether the index entries so far have been written in sorted order
+	bool sorted = true;
+	unsigned long long last_ix = 0;
+	long long last_seq = -1;
+
 	reader()
 	    : metapos(0), geompos(0), indexpos(0) {
 	}
@@ -130,6 +147,10 @@ struct reader {
 		metast = r.metast;
 
 		geom_map = r.geom_map;
+
+		sorted = r.sorted;
+		last_ix = r.last_ix;
+		last_seq = r.last_seq;
 	}
 };
 
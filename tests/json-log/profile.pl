@@ -0,0 +1,34 @@
+#!/usr/bin/perl
+# Check that each line of --tile-profile output is JSON with all the fields
+# of a tile profile, and that its strategies are all known ones. Prints the
+# zoom, x, and y of each record, to compare with the tiles in the output.
+# The strategies that must have been used somewhere are given as arguments.
+
+use strict;
+use warnings;
+use JSON::PP;
+
+my @fields = qw(z x y detail iterations features_read features_kept vertices_read vertices_kept encode_seconds compress_seconds bytes strategies);
+my %known = map { $_ => 1 } qw(densest smallest fraction gamma merge-polygons detail);
+
+my %used;
+my @want = @ARGV;
+@ARGV = ();
+
+while (<>) {
+	my $r = decode_json($_);
+
+	for my $field (@fields) {
+		die "profile without $field: $_" unless exists $r->{$field};
+	}
+	for my $strategy (split(/,/, $r->{strategies})) {
+		die "unknown strategy $strategy: $_" unless $known{$strategy};
+		$used{$strategy}++;
+	}
+
+	print "$r->{z} $r->{x} $r->{y}\n";
+}
+
+for my $strategy (@want) {
+	die "strategy $strategy never used\n" unless $used{$strategy};
+}
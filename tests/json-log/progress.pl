@@ -0,0 +1,45 @@
+#!/usr/bin/perl
+# Check that each line of --json-progress output is JSON, and that the
+# input, phase, zoom, and summary records are all there with their fields.
+# The zoom levels to expect are given as arguments.
+
+use strict;
+use warnings;
+use JSON::PP;
+
+my %want = (
+	input => [qw(file bytes bytes_per_second features features_per_second seconds)],
+	phase => [qw(name seconds)],
+	zoom => [qw(zoom seconds threads utilization tiles tile_bytes retries temp_read temp_written compress_seconds write_wait_seconds)],
+	summary => [qw(phases seconds tiles tile_bytes retries temp_read temp_written compress_seconds write_wait_seconds)],
+);
+
+my (%seen, %phases, %zooms);
+my @zooms = @ARGV;
+@ARGV = ();
+
+while (<>) {
+	my $r = decode_json($_);
+
+	for my $type (keys %$r) {
+		$seen{$type}++;
+		next unless $want{$type};
+
+		for my $field (@{$want{$type}}) {
+			die "$type record without $field: $_" unless exists $r->{$type}{$field};
+		}
+
+		$phases{$r->{$type}{name}}++ if $type eq "phase";
+		$zooms{$r->{$type}{zoom}}++ if $type eq "zoom";
+	}
+}
+
+for my $type (qw(input phase zoom summary)) {
+	die "no $type record\n" unless $seen{$type};
+}
+for my $phase (qw(read merge sort analyze tile metadata)) {
+	die "no $phase phase\n" unless $phases{$phase};
+}
+for my $zoom (@zooms) {
+	die "no record for zoom $zoom\n" unless $zooms{$zoom};
+}
@@ -0,0 +1,53 @@
+#!/usr/bin/perl
+# Check that --trace output is a JSON array of trace events from a single
+# process, that every thread that has spans was named, and that on each
+# thread the spans nest inside each other instead of overlapping.
+# The span names that must appear are given as arguments.
+
+use strict;
+use warnings;
+use JSON::PP;
+
+my @want = @ARGV;
+@ARGV = ();
+
+local $/;
+my $events = decode_json(<>);
+die "trace is not an array\n" unless ref($events) eq "ARRAY";
+
+my (%named, %spans, %seen);
+for my $e (@$events) {
+	die "event from pid $e->{pid}\n" unless $e->{pid} == 1;
+
+	if ($e->{ph} eq "M") {
+		$named{$e->{tid}}++ if $e->{name} eq "thread_name";
+	} elsif ($e->{ph} eq "X") {
+		die "span $e->{name} with negative duration\n" if $e->{dur} < 0;
+		push @{$spans{$e->{tid}}}, $e;
+		$seen{$e->{name}}++;
+	} else {
+		die "unexpected event type $e->{ph}\n";
+	}
+}
+
+# Timestamps are rounded to the nanosecond
+my $slop = 0.002;
+
+for my $tid (keys %spans) {
+	die "thread $tid has spans but no name\n" unless $named{$tid};
+
+	my @open;
+	for my $e (sort { $a->{ts} <=> $b->{ts} || $b->{dur} <=> $a->{dur} } @{$spans{$tid}}) {
+		while (@open && $open[-1]->{ts} + $open[-1]->{dur} <= $e->{ts} + $slop) {
+			pop @open;
+		}
+		if (@open && $e->{ts} + $e->{dur} > $open[-1]->{ts} + $open[-1]->{dur} + $slop) {
+			die "on thread $tid, $e->{name} at $e->{ts} overlaps the end of $open[-1]->{name} at $open[-1]->{ts}\n";
+		}
+		push @open, $e;
+	}
+}
+
+for my $name (@want) {
+	die "no $name span\n" unless $seen{$name};
+}
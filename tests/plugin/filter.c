@@ -0,0 +1,51 @@
+#include "filter-plugin.h"  // first, to check that it stands on its own
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Keeps only places with SCALERANK below 3, adds the length of each name
+// and whether it is in the western hemisphere, and removes every other attribute.
+
+int tippecanoe_filter(const struct tippecanoe_filter_host *host, struct tippecanoe_filter_feature *feature) {
+	int keep = 0;
+	size_t len = 0;
+
+	for (size_t i = 0; i < host->attribute_count(feature); i++) {
+		const char *key, *value;
+		int type;
+		host->attribute(feature, i, &key, &type, &value);
+
+		if (strcmp(key, "SCALERANK") == 0 && type == TIPPECANOE_FILTER_NUMBER && atof(value) < 3) {
+			keep = 1;
+		}
+		if (strcmp(key, "NAME") == 0 && type == TIPPECANOE_FILTER_STRING) {
+			len = strlen(value);
+		}
+	}
+
+	if (!keep) {
+		return 0;
+	}
+
+	while (host->attribute_count(feature) > 0) {
+		const char *key, *value;
+		int type;
+		host->attribute(feature, 0, &key, &type, &value);
+		host->remove_attribute(feature, key);
+	}
+
+	char buf[50];
+	sprintf(buf, "%zu", len);
+	host->set_attribute(feature, "name_length", TIPPECANOE_FILTER_NUMBER, buf);
+	host->set_attribute(feature, "zoom", TIPPECANOE_FILTER_NUMBER, host->zoom(feature) > 2 ? "3" : "2");
+
+	int op;
+	long long x, y;
+	host->geometry(feature, 0, &op, &x, &y);
+	host->set_attribute(feature, "west", TIPPECANOE_FILTER_BOOL, x < (1LL << 31) ? "true" : "false");
+	return 1;
+}
+
+int tippecanoe_filter_init(const struct tippecanoe_filter_host *host) {
+	return host->version == TIPPECANOE_FILTER_VERSION;
+}
@@ -70,7 +70,7 @@ void aprintf(std::string *buf, const char *format, ...) {
 	free(tmp);
 }
 
-void handle(std::string message, int z, unsigned x, unsigned y, std::map<std::string, layermap_entry> &layermap, std::vector<std::string> &header, std::map<std::string, std::vector<std::string>> &mapping, std::set<std::string> &exclude, std::set<std::string> &keep_layers, std::set<std::string> &remove_layers, int ifmatched, mvt_tile &outtile, json_object *filter) {
+void handle(std::string message, int z, unsigned x, unsigned y, std::map<std::string, layermap_entry> &layermap, std::vector<std::string> &header, std::map<std::string, std::vector<std::string>> &mapping, std::set<std::string> &exclude, std::set<std::string> &keep_layers, std::set<std::string> &remove_layers, int ifmatched, mvt_tile &outtile, compiled_filter const *filter) {
 	mvt_tile tile;
 	int features_added = 0;
 	bool was_compressed;
@@ -127,48 +127,32 @@ void handle(std::string message, int z, unsigned x, unsigned y, std::map<std::st
 
 		auto file_keys = layermap.find(layer.name);
 
+		// The filter slot for each of the layer's keys
+		std::vector<int> key_slots;
+		if (filter != NULL) {
+			for (size_t i = 0; i < layer.keys.size(); i++) {
+				key_slots.push_back(filter->slot(layer.keys[i]));
+			}
+		}
+
 		for (size_t f = 0; f < layer.features.size(); f++) {
 			mvt_feature feat = layer.features[f];
 			std::set<std::string> exclude_attributes;
 
 			if (filter != NULL) {
-				std::map<std::string, mvt_value> attributes;
+				filter_values values;
+				values.clear(*filter);
 
 				for (size_t t = 0; t + 1 < feat.tags.size(); t += 2) {
-					std::string key = layer.keys[feat.tags[t]];
-					mvt_value &val = layer.values[feat.tags[t + 1]];
-
-					attributes.insert(std::pair<std::string, mvt_value>(key, val));
-				}
-
-				if (feat.has_id) {
-					mvt_value v;
-					v.type = mvt_uint;
-					v.numeric_value.uint_value = feat.id;
-
-					attributes.insert(std::pair<std::string, mvt_value>("$id", v));
-				}
-
-				mvt_value v;
-				v.type = mvt_string;
-
-				if (feat.type == mvt_point) {
-					v.string_value = "Point";
-				} else if (feat.type == mvt_linestring) {
-					v.string_value = "LineString";
-				} else if (feat.type == mvt_polygon) {
-					v.string_value = "Polygon";
+					int slot = key_slots[feat.tags[t]];
+					if (values.wants(slot)) {
+						values.set_mvt(slot, layer.values[feat.tags[t + 1]]);
+					}
 				}
 
-				attributes.insert(std::pair<std::string, mvt_value>("$type", v));
-
-				mvt_value v2;
-				v2.type = mvt_uint;
-				v2.numeric_value.uint_value = z;
+				values.set_special(*filter, feat.has_id, feat.id, feat.type, z);
 
-				attributes.insert(std::pair<std::string, mvt_value>("$zoom", v2));
-
-				if (!evaluate(attributes, layer.name, filter, exclude_attributes)) {
+				if (!evaluate(*filter, values, layer.name, exclude_attributes)) {
 					continue;
 				}
 			}
@@ -480,7 +464,7 @@ struct arg {
 	std::set<std::string> *keep_layers = NULL;
 	std::set<std::string> *remove_layers = NULL;
 	int ifmatched = 0;
-	json_object *filter = NULL;
+	compiled_filter const *filter = NULL;
 };
 
 void *join_worker(void *v) {
@@ -525,7 +509,7 @@ void *join_worker(void *v) {
 	return NULL;
 }
 
-void handle_tasks(std::map<zxy, std::vector<std::string>> &tasks, std::vector<std::map<std::string, layermap_entry>> &layermaps, sqlite3 *outdb, const char *outdir, std::vector<std::string> &header, std::map<std::string, std::vector<std::string>> &mapping, std::set<std::string> &exclude, int ifmatched, std::set<std::string> &keep_layers, std::set<std::string> &remove_layers, json_object *filter) {
+void handle_tasks(std::map<zxy, std::vector<std::string>> &tasks, std::vector<std::map<std::string, layermap_entry>> &layermaps, sqlite3 *outdb, const char *outdir, std::vector<std::string> &header, std::map<std::string, std::vector<std::string>> &mapping, std::set<std::string> &exclude, int ifmatched, std::set<std::string> &keep_layers, std::set<std::string> &remove_layers, compiled_filter const *filter) {
 	pthread_t pthreads[CPUS];
 	std::vector<arg> args;
 
@@ -620,7 +604,7 @@ void handle_vector_layers(json_object *vector_layers, std::map<std::string, laye
 	}
 }
 
-void decode(struct reader *readers, std::map<std::string, layermap_entry> &layermap, sqlite3 *outdb, const char *outdir, struct stats *st, std::vector<std::string> &header, std::map<std::string, std::vector<std::string>> &mapping, std::set<std::string> &exclude, int ifmatched, std::string &attribution, std::string &description, std::set<std::string> &keep_layers, std::set<std::string> &remove_layers, std::string &name, json_object *filter, std::map<std::string, std::string> &attribute_descriptions, std::string &generator_options) {
+void decode(struct reader *readers, std::map<std::string, layermap_entry> &layermap, sqlite3 *outdb, const char *outdir, struct stats *st, std::vector<std::string> &header, std::map<std::string, std::vector<std::string>> &mapping, std::set<std::string> &exclude, int ifmatched, std::string &attribution, std::string &description, std::set<std::string> &keep_layers, std::set<std::string> &remove_layers, std::string &name, compiled_filter const *filter, std::map<std::string, std::string> &attribute_descriptions, std::string &generator_options) {
 	std::vector<std::map<std::string, layermap_entry>> layermaps;
 	for (size_t i = 0; i < CPUS; i++) {
 		layermaps.push_back(std::map<std::string, layermap_entry>());
@@ -1098,7 +1082,12 @@ int main(int argc, char **argv) {
 	std::map<std::string, std::string> attribute_descriptions;
 	std::string generator_options;
 
-	decode(readers, layermap, outdb, out_dir, &st, header, mapping, exclude, ifmatched, attribution, description, keep_layers, remove_layers, name, filter, attribute_descriptions, generator_options);
+	compiled_filter compiled;
+	if (filter != NULL) {
+		compiled = compile_filter(filter);
+	}
+
+	decode(readers, layermap, outdb, out_dir, &st, header, mapping, exclude, ifmatched, attribution, description, keep_layers, remove_layers, name, filter != NULL ? &compiled : NULL, attribute_descriptions, generator_options);
 
 	if (set_attribution.size() != 0) {
 		attribution = set_attribution;
@@ -9,6 +9,7 @@
 #include <vector>
 #include <map>
 #include <set>
+#include <unordered_map>
 #include <algorithm>
 #include <stdio.h>
 #include <stdlib.h>
@@ -95,6 +96,7 @@ struct coalesce {
 	double spacing = 0;
 	bool has_id = false;
 	unsigned long long id = 0;
+	unsigned long long fingerprint = 0;  // hash of everything that coalcmp() compares
 
 	bool operator<(const coalesce &o) const {
 		int cmp = coalindexcmp(this, &o);
@@ -188,6 +190,124 @@ int coalindexcmp(const struct coalesce *c1, const struct coalesce *c2) {
 	return cmp;
 }
 
+static unsigned long long fingerprint_string(unsigned long long h, const char *s) {
+	// FNV-1a, including the terminating null so that adjacent strings can't run together
+	for (; *s != '\0'; s++) {
+		h = (h ^ (unsigned char) *s) * 1099511628211ULL;
+	}
+	return h * 1099511628211ULL;
+}
+
+static unsigned long long fingerprint_value(unsigned long long h, unsigned long long v) {
+	return (h ^ v) * 1099511628211ULL;
+}
+
+// Features with different fingerprints can never be equal according to coalcmp(),
+// so most comparisons between features with different attributes can stop here.
+static unsigned long long coalesce_fingerprint(int type, bool has_id, unsigned long long id, std::vector<long long> const &keys, std::vector<long long> const &values, const char *stringpool, std::vector<std::string> const &full_keys, std::vector<serial_val> const &full_values) {
+	unsigned long long h = 14695981039346656037ULL;
+
+	h = fingerprint_value(h, type);
+	h = fingerprint_value(h, has_id);
+	if (has_id) {
+		h = fingerprint_value(h, id);
+	}
+
+	for (size_t i = 0; i < keys.size() && i < values.size(); i++) {
+		h = fingerprint_string(h, stringpool + keys[i] + 1);
+		h = fingerprint_value(h, stringpool[values[i]]);
+		h = fingerprint_string(h, stringpool + values[i] + 1);
+	}
+
+	h = fingerprint_value(h, full_keys.size());
+	for (size_t i = 0; i < full_keys.size(); i++) {
+		h = fingerprint_string(h, full_keys[i].c_str());
+		h = fingerprint_value(h, full_values[i].type);
+		h = fingerprint_string(h, full_values[i].s.c_str());
+	}
+
+	return h;
+}
+
+static bool coalesce_same(struct coalesce const &c1, struct coalesce const &c2) {
+	return c1.fingerprint == c2.fingerprint && coalcmp(&c1, &c2) == 0;
+}
+
+// Orders groups of features with the same attributes by those attributes
+struct coalesce_group_cmp {
+	std::vector<coalesce> const &features;
+	std::vector<std::vector<size_t>> const &groups;
+
+	coalesce_group_cmp(std::vector<coalesce> const &f, std::vector<std::vector<size_t>> const &g)
+	    : features(f), groups(g) {
+	}
+
+	bool operator()(size_t a, size_t b) const {
+		return coalcmp(&features[groups[a][0]], &features[groups[b][0]]) < 0;
+	}
+};
+
+// Orders features with the same attributes as coalindexcmp() does
+struct coalesce_member_cmp {
+	std::vector<coalesce> const &features;
+
+	coalesce_member_cmp(std::vector<coalesce> const &f)
+	    : features(f) {
+	}
+
+	bool operator()(size_t a, size_t b) const {
+		if (features[a].index != features[b].index) {
+			return features[a].index < features[b].index;
+		}
+		return features[a].geom < features[b].geom;
+	}
+};
+
+// Sort features into the same order as coalindexcmp(), but by first grouping
+// features with the same attributes through their fingerprints, so that
+// the full attribute comparison is only needed between the distinct groups
+static void sort_coalesce(std::vector<coalesce> &features) {
+	std::unordered_map<unsigned long long, std::vector<size_t>> by_fingerprint;
+	std::vector<std::vector<size_t>> groups;
+
+	for (size_t i = 0; i < features.size(); i++) {
+		std::vector<size_t> &candidates = by_fingerprint[features[i].fingerprint];
+
+		size_t j;
+		for (j = 0; j < candidates.size(); j++) {
+			if (coalcmp(&features[groups[candidates[j]][0]], &features[i]) == 0) {
+				groups[candidates[j]].push_back(i);
+				break;
+			}
+		}
+
+		if (j == candidates.size()) {
+			candidates.push_back(groups.size());
+			groups.push_back(std::vector<size_t>(1, i));
+		}
+	}
+
+	std::vector<size_t> group_order;
+	for (size_t i = 0; i < groups.size(); i++) {
+		group_order.push_back(i);
+	}
+	std::sort(group_order.begin(), group_order.end(), coalesce_group_cmp(features, groups));
+
+	std::vector<coalesce> out;
+	out.reserve(features.size());
+
+	for (size_t g : group_order) {
+		std::vector<size_t> &group = groups[g];
+		std::sort(group.begin(), group.end(), coalesce_member_cmp(features));
+
+		for (size_t i : group) {
+			out.push_back(std::move(features[i]));
+		}
+	}
+
+	features.swap(out);
+}
+
 mvt_value retrieve_string(long long off, char *stringpool, int *otype) {
 	int type = stringpool[off];
 	char *s = stringpool + off + 1;
@@ -199,27 +319,62 @@ mvt_value retrieve_string(long long off, char *stringpool, int *otype) {
 	return stringified_to_mvt_value(type, s);
 }
 
-void decode_meta(std::vector<long long> const &metakeys, std::vector<long long> const &metavals, char *stringpool, mvt_layer &layer, mvt_feature &feature) {
+// The indices in a layer's key and value tables of strings that have
+// already been tagged, by their address in the string pool. Strings at
+// the same address are the same string, so most tags can be interned
+// by address without building and comparing them.
+struct pool_tags {
+	std::unordered_map<const char *, size_t> keys{};
+	std::unordered_map<const char *, size_t> values{};
+};
+
+void decode_meta(std::vector<long long> const &metakeys, std::vector<long long> const &metavals, char *stringpool, mvt_layer &layer, mvt_feature &feature, pool_tags *tags) {
 	size_t i;
 	for (i = 0; i < metakeys.size(); i++) {
+		if (tags != NULL) {
+			auto ki = tags->keys.find(stringpool + metakeys[i]);
+			if (ki != tags->keys.end()) {
+				auto vi = tags->values.find(stringpool + metavals[i]);
+				if (vi != tags->values.end()) {
+					feature.tags.push_back(ki->second);
+					feature.tags.push_back(vi->second);
+					continue;
+				}
+			}
+		}
+
 		int otype;
 		mvt_value key = retrieve_string(metakeys[i], stringpool, NULL);
 		mvt_value value = retrieve_string(metavals[i], stringpool, &otype);
 
 		layer.tag(feature, key.string_value, value);
+
+		if (tags != NULL) {
+			tags->keys[stringpool + metakeys[i]] = feature.tags[feature.tags.size() - 2];
+			tags->values[stringpool + metavals[i]] = feature.tags[feature.tags.size() - 1];
+		}
 	}
 }
 
 static int metacmp(const std::vector<long long> &keys1, const std::vector<long long> &values1, char *stringpool1, const std::vector<long long> &keys2, const std::vector<long long> &values2, char *stringpool2) {
 	size_t i;
 	for (i = 0; i < keys1.size() && i < keys2.size(); i++) {
-		mvt_value key1 = retrieve_string(keys1[i], stringpool1, NULL);
-		mvt_value key2 = retrieve_string(keys2[i], stringpool2, NULL);
+		// Strings in the same place in the pool are the same string.
+		// Once the pools have been consolidated, this is true
+		// across input segments too.
+		if (stringpool1 + keys1[i] != stringpool2 + keys2[i]) {
+			mvt_value key1 = retrieve_string(keys1[i], stringpool1, NULL);
+			mvt_value key2 = retrieve_string(keys2[i], stringpool2, NULL);
+
+			if (key1.string_value < key2.string_value) {
+				return -1;
+			} else if (key1.string_value > key2.string_value) {
+				return 1;
+			}
+		}
 
-		if (key1.string_value < key2.string_value) {
-			return -1;
-		} else if (key1.string_value > key2.string_value) {
-			return 1;
+		if (stringpool1 + values1[i] == stringpool2 + values2[i]) {
+			continue;
 		}
 
 		long long off1 = values1[i];
@@ -438,6 +593,7 @@ drawvec revive_polygon(drawvec &geom, double area, int z, int detail) {
 void *partial_feature_worker(void *v) {
 	struct partial_arg *a = (struct partial_arg *) v;
 	std::vector<struct partial> *partials = a->partials;
+	trace_span span("partial_feature_worker", "\"task\":%d", a->task);
 
 	for (size_t i = a->task; i < (*partials).size(); i += a->tasks) {
 		drawvec geom;
@@ -569,67 +725,92 @@ static drawvec reverse_subring(drawvec const &dv) {
 	return out;
 }
 
-struct edge {
-	unsigned x1 = 0;
-	unsigned y1 = 0;
-	unsigned x2 = 0;
-	unsigned y2 = 0;
-	unsigned ring = 0;
+// An open-addressed hash table from each distinct polygon edge, with its
+// endpoints in draw order, to a sequential edge number
+struct edge_table {
+	struct slot {
+		unsigned x1 = 0;
+		unsigned y1 = 0;
+		unsigned x2 = 0;
+		unsigned y2 = 0;
+		size_t edge = 0;  // edge number + 1, or 0 for an empty slot
+	};
 
-	edge(unsigned _x1, unsigned _y1, unsigned _x2, unsigned _y2, unsigned _ring) {
-		x1 = _x1;
-		y1 = _y1;
-		x2 = _x2;
-		y2 = _y2;
-		ring = _ring;
-	}
+	std::vector<slot> slots;
+	size_t mask = 0;
+	size_t count = 0;
 
-	bool operator<(const edge &s) const {
-		long long cmp = (long long) y1 - s.y1;
-		if (cmp == 0) {
-			cmp = (long long) x1 - s.x1;
+	edge_table(size_t edges) {
+		size_t n = 16;
+		while (n < edges * 2) {
+			n *= 2;
 		}
-		if (cmp == 0) {
-			cmp = (long long) y2 - s.y2;
+
+		slots.resize(n);
+		mask = n - 1;
+	}
+
+	size_t hash(unsigned x1, unsigned y1, unsigned x2, unsigned y2) const {
+		unsigned long long h = (((unsigned long long) x1 << 32) | y1) * 0x9E3779B97F4A7C15ULL;
+		h ^= (((unsigned long long) x2 << 32) | y2) * 0xC2B2AE3D27D4EB4FULL;
+		return (h ^ (h >> 29)) & mask;
+	}
+
+	// The number of the edge, adding it if it is new
+	size_t insert(draw const &p1, draw const &p2) {
+		unsigned x1 = p1.x, y1 = p1.y, x2 = p2.x, y2 = p2.y;
+
+		size_t i;
+		for (i = hash(x1, y1, x2, y2); slots[i].edge != 0; i = (i + 1) & mask) {
+			if (slots[i].x1 == x1 && slots[i].y1 == y1 && slots[i].x2 == x2 && slots[i].y2 == y2) {
+				return slots[i].edge - 1;
+			}
 		}
-		if (cmp == 0) {
-			cmp = (long long) x2 - s.x2;
+
+		slots[i].x1 = x1;
+		slots[i].y1 = y1;
+		slots[i].x2 = x2;
+		slots[i].y2 = y2;
+		slots[i].edge = ++count;
+		return count - 1;
+	}
+
+	// The number of the edge, or -1 if it is not in the table
+	ssize_t find(draw const &p1, draw const &p2) const {
+		unsigned x1 = p1.x, y1 = p1.y, x2 = p2.x, y2 = p2.y;
+
+		for (size_t i = hash(x1, y1, x2, y2); slots[i].edge != 0; i = (i + 1) & mask) {
+			if (slots[i].x1 == x1 && slots[i].y1 == y1 && slots[i].x2 == x2 && slots[i].y2 == y2) {
+				return slots[i].edge - 1;
+			}
 		}
-		return cmp < 0;
+
+		return -1;
 	}
 };
 
-struct edgecmp_ring {
-	bool operator()(const edge &a, const edge &b) {
-		long long cmp = (long long) a.y1 - b.y1;
-		if (cmp == 0) {
-			cmp = (long long) a.x1 - b.x1;
-		}
-		if (cmp == 0) {
-			cmp = (long long) a.y2 - b.y2;
-		}
-		if (cmp == 0) {
-			cmp = (long long) a.x2 - b.x2;
-		}
-		if (cmp == 0) {
-			cmp = (long long) a.ring - b.ring;
+// Hash of the points of an arc, for looking up arcs that have been seen already
+struct arc_hash {
+	size_t operator()(drawvec const &dv) const {
+		unsigned long long h = 14695981039346656037ULL;
+		for (size_t i = 0; i < dv.size(); i++) {
+			h = (h ^ (unsigned long long) dv[i].x) * 1099511628211ULL;
+			h = (h ^ (unsigned long long) dv[i].y) * 1099511628211ULL;
 		}
-		return cmp < 0;
+		return h;
 	}
-} edgecmp_ring;
+};
 
-bool edges_same(std::pair<std::vector<edge>::iterator, std::vector<edge>::iterator> e1, std::pair<std::vector<edge>::iterator, std::vector<edge>::iterator> e2) {
-	if ((e2.second - e2.first) != (e1.second - e1.first)) {
+// Do two edges appear in exactly the same rings?
+static bool edges_same(std::vector<size_t> const &ring_start, std::vector<unsigned> const &rings, size_t e1, size_t e2) {
+	if (ring_start[e1 + 1] - ring_start[e1] != ring_start[e2 + 1] - ring_start[e2]) {
 		return false;
 	}
 
-	while (e1.first != e1.second) {
-		if (e1.first->ring != e2.first->ring) {
+	for (size_t i = 0; i < ring_start[e1 + 1] - ring_start[e1]; i++) {
+		if (rings[ring_start[e1] + i] != rings[ring_start[e2] + i]) {
 			return false;
 		}
-
-		++e1.first;
-		++e2.first;
 	}
 
 	return true;
@@ -661,35 +842,68 @@ bool find_common_edges(std::vector<partial> &partials, int z, int line_detail, d
 	// that each edge appears in. (The ring number is across all polygons;
 	// we don't need to look it back up, just to tell where it changes.)
 
-	std::vector<edge> edges;
+	size_t edge_count = 0;
+	for (size_t i = 0; i < partials.size(); i++) {
+		if (partials[i].t == VT_POLYGON) {
+			for (size_t j = 0; j < partials[i].geoms.size(); j++) {
+				edge_count += partials[i].geoms[j].size();
+			}
+		}
+	}
+
+	edge_table edges(edge_count);
+	std::vector<size_t> edge_uses;	// the edge number of each edge of each ring, in order
+	std::vector<unsigned> edge_rings;
+	edge_uses.reserve(edge_count);
+	edge_rings.reserve(edge_count);
+
 	size_t ring = 0;
 	for (size_t i = 0; i < partials.size(); i++) {
 		if (partials[i].t == VT_POLYGON) {
 			for (size_t j = 0; j < partials[i].geoms.size(); j++) {
-				for (size_t k = 0; k + 1 < partials[i].geoms[j].size(); k++) {
-					if (partials[i].geoms[j][k].op == VT_MOVETO) {
+				drawvec const &g = partials[i].geoms[j];
+
+				for (size_t k = 0; k + 1 < g.size(); k++) {
+					if (g[k].op == VT_MOVETO) {
 						ring++;
 					}
 
-					if (partials[i].geoms[j][k + 1].op == VT_LINETO) {
-						drawvec dv;
-						if (partials[i].geoms[j][k] < partials[i].geoms[j][k + 1]) {
-							dv.push_back(partials[i].geoms[j][k]);
-							dv.push_back(partials[i].geoms[j][k + 1]);
+					if (g[k + 1].op == VT_LINETO) {
+						if (g[k] < g[k + 1]) {
+							edge_uses.push_back(edges.insert(g[k], g[k + 1]));
 						} else {
-							dv.push_back(partials[i].geoms[j][k + 1]);
-							dv.push_back(partials[i].geoms[j][k]);
+							edge_uses.push_back(edges.insert(g[k + 1], g[k]));
 						}
-
-						edges.push_back(edge(dv[0].x, dv[0].y, dv[1].x, dv[1].y, ring));
+						edge_rings.push_back(ring);
 					}
 				}
 			}
 		}
 	}
 
-	std::sort(edges.begin(), edges.end(), edgecmp_ring);
-	std::set<draw> necessaries;
+	// Group the rings by edge. Rings were numbered in the order they were
+	// visited, so each edge's list of rings comes out sorted.
+
+	std::vector<size_t> ring_start(edges.count + 1, 0);
+	for (size_t i = 0; i < edge_uses.size(); i++) {
+		ring_start[edge_uses[i] + 1]++;
+	}
+	for (size_t i = 0; i < edges.count; i++) {
+		ring_start[i + 1] += ring_start[i];
+	}
+
+	std::vector<unsigned> rings(edge_uses.size());
+	{
+		std::vector<size_t> fill(ring_start.begin(), ring_start.end() - 1);
+		for (size_t i = 0; i < edge_uses.size(); i++) {
+			rings[fill[edge_uses[i]]++] = edge_rings[i];
+		}
+	}
+
+	edge_uses.clear();
+	edge_rings.clear();
+
+	std::vector<draw> necessaries;
 
 	// Now mark all the points where the set of rings using the edge on one side
 	// is not the same as the set of rings using the edge on the other side.
@@ -717,44 +931,23 @@ bool find_common_edges(std::vector<partial> &partials, int z, int line_detail, d
 						size_t s = b - a - 1;
 
 						if (s > 0) {
-							drawvec left;
-							if (g[a + (s - 1) % s] < g[a]) {
-								left.push_back(g[a + (s - 1) % s]);
-								left.push_back(g[a]);
-							} else {
-								left.push_back(g[a]);
-								left.push_back(g[a + (s - 1) % s]);
-							}
-							if (left[1] < left[0]) {
-								fprintf(stderr, "left misordered\n");
-							}
-							std::pair<std::vector<edge>::iterator, std::vector<edge>::iterator> e1 = std::equal_range(edges.begin(), edges.end(), edge(left[0].x, left[0].y, left[1].x, left[1].y, 0));
+							draw const &l1 = g[a + (s - 1) % s];
+							draw const &l2 = g[a];
+							ssize_t e1 = (l1 < l2) ? edges.find(l1, l2) : edges.find(l2, l1);
 
 							for (size_t k = 0; k < s; k++) {
-								drawvec right;
+								draw const &r1 = g[a + k];
+								draw const &r2 = g[a + k + 1];
+								ssize_t e2 = (r1 < r2) ? edges.find(r1, r2) : edges.find(r2, r1);
 
-								if (g[a + k] < g[a + k + 1]) {
-									right.push_back(g[a + k]);
-									right.push_back(g[a + k + 1]);
-								} else {
-									right.push_back(g[a + k + 1]);
-									right.push_back(g[a + k]);
-								}
-
-								std::pair<std::vector<edge>::iterator, std::vector<edge>::iterator> e2 = std::equal_range(edges.begin(), edges.end(), edge(right[0].x, right[0].y, right[1].x, right[1].y, 0));
-
-								if (right[1] < right[0]) {
-									fprintf(stderr, "left misordered\n");
-								}
-
-								if (e1.first == e1.second || e2.first == e2.second) {
-									fprintf(stderr, "Internal error: polygon edge lookup failed for %lld,%lld to %lld,%lld or %lld,%lld to %lld,%lld\n", left[0].x, left[0].y, left[1].x, left[1].y, right[0].x, right[0].y, right[1].x, right[1].y);
+								if (e1 < 0 || e2 < 0) {
+									fprintf(stderr, "Internal error: polygon edge lookup failed for %lld,%lld to %lld,%lld or %lld,%lld to %lld,%lld\n", (long long) l1.x, (long long) l1.y, (long long) l2.x, (long long) l2.y, (long long) r1.x, (long long) r1.y, (long long) r2.x, (long long) r2.y);
 									exit(EXIT_FAILURE);
 								}
 
-								if (!edges_same(e1, e2)) {
+								if (!edges_same(ring_start, rings, e1, e2)) {
 									g[a + k].necessary = 1;
-									necessaries.insert(g[a + k]);
+									necessaries.push_back(g[a + k]);
 								}
 
 								e1 = e2;
@@ -768,8 +961,10 @@ bool find_common_edges(std::vector<partial> &partials, int z, int line_detail, d
 		}
 	}
 
-	edges.clear();
-	std::map<drawvec, size_t> arcs;
+	std::sort(necessaries.begin(), necessaries.end());
+	necessaries.erase(std::unique(necessaries.begin(), necessaries.end()), necessaries.end());
+
+	std::unordered_map<drawvec, size_t, arc_hash> arcs;
 	std::multimap<ssize_t, size_t> merge_candidates;  // from arc to partial
 
 	// Roll rings that include a necessary point around so they start at one
@@ -780,7 +975,7 @@ bool find_common_edges(std::vector<partial> &partials, int z, int line_detail, d
 				drawvec &g = partials[i].geoms[j];
 
 				for (size_t k = 0; k < g.size(); k++) {
-					if (necessaries.count(g[k]) != 0) {
+					if (std::binary_search(necessaries.begin(), necessaries.end(), g[k])) {
 						g[k].necessary = 1;
 					}
 				}
@@ -1173,6 +1368,15 @@ long long choose_minextent(std::vector<long long> &extents, double f) {
 	return extents[(extents.size() - 1) * (1 - f)];
 }
 
+// Each tiling thread's state for evaluating the feature filter
+struct filter_context {
+	compiled_filter const *filter = NULL;
+	filter_values values{};
+
+	// For each string pool segment, the filter slot for each key's pool offset
+	std::vector<std::unordered_map<long long, int>> key_slots{};
+};
+
 struct write_tile_args {
 	struct task *tasks = NULL;
 	char *metabase = NULL;
@@ -1220,7 +1424,9 @@ struct write_tile_args {
 	bool still_dropping = false;
 	int wrote_zoom = 0;
 	size_t tiling_seg = 0;
-	struct json_object *filter = NULL;
+	double cpu_seconds = 0;	   // CPU time used by the thread, for --json-progress
+	std::string profile = "";  // --tile-profile records not yet written out
+	filter_context *filter = NULL;
 };
 
 bool clip_to_tile(serial_feature &sf, int z, long long buffer) {
@@ -1318,7 +1524,7 @@ void remove_attributes(serial_feature &sf, std::set<std::string> const &exclude_
 	}
 }
 
-serial_feature next_feature(FILE *geoms, std::atomic<long long> *geompos_in, char *metabase, long long *meta_off, int z, unsigned tx, unsigned ty, unsigned *initial_x, unsigned *initial_y, long long *original_features, long long *unclipped_features, int nextzoom, int maxzoom, int minzoom, int max_zoom_increment, size_t pass, size_t passes, std::atomic<long long> *along, long long alongminus, int buffer, int *within, bool *first_time, FILE **geomfile, std::atomic<long long> *geompos, std::atomic<double> *oprogress, double todo, const char *fname, int child_shards, struct json_object *filter, const char *stringpool, long long *pool_off, std::vector<std::vector<std::string>> *layer_unmaps) {
+serial_feature next_feature(FILE *geoms, std::atomic<long long> *geompos_in, char *metabase, long long *meta_off, int z, unsigned tx, unsigned ty, unsigned *initial_x, unsigned *initial_y, long long *original_features, long long *unclipped_features, int nextzoom, int maxzoom, int minzoom, int max_zoom_increment, size_t pass, size_t passes, std::atomic<long long> *along, long long alongminus, int buffer, int *within, bool *first_time, FILE **geomfile, std::atomic<long long> *geompos, std::atomic<double> *oprogress, double todo, const char *fname, int child_shards, filter_context *filter, const char *stringpool, long long *pool_off, std::vector<std::vector<std::string>> *layer_unmaps) {
 	while (1) {
 		serial_feature sf = deserialize_feature(geoms, geompos_in, metabase, meta_off, z, tx, ty, initial_x, initial_y);
 		if (sf.t < 0) {
@@ -1364,56 +1570,44 @@ serial_feature next_feature(FILE *geoms, std::atomic<long long> *geompos_in, cha
 		}
 
 		if (filter != NULL) {
-			std::map<std::string, mvt_value> attributes;
-			std::string layername = (*layer_unmaps)[sf.segment][sf.layer];
+			compiled_filter const &cf = *filter->filter;
+			filter_values &values = filter->values;
 			std::set<std::string> exclude_attributes;
 
-			for (size_t i = 0; i < sf.keys.size(); i++) {
-				std::string key = stringpool + pool_off[sf.segment] + sf.keys[i] + 1;
-
-				serial_val sv;
-				sv.type = (stringpool + pool_off[sf.segment])[sf.values[i]];
-				sv.s = stringpool + pool_off[sf.segment] + sf.values[i] + 1;
-
-				mvt_value val = stringified_to_mvt_value(sv.type, sv.s.c_str());
-				attributes.insert(std::pair<std::string, mvt_value>(key, val));
+			if ((size_t) sf.segment >= filter->key_slots.size()) {
+				filter->key_slots.resize(sf.segment + 1);
 			}
+			std::unordered_map<long long, int> &key_slots = filter->key_slots[sf.segment];
+			const char *pool = stringpool + pool_off[sf.segment];
 
-			for (size_t i = 0; i < sf.full_keys.size(); i++) {
-				std::string key = sf.full_keys[i];
-				mvt_value val = stringified_to_mvt_value(sf.full_values[i].type, sf.full_values[i].s.c_str());
-
-				attributes.insert(std::pair<std::string, mvt_value>(key, val));
-			}
+			values.clear(cf);
 
-			if (sf.has_id) {
-				mvt_value v;
-				v.type = mvt_uint;
-				v.numeric_value.uint_value = sf.id;
+			// Only the attributes that the filter looks at are decoded
+			for (size_t i = 0; i < sf.keys.size(); i++) {
+				int slot;
+				auto ks = key_slots.find(sf.keys[i]);
+				if (ks == key_slots.end()) {
+					slot = cf.slot(pool + sf.keys[i] + 1);
+					key_slots.insert(std::pair<long long, int>(sf.keys[i], slot));
+				} else {
+					slot = ks->second;
+				}
 
-				attributes.insert(std::pair<std::string, mvt_value>("$id", v));
+				if (values.wants(slot)) {
+					values.set_stringified(slot, pool[sf.values[i]], pool + sf.values[i] + 1);
+				}
 			}
 
-			mvt_value v;
-			v.type = mvt_string;
-
-			if (sf.t == mvt_point) {
-				v.string_value = "Point";
-			} else if (sf.t == mvt_linestring) {
-				v.string_value = "LineString";
-			} else if (sf.t == mvt_polygon) {
-				v.string_value = "Polygon";
+			for (size_t i = 0; i < sf.full_keys.size(); i++) {
+				int slot = cf.slot(sf.full_keys[i]);
+				if (values.wants(slot)) {
+					values.set_stringified(slot, sf.full_values[i].type, sf.full_values[i].s.c_str());
+				}
 			}
 
-			attributes.insert(std::pair<std::string, mvt_value>("$type", v));
-
-			mvt_value v2;
-			v2.type = mvt_uint;
-			v2.numeric_value.uint_value = z;
-
-			attributes.insert(std::pair<std::string, mvt_value>("$zoom", v2));
+			values.set_special(cf, sf.has_id, sf.id, sf.t, z);
 
-			if (!evaluate(attributes, layername, filter, exclude_attributes)) {
+			if (!evaluate(cf, values, (*layer_unmaps)[sf.segment][sf.layer], exclude_attributes)) {
 				continue;
 			}
 
@@ -1481,11 +1675,17 @@ struct run_prefilter_args {
 	char *stringpool = NULL;
 	long long *pool_off = NULL;
 	FILE *prefilter_fp = NULL;
-	struct json_object *filter = NULL;
+	bool framed = false;
+	filter_context *filter = NULL;
 };
 
 void *run_prefilter(void *v) {
 	run_prefilter_args *rpa = (run_prefilter_args *) v;
+
+	if (rpa->framed) {
+		write_filter_begin(rpa->prefilter_fp, rpa->z, rpa->tx, rpa->ty);
+	}
+
 	json_writer state(rpa->prefilter_fp);
 
 	while (1) {
@@ -1520,12 +1720,17 @@ void *run_prefilter(void *v) {
 			tmp_feature.geometry[i].y += sy;
 		}
 
-		decode_meta(sf.keys, sf.values, rpa->stringpool + rpa->pool_off[sf.segment], tmp_layer, tmp_feature);
+		decode_meta(sf.keys, sf.values, rpa->stringpool + rpa->pool_off[sf.segment], tmp_layer, tmp_feature, NULL);
 		tmp_layer.features.push_back(tmp_feature);
 
 		layer_to_geojson(tmp_layer, 0, 0, 0, false, true, false, true, sf.index, sf.seq, sf.extent, true, state);
 	}
 
+	if (rpa->framed) {
+		write_filter_end(rpa->prefilter_fp, rpa->z, rpa->tx, rpa->ty, "prefilter");
+		return NULL;
+	}
+
 	if (fclose(rpa->prefilter_fp) != 0) {
 		if (errno == EPIPE) {
 			static bool warned = false;
@@ -1562,11 +1767,7 @@ void add_tilestats(std::string const &layername, int z, std::vector<std::map<std
 		exit(EXIT_FAILURE);
 	}
 
-	type_and_string attrib;
-	attrib.type = val.type;
-	attrib.string = val.s;
-
-	add_to_file_keys(fk->second.file_keys, key, attrib);
+	add_to_file_keys(fk->second.file_keys, key, val.type, val.s);
 }
 
 void preserve_attribute(attribute_op op, serial_feature &, char *stringpool, long long *pool_off, std::string &key, serial_val &val, partial &p) {
@@ -1718,7 +1919,7 @@ static bool line_is_too_small(drawvec const &geometry, int z, int detail) {
 	return true;
 }
 
-long long write_tile(FILE *geoms, std::atomic<long long> *geompos_in, char *metabase, char *stringpool, int z, unsigned tx, unsigned ty, int detail, int min_detail, sqlite3 *outdb, const char *outdir, int buffer, const char *fname, FILE **geomfile, int minzoom, int maxzoom, double todo, std::atomic<long long> *along, long long alongminus, double gamma, int child_shards, long long *meta_off, long long *pool_off, unsigned *initial_x, unsigned *initial_y, std::atomic<int> *running, double simplification, std::vector<std::map<std::string, layermap_entry>> *layermaps, std::vector<std::vector<std::string>> *layer_unmaps, size_t tiling_seg, size_t pass, size_t passes, unsigned long long mingap, long long minextent, double fraction, const char *prefilter, const char *postfilter, struct json_object *filter, write_tile_args *arg) {
+long long write_tile(FILE *geoms, std::atomic<long long> *geompos_in, char *metabase, char *stringpool, int z, unsigned tx, unsigned ty, int detail, int min_detail, sqlite3 *outdb, const char *outdir, int buffer, const char *fname, FILE **geomfile, int minzoom, int maxzoom, double todo, std::atomic<long long> *along, long long alongminus, double gamma, int child_shards, long long *meta_off, long long *pool_off, unsigned *initial_x, unsigned *initial_y, std::atomic<int> *running, double simplification, std::vector<std::map<std::string, layermap_entry>> *layermaps, std::vector<std::vector<std::string>> *layer_unmaps, size_t tiling_seg, size_t pass, size_t passes, unsigned long long mingap, long long minextent, double fraction, const char *prefilter, const char *postfilter, write_tile_args *arg) {
 	int line_detail;
 	double merge_fraction = 1;
 	double mingap_fraction = 1;
@@ -1749,12 +1950,39 @@ long long write_tile(FILE *geoms, std::atomic<long long> *geompos_in, char *meta
 
 	bool has_polygons = false;
 
+	tile_profile tp;
+	bool timing = logger.json_enabled || logger.profile != NULL;
+
+	// Thresholds that an earlier tile at this zoom level had to raise also apply here
+	if (mingap > 0 && (additional[A_DROP_DENSEST_AS_NEEDED] || additional[A_COALESCE_DENSEST_AS_NEEDED] || additional[A_CLUSTER_DENSEST_AS_NEEDED])) {
+		tp.strategies |= STRATEGY_DENSEST;
+	}
+	if (minextent > 0 && (additional[A_DROP_SMALLEST_AS_NEEDED] || additional[A_COALESCE_SMALLEST_AS_NEEDED])) {
+		tp.strategies |= STRATEGY_SMALLEST;
+	}
+	if (fraction < 1) {
+		tp.strategies |= STRATEGY_FRACTION;
+	}
+
+	trace_span span("write_tile", "\"z\":%d,\"x\":%u,\"y\":%u,\"pass\":%zu", z, tx, ty, pass);
 	bool first_time = true;
 	// This only loops if the tile data didn't fit, in which case the detail
 	// goes down and the progress indicator goes backward for the next try.
 	for (line_detail = detail; line_detail >= min_detail || line_detail == detail; line_detail--, oprogress = 0) {
 		long long count = 0;
 		double accum_area = 0;
+		trace_span iteration("iteration", "\"detail\":%d", line_detail);
+
+		if (!first_time) {
+			logger.retries++;
+			if (line_detail < tp.detail) {
+				tp.strategies |= STRATEGY_DETAIL;
+			}
+		}
+		tp.iterations++;
+		tp.detail = line_detail;
+		tp.features_read = 0;
+		tp.vertices_read = 0;
 
 		double fraction_accum = 0;
 
@@ -1795,6 +2023,8 @@ long long write_tile(FILE *geoms, std::atomic<long long> *geompos_in, char *meta
 		run_prefilter_args rpa;  // here so it stays in scope until joined
 		FILE *prefilter_read_fp = NULL;
 		json_pull *prefilter_jp = NULL;
+		filter_worker *prefilter_worker = NULL;
+		trace_span prefilter_span;
 
 		if (z < minzoom) {
 			prefilter = NULL;
@@ -1802,11 +2032,17 @@ long long write_tile(FILE *geoms, std::atomic<long long> *geompos_in, char *meta
 		}
 
 		if (prefilter != NULL) {
-			setup_filter(prefilter, &prefilter_write, &prefilter_read, &prefilter_pid, z, tx, ty);
-			prefilter_fp = fdopen(prefilter_write, "w");
-			if (prefilter_fp == NULL) {
-				perror("freopen prefilter");
-				exit(EXIT_FAILURE);
+			prefilter_span.begin("prefilter");
+			if (additional[A_PERSISTENT_FILTERS]) {
+				prefilter_worker = acquire_filter_worker(prefilter, false);
+				prefilter_fp = prefilter_worker->write_to;
+			} else {
+				setup_filter(prefilter, &prefilter_write, &prefilter_read, &prefilter_pid, z, tx, ty);
+				prefilter_fp = fdopen(prefilter_write, "w");
+				if (prefilter_fp == NULL) {
+					perror("freopen prefilter");
+					exit(EXIT_FAILURE);
+				}
 			}
 
 			rpa.geoms = geoms;
@@ -1838,22 +2074,27 @@ long long write_tile(FILE *geoms, std::atomic<long long> *geompos_in, char *meta
 			rpa.fname = fname;
 			rpa.child_shards = child_shards;
 			rpa.prefilter_fp = prefilter_fp;
+			rpa.framed = prefilter_worker != NULL;
 			rpa.layer_unmaps = layer_unmaps;
 			rpa.stringpool = stringpool;
 			rpa.pool_off = pool_off;
-			rpa.filter = filter;
+			rpa.filter = arg->filter;
 
 			if (pthread_create(&prefilter_writer, NULL, run_prefilter, &rpa) != 0) {
 				perror("pthread_create (prefilter writer)");
 				exit(EXIT_FAILURE);
 			}
 
-			prefilter_read_fp = fdopen(prefilter_read, "r");
-			if (prefilter_read_fp == NULL) {
-				perror("fdopen prefilter output");
-				exit(EXIT_FAILURE);
+			if (prefilter_worker != NULL) {
+				prefilter_jp = prefilter_worker->jp;
+			} else {
+				prefilter_read_fp = fdopen(prefilter_read, "r");
+				if (prefilter_read_fp == NULL) {
+					perror("fdopen prefilter output");
+					exit(EXIT_FAILURE);
+				}
+				prefilter_jp = json_begin_file(prefilter_read_fp);
 			}
-			prefilter_jp = json_begin_file(prefilter_read_fp);
 		}
 
 		while (1) {
@@ -1861,14 +2102,31 @@ long long write_tile(FILE *geoms, std::atomic<long long> *geompos_in, char *meta
 			ssize_t which_partial = -1;
 
 			if (prefilter == NULL) {
-				sf = next_feature(geoms, geompos_in, metabase, meta_off, z, tx, ty, initial_x, initial_y, &original_features, &unclipped_features, nextzoom, maxzoom, minzoom, max_zoom_increment, pass, passes, along, alongminus, buffer, within, &first_time, geomfile, geompos, &oprogress, todo, fname, child_shards, filter, stringpool, pool_off, layer_unmaps);
+				sf = next_feature(geoms, geompos_in, metabase, meta_off, z, tx, ty, initial_x, initial_y, &original_features, &unclipped_features, nextzoom, maxzoom, minzoom, max_zoom_increment, pass, passes, along, alongminus, buffer, within, &first_time, geomfile, geompos, &oprogress, todo, fname, child_shards, arg->filter, stringpool, pool_off, layer_unmaps);
 			} else {
-				sf = parse_feature(prefilter_jp, z, tx, ty, layermaps, tiling_seg, layer_unmaps, postfilter != NULL);
+				sf = parse_feature(prefilter_jp, z, tx, ty, layermaps, tiling_seg, layer_unmaps, postfilter != NULL, prefilter_worker != NULL);
 			}
 
 			if (sf.t < 0) {
 				break;
 			}
+			tp.features_read++;
+			tp.vertices_read += sf.geometry.size();
+
+			if (filter_plugin_loaded()) {
+				std::string layername = (*layer_unmaps)[sf.segment][sf.layer];
+				std::set<std::string> changed;
+
+				if (!plugin_filter_feature(sf, z, tx, ty, stringpool, pool_off, layername, changed)) {
+					continue;
+				}
+
+				for (size_t i = 0; i < sf.full_keys.size(); i++) {
+					if (changed.count(sf.full_keys[i]) > 0) {
+						add_tilestats(layername, z, layermaps, tiling_seg, layer_unmaps, sf.full_keys[i], sf.full_values[i]);
+					}
+				}
+			}
 
 			if (sf.dropped) {
 				if (find_partial(partials, sf, which_partial, layer_unmaps)) {
@@ -2065,7 +2323,14 @@ long long write_tile(FILE *geoms, std::atomic<long long> *geompos_in, char *meta
 			}
 		}
 
-		if (prefilter != NULL) {
+		if (prefilter_worker != NULL) {
+			void *ret;
+			if (pthread_join(prefilter_writer, &ret) != 0) {
+				perror("pthread_join prefilter writer");
+				exit(EXIT_FAILURE);
+			}
+			release_filter_worker(prefilter_worker);
+		} else if (prefilter != NULL) {
 			json_end(prefilter_jp);
 			if (fclose(prefilter_read_fp) != 0) {
 				perror("close output from prefilter");
@@ -2087,6 +2352,7 @@ long long write_tile(FILE *geoms, std::atomic<long long> *geompos_in, char *meta
 				exit(EXIT_FAILURE);
 			}
 		}
+		prefilter_span.end();
 
 		first_time = false;
 		bool merge_successful = true;
@@ -2133,6 +2399,10 @@ long long write_tile(FILE *geoms, std::atomic<long long> *geompos_in, char *meta
 			std::vector<drawvec> &pgeoms = partials[i].geoms;
 			signed char t = partials[i].t;
 			long long original_seq = partials[i].original_seq;
+			unsigned long long fingerprint = 0;
+			if (additional[A_COALESCE] || additional[A_REORDER]) {
+				fingerprint = coalesce_fingerprint(t, partials[i].has_id, partials[i].id, partials[i].keys, partials[i].values, stringpool + pool_off[partials[i].segment], partials[i].full_keys, partials[i].full_values);
+			}
 
 			// A complex polygon may have been split up into multiple geometries.
 			// Break them out into multiple features if necessary.
@@ -2154,6 +2424,7 @@ long long write_tile(FILE *geoms, std::atomic<long long> *geompos_in, char *meta
 					c.spacing = partials[i].spacing;
 					c.id = partials[i].id;
 					c.has_id = partials[i].has_id;
+					c.fingerprint = fingerprint;
 
 					// printf("segment %d layer %lld is %s\n", partials[i].segment, partials[i].layer, (*layer_unmaps)[partials[i].segment][partials[i].layer].c_str());
 
@@ -2188,7 +2459,7 @@ long long write_tile(FILE *geoms, std::atomic<long long> *geompos_in, char *meta
 			std::vector<coalesce> &layer_features = layer_iterator->second;
 
 			if (additional[A_REORDER]) {
-				std::sort(layer_features.begin(), layer_features.end());
+				sort_coalesce(layer_features);
 			}
 
 			std::vector<coalesce> out;
@@ -2204,7 +2475,7 @@ long long write_tile(FILE *geoms, std::atomic<long long> *geompos_in, char *meta
 				}
 #endif
 
-				if (additional[A_COALESCE] && out.size() > 0 && coalcmp(&layer_features[x], &out[y]) == 0) {
+				if (additional[A_COALESCE] && out.size() > 0 && coalesce_same(layer_features[x], out[y])) {
 					for (size_t g = 0; g < layer_features[x].geom.size(); g++) {
 						out[y].geom.push_back(layer_features[x].geom[g]);
 					}
@@ -2252,6 +2523,7 @@ long long write_tile(FILE *geoms, std::atomic<long long> *geompos_in, char *meta
 			layer.name = layer_iterator->first;
 			layer.version = 2;
 			layer.extent = 1 << line_detail;
+			pool_tags tags;
 
 			for (size_t x = 0; x < layer_features.size(); x++) {
 				mvt_feature feature;
@@ -2272,7 +2544,7 @@ long long write_tile(FILE *geoms, std::atomic<long long> *geompos_in, char *meta
 				feature.id = layer_features[x].id;
 				feature.has_id = layer_features[x].has_id;
 
-				decode_meta(layer_features[x].keys, layer_features[x].values, layer_features[x].stringpool, layer, feature);
+				decode_meta(layer_features[x].keys, layer_features[x].values, layer_features[x].stringpool, layer, feature, &tags);
 				for (size_t a = 0; a < layer_features[x].full_keys.size(); a++) {
 					serial_val sv = layer_features[x].full_values[a];
 					mvt_value v = stringified_to_mvt_value(sv.type, sv.s.c_str());
@@ -2309,6 +2581,7 @@ long long write_tile(FILE *geoms, std::atomic<long long> *geompos_in, char *meta
 		}
 
 		if (postfilter != NULL) {
+			trace_span postfilter_span("postfilter");
 			tile.layers = filter_layers(postfilter, tile.layers, z, tx, ty, layermaps, tiling_seg, layer_unmaps, 1 << line_detail);
 		}
 
@@ -2342,6 +2615,7 @@ long long write_tile(FILE *geoms, std::atomic<long long> *geompos_in, char *meta
 
 				if (has_polygons && additional[A_MERGE_POLYGONS_AS_NEEDED] && merge_fraction > .05 && merge_successful) {
 					merge_fraction = merge_fraction * max_tile_features / tile.layers.size() * 0.95;
+					tp.strategies |= STRATEGY_MERGE_POLYGONS;
 					if (!quiet) {
 						fprintf(stderr, "Going to try merging %0.2f%% of the polygons to make it fit\n", 100 - merge_fraction * 100);
 					}
@@ -2359,6 +2633,7 @@ long long write_tile(FILE *geoms, std::atomic<long long> *geompos_in, char *meta
 						arg->still_dropping = true;
 					}
 
+					tp.strategies |= STRATEGY_GAMMA;
 					if (!quiet) {
 						fprintf(stderr, "Going to try gamma of %0.3f to make it fit\n", gamma);
 					}
@@ -2379,6 +2654,7 @@ long long write_tile(FILE *geoms, std::atomic<long long> *geompos_in, char *meta
 						arg->mingap_out = mingap;
 						arg->still_dropping = true;
 					}
+					tp.strategies |= STRATEGY_DENSEST;
 					if (!quiet) {
 						fprintf(stderr, "Going to try keeping the sparsest %0.2f%% of the features to make it fit\n", mingap_fraction * 100.0);
 					}
@@ -2393,6 +2669,7 @@ long long write_tile(FILE *geoms, std::atomic<long long> *geompos_in, char *meta
 							arg->minextent_out = minextent;
 							arg->still_dropping = true;
 						}
+						tp.strategies |= STRATEGY_SMALLEST;
 						if (!quiet) {
 							fprintf(stderr, "Going to try keeping the biggest %0.2f%% of the features to make it fit\n", minextent_fraction * 100.0);
 						}
@@ -2404,6 +2681,7 @@ long long write_tile(FILE *geoms, std::atomic<long long> *geompos_in, char *meta
 					// and probably actually varies based on how much duplicated metadata there is
 
 					fraction = fraction * max_tile_features / totalsize * 0.95;
+					tp.strategies |= STRATEGY_FRACTION;
 					if (!quiet) {
 						fprintf(stderr, "Going to try keeping %0.2f%% of the features to make it fit\n", fraction * 100);
 					}
@@ -2422,10 +2700,20 @@ long long write_tile(FILE *geoms, std::atomic<long long> *geompos_in, char *meta
 			}
 
 			std::string compressed;
+			double encode_start = timing ? json_logger_now() : 0;
 			std::string pbf = tile.encode();
+			if (timing) {
+				tp.encode_seconds += json_logger_now() - encode_start;
+			}
 
 			if (!prevent[P_TILE_COMPRESSION]) {
+				double compress_start = timing ? json_logger_now() : 0;
 				compress(pbf, compressed);
+				if (timing) {
+					double compress_time = json_logger_now() - compress_start;
+					tp.compress_seconds += compress_time;
+					logger.compress_ns += compress_time * 1e9;
+				}
 			} else {
 				compressed = pbf;
 			}
@@ -2437,6 +2725,7 @@ long long write_tile(FILE *geoms, std::atomic<long long> *geompos_in, char *meta
 
 				if (has_polygons && additional[A_MERGE_POLYGONS_AS_NEEDED] && merge_fraction > .05 && merge_successful) {
 					merge_fraction = merge_fraction * max_tile_size / compressed.size() * 0.95;
+					tp.strategies |= STRATEGY_MERGE_POLYGONS;
 					if (!quiet) {
 						fprintf(stderr, "Going to try merging %0.2f%% of the polygons to make it fit\n", 100 - merge_fraction * 100);
 					}
@@ -2453,6 +2742,7 @@ long long write_tile(FILE *geoms, std::atomic<long long> *geompos_in, char *meta
 						arg->still_dropping = true;
 					}
 
+					tp.strategies |= STRATEGY_GAMMA;
 					if (!quiet) {
 						fprintf(stderr, "Going to try gamma of %0.3f to make it fit\n", gamma);
 					}
@@ -2478,6 +2768,7 @@ long long write_tile(FILE *geoms, std::atomic<long long> *geompos_in, char *meta
 						arg->mingap_out = mingap;
 						arg->still_dropping = true;
 					}
+					tp.strategies |= STRATEGY_DENSEST;
 					if (!quiet) {
 						fprintf(stderr, "Going to try keeping the sparsest %0.2f%% of the features to make it fit\n", mingap_fraction * 100.0);
 					}
@@ -2491,6 +2782,7 @@ long long write_tile(FILE *geoms, std::atomic<long long> *geompos_in, char *meta
 							arg->minextent_out = minextent;
 							arg->still_dropping = true;
 						}
+						tp.strategies |= STRATEGY_SMALLEST;
 						if (!quiet) {
 							fprintf(stderr, "Going to try keeping the biggest %0.2f%% of the features to make it fit\n", minextent_fraction * 100.0);
 						}
@@ -2502,6 +2794,7 @@ long long write_tile(FILE *geoms, std::atomic<long long> *geompos_in, char *meta
 					// and probably actually varies based on how much duplicated metadata there is
 
 					fraction = fraction * max_tile_size / compressed.size() * 0.95;
+					tp.strategies |= STRATEGY_FRACTION;
 					if (!quiet) {
 						fprintf(stderr, "Going to try keeping %0.2f%% of the features to make it fit\n", fraction * 100);
 					}
@@ -2515,21 +2808,42 @@ long long write_tile(FILE *geoms, std::atomic<long long> *geompos_in, char *meta
 				}
 			} else {
 				if (pass == 1) {
+					double wait_start = logger.json_enabled ? json_logger_now() : 0;
 					if (pthread_mutex_lock(&db_lock) != 0) {
 						perror("pthread_mutex_lock");
 						exit(EXIT_FAILURE);
 					}
+					if (logger.json_enabled) {
+						logger.write_wait_ns += (json_logger_now() - wait_start) * 1e9;
+					}
+					logger.tiles++;
+					logger.tile_bytes += compressed.size();
 
+					trace_span write_span("write", "\"bytes\":%zu", compressed.size());
 					if (outdb != NULL) {
 						mbtiles_write_tile(outdb, z, tx, ty, compressed.data(), compressed.size());
 					} else if (outdir != NULL) {
 						dir_write_tile(outdir, z, tx, ty, compressed);
 					}
+					write_span.end();
 
 					if (pthread_mutex_unlock(&db_lock) != 0) {
 						perror("pthread_mutex_unlock");
 						exit(EXIT_FAILURE);
 					}
+
+					// Outside the lock, since it may have to write out the thread's profile buffer
+					if (logger.profile != NULL) {
+						tp.z = z;
+						tp.x = tx;
+						tp.y = ty;
+						tp.vertices_kept = count;
+						tp.bytes = compressed.size();
+						for (auto const &l : tile.layers) {
+							tp.features_kept += l.features.size();
+						}
+						logger.profile_tile(arg->profile, tp);
+					}
 				}
 
 				return count;
@@ -2551,6 +2865,8 @@ struct task {
 void *run_thread(void *vargs) {
 	write_tile_args *arg = (write_tile_args *) vargs;
 	struct task *task;
+	double cpu_start = json_logger_thread_cpu();
+	trace_span span("run_thread", "\"pass\":%zu", arg->pass);
 
 	for (task = arg->tasks; task != NULL; task = task->next) {
 		int j = task->fileno;
@@ -2588,11 +2904,13 @@ void *run_thread(void *vargs) {
 
 			// fprintf(stderr, "%d/%u/%u\n", z, x, y);
 
-			long long len = write_tile(geom, &geompos, arg->metabase, arg->stringpool, z, x, y, z == arg->maxzoom ? arg->full_detail : arg->low_detail, arg->min_detail, arg->outdb, arg->outdir, arg->buffer, arg->fname, arg->geomfile, arg->minzoom, arg->maxzoom, arg->todo, arg->along, geompos, arg->gamma, arg->child_shards, arg->meta_off, arg->pool_off, arg->initial_x, arg->initial_y, arg->running, arg->simplification, arg->layermaps, arg->layer_unmaps, arg->tiling_seg, arg->pass, arg->passes, arg->mingap, arg->minextent, arg->fraction, arg->prefilter, arg->postfilter, arg->filter, arg);
+			long long len = write_tile(geom, &geompos, arg->metabase, arg->stringpool, z, x, y, z == arg->maxzoom ? arg->full_detail : arg->low_detail, arg->min_detail, arg->outdb, arg->outdir, arg->buffer, arg->fname, arg->geomfile, arg->minzoom, arg->maxzoom, arg->todo, arg->along, geompos, arg->gamma, arg->child_shards, arg->meta_off, arg->pool_off, arg->initial_x, arg->initial_y, arg->running, arg->simplification, arg->layermaps, arg->layer_unmaps, arg->tiling_seg, arg->pass, arg->passes, arg->mingap, arg->minextent, arg->fraction, arg->prefilter, arg->postfilter, arg);
 
 			if (len < 0) {
 				int *err = &arg->err;
 				*err = z - 1;
+				arg->cpu_seconds = json_logger_thread_cpu() - cpu_start;
+				logger.flush_profile(arg->profile);
 				return err;
 			}
 
@@ -2650,10 +2968,12 @@ void *run_thread(void *vargs) {
 	}
 
 	arg->running--;
+	arg->cpu_seconds = json_logger_thread_cpu() - cpu_start;
+	logger.flush_profile(arg->profile);
 	return NULL;
 }
 
-int traverse_zooms(int *geomfd, off_t *geom_size, char *metabase, char *stringpool, std::atomic<unsigned> *midx, std::atomic<unsigned> *midy, int &maxzoom, int minzoom, sqlite3 *outdb, const char *outdir, int buffer, const char *fname, const char *tmpdir, double gamma, int full_detail, int low_detail, int min_detail, long long *meta_off, long long *pool_off, unsigned *initial_x, unsigned *initial_y, double simplification, std::vector<std::map<std::string, layermap_entry>> &layermaps, const char *prefilter, const char *postfilter, std::map<std::string, attribute_op> const *attribute_accum, struct json_object *filter) {
+int traverse_zooms(int *geomfd, off_t *geom_size, char *metabase, char *stringpool, std::atomic<unsigned> *midx, std::atomic<unsigned> *midy, int &maxzoom, int minzoom, sqlite3 *outdb, const char *outdir, int buffer, const char *fname, const char *tmpdir, double gamma, int full_detail, int low_detail, int min_detail, long long *meta_off, long long *pool_off, unsigned *initial_x, unsigned *initial_y, double simplification, std::vector<std::map<std::string, layermap_entry>> &layermaps, const char *prefilter, const char *postfilter, std::map<std::string, attribute_op> const *attribute_accum, compiled_filter const *filter) {
 	last_progress = 0;
 
 	// The existing layermaps are one table per input thread.
@@ -2677,9 +2997,13 @@ int traverse_zooms(int *geomfd, off_t *geom_size, char *metabase, char *stringpo
 		}
 	}
 
+	std::vector<filter_context> filter_contexts;
+
 	int i;
 	for (i = 0; i <= maxzoom; i++) {
 		std::atomic<long long> most(0);
+		double zoom_start = json_logger_now();
+		double zoom_cpu = 0;
 
 		FILE *sub[TEMP_FILES];
 		int subfd[TEMP_FILES];
@@ -2708,6 +3032,7 @@ int traverse_zooms(int *geomfd, off_t *geom_size, char *metabase, char *stringpo
 				useful_threads++;
 			}
 		}
+		long long temp_read = 0;
 
 		size_t threads = CPUS;
 		if (threads > TEMP_FILES / 4) {
@@ -2798,8 +3123,12 @@ int traverse_zooms(int *geomfd, off_t *geom_size, char *metabase, char *stringpo
 			pthread_t pthreads[threads];
 			std::vector<write_tile_args> args;
 			args.resize(threads);
+			if (filter != NULL && filter_contexts.size() < threads) {
+				filter_contexts.resize(threads);
+			}
 			std::atomic<int> running(threads);
 			std::atomic<long long> along(0);
+			temp_read += todo;
 
 			for (size_t thread = 0; thread < threads; thread++) {
 				args[thread].metabase = metabase;
@@ -2842,7 +3171,10 @@ int traverse_zooms(int *geomfd, off_t *geom_size, char *metabase, char *stringpo
 				args[thread].prefilter = prefilter;
 				args[thread].postfilter = postfilter;
 				args[thread].attribute_accum = attribute_accum;
-				args[thread].filter = filter;
+				if (filter != NULL) {
+					filter_contexts[thread].filter = filter;
+					args[thread].filter = &filter_contexts[thread];
+				}
 
 				args[thread].tasks = dispatches[thread].tasks;
 				args[thread].running = &running;
@@ -2867,6 +3199,7 @@ int traverse_zooms(int *geomfd, off_t *geom_size, char *metabase, char *stringpo
 				if (retval != NULL) {
 					err = *((int *) retval);
 				}
+				zoom_cpu += args[thread].cpu_seconds;
 
 				if (args[thread].gamma_out > zoom_gamma) {
 					zoom_gamma = args[thread].gamma_out;
@@ -2915,11 +3248,20 @@ int traverse_zooms(int *geomfd, off_t *geom_size, char *metabase, char *stringpo
 			geom_size[j] = geomst.st_size;
 		}
 
+		long long temp_written = 0;
+		for (size_t j = 0; j < TEMP_FILES; j++) {
+			temp_written += geom_size[j];
+		}
+		logger.zoom(i, json_logger_now() - zoom_start, zoom_cpu, threads, temp_read, temp_written);
+
 		if (err != INT_MAX) {
+			close_filter_workers();
 			return err;
 		}
 	}
 
+	close_filter_workers();
+
 	for (size_t j = 0; j < TEMP_FILES; j++) {
 		// Can be < 0 if there is only one source file, at z0
 		if (geomfd[j] >= 0) {